@@ -24,6 +24,12 @@ atomic_add(volatile int *ptr, int incr)
   return __sync_fetch_and_add(ptr, incr);
 }
 
+static inline size_t
+atomic_add_size(volatile size_t *ptr, size_t incr)
+{
+  return __sync_fetch_and_add(ptr, incr);
+}
+
 static inline int
 atomic_exchange(volatile int *ptr, int new)
 {
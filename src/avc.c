@@ -180,7 +180,7 @@ isom_write_avcc(sbuf_t *sb, const uint8_t *data, int len)
 th_pkt_t *
 avc_convert_pkt(th_pkt_t *src)
 {
-  th_pkt_t *pkt = malloc(sizeof(th_pkt_t));
+  th_pkt_t *pkt = pkt_alloc(NULL, 0, 0, 0);
   *pkt = *src;
   pkt->pkt_refcount = 1;
   pkt->pkt_header = NULL;
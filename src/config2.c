@@ -74,3 +74,22 @@ int config_set_muxconfpath ( const char *path )
   }
   return 0;
 }
+
+int config_get_descrambler_threads ( void )
+{
+  uint32_t u32;
+  if (htsmsg_get_u32(config, "descrambler_threads", &u32))
+    return 0;
+  return u32;
+}
+
+int config_set_descrambler_threads ( int n )
+{
+  if (n < 0) n = 0;
+  if (n != config_get_descrambler_threads()) {
+    htsmsg_delete_field(config, "descrambler_threads");
+    htsmsg_add_u32(config, "descrambler_threads", n);
+    return 1;
+  }
+  return 0;
+}
@@ -39,12 +39,7 @@
 #include "dtable.h"
 #include "subscriptions.h"
 #include "service.h"
-
-#if ENABLE_DVBCSA
-#include <dvbcsa/dvbcsa.h>
-#else
-#include "ffdecsa/FFdecsa.h"
-#endif
+#include "tvhcsa.h"
 
 /**
  *
@@ -152,7 +147,7 @@ typedef struct cwc_service {
   int cs_okchannel;
 
   /**
-   * Status of the key(s) in cs_keys
+   * Status of the key(s) in cs_csa
    */
   enum {
     CS_UNKNOWN,
@@ -161,28 +156,10 @@ typedef struct cwc_service {
     CS_IDLE
   } cs_keystate;
 
-#if ENABLE_DVBCSA
-  struct dvbcsa_bs_key_s *cs_key_even;
-  struct dvbcsa_bs_key_s *cs_key_odd;
-#else
-  void *cs_keys;
-#endif
-
-  uint8_t cs_cw[16];
-  int cs_pending_cw_update;
-
   /**
    * CSA
    */
-  int cs_cluster_size;
-  uint8_t *cs_tsbcluster;
-  int cs_fill;
-#if ENABLE_DVBCSA
-  struct dvbcsa_bs_batch_s *cs_tsbbatch_even;
-  struct dvbcsa_bs_batch_s *cs_tsbbatch_odd;
-  int cs_fill_even;
-  int cs_fill_odd;
-#endif
+  tvhcsa_t *cs_csa;
 
   LIST_HEAD(, ecm_pid) cs_pids;
 
@@ -763,6 +740,19 @@ cwc_send_login(cwc_t *cwc)
 }
 
 
+/**
+ * A control word of all zeroes means that half was not sent
+ */
+static int
+cwc_cw_valid(const uint8_t *cw)
+{
+  int i;
+  for(i = 0; i < 8; i++)
+    if(cw[i])
+      return 1;
+  return 0;
+}
+
 
 static void
 handle_ecm_reply(cwc_service_t *ct, ecm_section_t *es, uint8_t *msg,
@@ -880,8 +870,9 @@ forbid:
 	     ct->cs_cwc->cwc_port);
 
     ct->cs_keystate = CS_RESOLVED;
-    memcpy(ct->cs_cw, msg + 3, 16);
-    ct->cs_pending_cw_update = 1;
+    tvhcsa_set_cw(ct->cs_csa,
+                  cwc_cw_valid(msg + 3)  ? msg + 3  : NULL,
+                  cwc_cw_valid(msg + 11) ? msg + 11 : NULL);
 
     ep = LIST_FIRST(&ct->cs_pids);
     while(ep != NULL) {
@@ -1893,138 +1884,11 @@ cwc_emm_bulcrypt(cwc_t *cwc, uint8_t *data, int len)
 /**
  *
  */
-static void
-update_keys(cwc_service_t *ct)
-{
-  int i;
-  ct->cs_pending_cw_update = 0;
-  for(i = 0; i < 8; i++)
-    if(ct->cs_cw[i]) {
-#if ENABLE_DVBCSA
-      dvbcsa_bs_key_set(ct->cs_cw, ct->cs_key_even);
-#else
-      set_even_control_word(ct->cs_keys, ct->cs_cw);
-#endif
-      break;
-    }
-  
-  for(i = 0; i < 8; i++)
-    if(ct->cs_cw[8 + i]) {
-#if ENABLE_DVBCSA
-      dvbcsa_bs_key_set(ct->cs_cw + 8, ct->cs_key_odd);
-#else
-      set_odd_control_word(ct->cs_keys, ct->cs_cw + 8);
-#endif
-      break;
-    }
-}
-
-
-/**
- *
- */
-#if ENABLE_DVBCSA
-static int
-cwc_descramble(th_descrambler_t *td, service_t *t, struct elementary_stream *st,
-	       const uint8_t *tsb)
-{
-  cwc_service_t *ct = (cwc_service_t *)td;
-  uint8_t *pkt;
-  int xc0;
-  int ev_od;
-  int len;
-  int offset;
-  int n;
-  // FIXME: //int residue;
-
-  if(ct->cs_keystate == CS_FORBIDDEN)
-    return 1;
-
-  if(ct->cs_keystate != CS_RESOLVED)
-    return -1;
-
-  if(ct->cs_fill == 0 && ct->cs_pending_cw_update)
-    update_keys(ct);
-
-  pkt = ct->cs_tsbcluster + ct->cs_fill * 188;
-  memcpy(pkt, tsb, 188);
-  ct->cs_fill++;
-
-  do { // handle this packet
-    xc0 = pkt[3] & 0xc0;
-    if(xc0 == 0x00) { // clear
-      break;
-    }
-    if(xc0 == 0x40) { // reserved
-      break;
-    }
-    if(xc0 == 0x80 || xc0 == 0xc0) { // encrypted
-      ev_od = (xc0 & 0x40) >> 6; // 0 even, 1 odd
-      pkt[3] &= 0x3f;  // consider it decrypted now
-      if(pkt[3] & 0x20) { // incomplete packet
-        offset = 4 + pkt[4] + 1;
-        len = 188 - offset;
-        n = len >> 3;
-        // FIXME: //residue = len - (n << 3);
-        if(n == 0) { // decrypted==encrypted!
-          break; // this doesn't need more processing
-        }
-      } else {
-        len = 184;
-        offset = 4;
-        // FIXME: //n = 23;
-        // FIXME: //residue = 0;
-      }
-      if(ev_od == 0) {
-        ct->cs_tsbbatch_even[ct->cs_fill_even].data = pkt + offset;
-        ct->cs_tsbbatch_even[ct->cs_fill_even].len = len;
-        ct->cs_fill_even++;
-      } else {
-        ct->cs_tsbbatch_odd[ct->cs_fill_odd].data = pkt + offset;
-        ct->cs_tsbbatch_odd[ct->cs_fill_odd].len = len;
-        ct->cs_fill_odd++;
-      }
-    }
-  } while(0);
-
-  if(ct->cs_fill != ct->cs_cluster_size)
-    return 0;
-
-  if(ct->cs_fill_even) {
-    ct->cs_tsbbatch_even[ct->cs_fill_even].data = NULL;
-    dvbcsa_bs_decrypt(ct->cs_key_even, ct->cs_tsbbatch_even, 184);
-    ct->cs_fill_even = 0;
-  }
-  if(ct->cs_fill_odd) {
-    ct->cs_tsbbatch_odd[ct->cs_fill_odd].data = NULL;
-    dvbcsa_bs_decrypt(ct->cs_key_odd, ct->cs_tsbbatch_odd, 184);
-    ct->cs_fill_odd = 0;
-  }
-
-  {
-      int i;
-      const uint8_t *t0 = ct->cs_tsbcluster;
-
-      for(i = 0; i < ct->cs_fill; i++) {
-	ts_recv_packet2(t, t0);
-	t0 += 188;
-      }
-  }
-  ct->cs_fill = 0;
-
-  if(ct->cs_pending_cw_update)
-    update_keys(ct);
-
-  return 0;
-}
-#else
 static int
 cwc_descramble(th_descrambler_t *td, service_t *t, struct elementary_stream *st,
 	       const uint8_t *tsb)
 {
   cwc_service_t *ct = (cwc_service_t *)td;
-  int r;
-  unsigned char *vec[3];
 
   if(ct->cs_keystate == CS_FORBIDDEN)
     return 1;
@@ -2032,51 +1896,9 @@ cwc_descramble(th_descrambler_t *td, service_t *t, struct elementary_stream *st,
   if(ct->cs_keystate != CS_RESOLVED)
     return -1;
 
-  if(ct->cs_fill == 0 && ct->cs_pending_cw_update)
-    update_keys(ct);
-
-  memcpy(ct->cs_tsbcluster + ct->cs_fill * 188, tsb, 188);
-  ct->cs_fill++;
-
-  if(ct->cs_fill != ct->cs_cluster_size)
-    return 0;
-
-  while(1) {
-
-    vec[0] = ct->cs_tsbcluster;
-    vec[1] = ct->cs_tsbcluster + ct->cs_fill * 188;
-    vec[2] = NULL;
-    
-    r = decrypt_packets(ct->cs_keys, vec);
-    if(r > 0) {
-      int i;
-      const uint8_t *t0 = ct->cs_tsbcluster;
-
-      for(i = 0; i < r; i++) {
-	ts_recv_packet2(t, t0);
-	t0 += 188;
-      }
-
-      r = ct->cs_fill - r;
-      assert(r >= 0);
-
-      if(r > 0)
-	memmove(ct->cs_tsbcluster, t0, r * 188);
-      ct->cs_fill = r;
-
-      if(ct->cs_pending_cw_update && r > 0)
-	continue;
-    } else {
-      ct->cs_fill = 0;
-    }
-    break;
-  }
-  if(ct->cs_pending_cw_update)
-    update_keys(ct);
-
+  tvhcsa_descramble(ct->cs_csa, t, tsb);
   return 0;
 }
-#endif
 
 /**
  * cwc_mutex is held
@@ -2100,15 +1922,7 @@ cwc_service_destroy(th_descrambler_t *td)
 
   LIST_REMOVE(ct, cs_link);
 
-#if ENABLE_DVBCSA
-  dvbcsa_bs_key_free(ct->cs_key_odd);
-  dvbcsa_bs_key_free(ct->cs_key_even);
-  free(ct->cs_tsbbatch_odd);
-  free(ct->cs_tsbbatch_even);
-#else
-  free_key_struct(ct->cs_keys);
-#endif
-  free(ct->cs_tsbcluster);
+  tvhcsa_destroy(ct->cs_csa);
   free(ct);
 }
 
@@ -2152,22 +1966,7 @@ cwc_service_start(service_t *t)
       continue;
 
     ct                   = calloc(1, sizeof(cwc_service_t));
-#if ENABLE_DVBCSA
-    ct->cs_cluster_size  = dvbcsa_bs_batch_size();
-#else
-    ct->cs_cluster_size  = get_suggested_cluster_size();
-#endif
-    ct->cs_tsbcluster    = malloc(ct->cs_cluster_size * 188);
-#if ENABLE_DVBCSA
-    ct->cs_tsbbatch_even = malloc((ct->cs_cluster_size + 1) *
-                                   sizeof(struct dvbcsa_bs_batch_s));
-    ct->cs_tsbbatch_odd  = malloc((ct->cs_cluster_size + 1) *
-                                   sizeof(struct dvbcsa_bs_batch_s));
-    ct->cs_key_even      = dvbcsa_bs_key_alloc();
-    ct->cs_key_odd       = dvbcsa_bs_key_alloc();
-#else
-    ct->cs_keys          = get_key_struct();
-#endif
+    ct->cs_csa           = tvhcsa_create();
     ct->cs_cwc           = cwc;
     ct->cs_service       = t;
     ct->cs_okchannel     = -3;
@@ -173,6 +173,19 @@ typedef struct dvb_table_feed {
 
 
 
+/**
+ * PID dispatch entry, one per (service, elementary stream) that
+ * wants packets from a given PID
+ */
+typedef struct dvb_pid_dispatch {
+  struct service *dpd_service;
+  struct elementary_stream *dpd_stream;
+  int dpd_gen;  // s_components_gen at the time dpd_stream was resolved
+  int dpd_slot; // Per service index (0 .. tda_pid_dispatch_nsvc - 1)
+} dvb_pid_dispatch_t;
+
+
+
 /**
  * DVB Adapter (one of these per physical adapter)
  */
@@ -215,6 +228,8 @@ typedef struct th_dvb_adapter {
   uint32_t tda_diseqc_repeats;
   uint32_t tda_disable_pmt_monitor;
   int32_t  tda_full_mux_rx;
+  uint32_t tda_read_size;     // DVR read size (bytes), 0 = default
+  uint32_t tda_read_adaptive; // Vary read size with the bitrate
   char *tda_displayname;
 
   char *tda_fe_path;
@@ -272,6 +287,28 @@ typedef struct th_dvb_adapter {
   // PIDs that needs to be requeued and processed as tables
   uint8_t tda_table_filter[8192];
 
+  /**
+   * PID -> service fan-out, protected via the delivery mutex.
+   *
+   * Entries for PID 'p' are tda_pid_dispatch[tda_pid_dispatch_idx[p]]
+   * up to (but not including) tda_pid_dispatch_idx[p + 1].
+   * Rebuilt by the input thread when tda_pid_dispatch_dirty is set,
+   * the current mux changes or a service changes its components.
+   */
+  dvb_pid_dispatch_t *tda_pid_dispatch;
+  int tda_pid_dispatch_size;
+  int tda_pid_dispatch_idx[8193];
+  int tda_pid_dispatch_nsvc;
+  int tda_pid_dispatch_dirty;
+  th_dvb_mux_instance_t *tda_pid_dispatch_mux;
+
+  /**
+   * DVR input statistics, written by the input thread only
+   */
+  int tda_read_cur;            // Current read size (bytes)
+  uint32_t tda_syscall_rate;   // read() + epoll_wait() per second
+  uint32_t tda_packet_rate;    // TS packets per second
+
 
 } th_dvb_adapter_t;
 
@@ -369,6 +406,10 @@ void dvb_adapter_set_disable_pmt_monitor(th_dvb_adapter_t *tda, int on);
 
 void dvb_adapter_set_full_mux_rx(th_dvb_adapter_t *tda, int r);
 
+void dvb_adapter_set_read_size(th_dvb_adapter_t *tda, int size);
+
+void dvb_adapter_set_read_adaptive(th_dvb_adapter_t *tda, int on);
+
 void dvb_adapter_clone(th_dvb_adapter_t *dst, th_dvb_adapter_t *src);
 
 void dvb_adapter_clean(th_dvb_adapter_t *tda);
@@ -46,6 +46,15 @@
 #include "epggrab.h"
 #include "diseqc.h"
 
+/**
+ * The DVR device is read in multiples of DVB_READ_BLOCK bytes into
+ * refcounted chunks, full mux subscribers are handed slices of these
+ */
+#define DVB_READ_BLOCK        (188 * 7)
+#define DVB_READ_SIZE_DEFAULT (DVB_READ_BLOCK * 2)
+#define DVB_READ_SIZE_MAX     (DVB_READ_BLOCK * (1048576 / DVB_READ_BLOCK))
+#define DVB_CHUNK_SIZE_MIN    (188 * 320)
+
 struct th_dvb_adapter_queue dvb_adapters;
 struct th_dvb_mux_instance_tree dvb_muxes;
 static void *dvb_adapter_input_dvr(void *aux);
@@ -96,6 +105,8 @@ tda_save(th_dvb_adapter_t *tda)
   htsmsg_add_u32(m, "skip_initialscan", tda->tda_skip_initialscan);
   htsmsg_add_u32(m, "disable_pmt_monitor", tda->tda_disable_pmt_monitor);
   htsmsg_add_s32(m, "full_mux_rx", tda->tda_full_mux_rx);
+  htsmsg_add_u32(m, "read_size", tda->tda_read_size);
+  htsmsg_add_u32(m, "read_adaptive", tda->tda_read_adaptive);
   hts_settings_save(m, "dvbadapters/%s", tda->tda_identifier);
   htsmsg_destroy(m);
 }
@@ -391,6 +402,63 @@ dvb_adapter_set_full_mux_rx(th_dvb_adapter_t *tda, int on)
 }
 
 
+/**
+ * Round a DVR read size to whole blocks within limits, 0 means default
+ */
+static int
+dvb_adapter_read_size_norm(int size)
+{
+  if(size <= 0)
+    return 0;
+  size -= size % DVB_READ_BLOCK;
+  if(size < DVB_READ_BLOCK)
+    size = DVB_READ_BLOCK;
+  if(size > DVB_READ_SIZE_MAX)
+    size = DVB_READ_SIZE_MAX;
+  return size;
+}
+
+
+/**
+ * Set the (max) number of bytes read from the DVR device at a time
+ */
+void
+dvb_adapter_set_read_size(th_dvb_adapter_t *tda, int size)
+{
+  size = dvb_adapter_read_size_norm(size);
+
+  if(tda->tda_read_size == size)
+    return;
+
+  lock_assert(&global_lock);
+
+  tvhlog(LOG_NOTICE, "dvb", "Adapter \"%s\" DVR read size set to: %d bytes",
+	 tda->tda_displayname, size ?: DVB_READ_SIZE_DEFAULT);
+
+  tda->tda_read_size = size;
+  tda_save(tda);
+}
+
+
+/**
+ *
+ */
+void
+dvb_adapter_set_read_adaptive(th_dvb_adapter_t *tda, int on)
+{
+  if(tda->tda_read_adaptive == on)
+    return;
+
+  lock_assert(&global_lock);
+
+  tvhlog(LOG_NOTICE, "dvb", "Adapter \"%s\" adaptive DVR read size set to: %s",
+	 tda->tda_displayname, on ? "On" : "Off");
+
+  tda->tda_read_adaptive = on;
+  tda_save(tda);
+}
+
+
 /**
  *
  */
@@ -700,6 +768,9 @@ dvb_adapter_init(uint32_t adapter_mask, const char *rawfile)
       if (htsmsg_get_s32(c, "full_mux_rx", &tda->tda_full_mux_rx))
         if (!htsmsg_get_u32(c, "disable_full_mux_rx", &u32) && u32)
           tda->tda_full_mux_rx = 0;
+      if (!htsmsg_get_u32(c, "read_size", &u32))
+        tda->tda_read_size = dvb_adapter_read_size_norm(u32);
+      htsmsg_get_u32(c, "read_adaptive", &tda->tda_read_adaptive);
     }
     htsmsg_destroy(l);
   }
@@ -836,6 +907,7 @@ dvb_adapter_destroy(th_dvb_adapter_t *tda)
 
   free(tda->tda_identifier);
   free(tda->tda_displayname);
+  free(tda->tda_pid_dispatch);
 
   free(tda);
 
@@ -860,6 +932,164 @@ dvb_adapter_clean(th_dvb_adapter_t *tda)
 
 
 
+/**
+ * Rebuild the PID -> (service, elementary stream) dispatch table
+ *
+ * tda_delivery_mutex must be held
+ */
+static void
+dvb_adapter_pid_dispatch_rebuild(th_dvb_adapter_t *tda)
+{
+  service_t *t;
+  elementary_stream_t *st;
+  dvb_pid_dispatch_t *vec = NULL;
+  int16_t *pids = NULL;
+  int *idx = tda->tda_pid_dispatch_idx;
+  int i, n = 0, size = 0, nsvc = 0;
+
+  /* Collect all consumers, one pass so each service is locked once */
+  LIST_FOREACH(t, &tda->tda_transports, s_active_link) {
+    if(t->s_dvb_mux_instance != tda->tda_mux_current)
+      continue;
+
+    pthread_mutex_lock(&t->s_stream_mutex);
+    TAILQ_FOREACH(st, &t->s_components, es_link) {
+      if(st->es_pid < 0 || st->es_pid >= 0x2000)
+        continue;
+      if(n == size) {
+        size = size ? size * 2 : 32;
+        vec  = realloc(vec,  size * sizeof(dvb_pid_dispatch_t));
+        pids = realloc(pids, size * sizeof(int16_t));
+      }
+      vec[n].dpd_service = t;
+      vec[n].dpd_stream  = st;
+      vec[n].dpd_gen     = t->s_components_gen;
+      vec[n].dpd_slot    = nsvc;
+      pids[n] = st->es_pid;
+      n++;
+    }
+    t->s_dvb_pid_dispatch_gen = t->s_components_gen;
+    pthread_mutex_unlock(&t->s_stream_mutex);
+    nsvc++;
+  }
+
+  /* Bucket by PID, idx[p] is the start of bucket p */
+  memset(idx, 0, sizeof(tda->tda_pid_dispatch_idx));
+  for(i = 0; i < n; i++)
+    idx[pids[i] + 1]++;
+  for(i = 0; i < 8192; i++)
+    idx[i + 1] += idx[i];
+
+  if(n > tda->tda_pid_dispatch_size) {
+    free(tda->tda_pid_dispatch);
+    tda->tda_pid_dispatch = malloc(n * sizeof(dvb_pid_dispatch_t));
+    tda->tda_pid_dispatch_size = n;
+  }
+
+  for(i = 0; i < n; i++)
+    tda->tda_pid_dispatch[idx[pids[i]]++] = vec[i];
+
+  /* Filling advanced each start index to the start of the next bucket */
+  memmove(idx + 1, idx, 8192 * sizeof(int));
+  idx[0] = 0;
+
+  free(vec);
+  free(pids);
+
+  tda->tda_pid_dispatch_nsvc  = nsvc;
+  tda->tda_pid_dispatch_mux   = tda->tda_mux_current;
+  tda->tda_pid_dispatch_dirty = 0;
+}
+
+
+/**
+ * Make sure the PID dispatch table is up to date before delivering
+ * a new batch of packets
+ *
+ * tda_delivery_mutex must be held
+ */
+static void
+dvb_adapter_pid_dispatch_check(th_dvb_adapter_t *tda)
+{
+  service_t *t;
+  int dirty = tda->tda_pid_dispatch_dirty ||
+    tda->tda_pid_dispatch_mux != tda->tda_mux_current;
+
+  LIST_FOREACH(t, &tda->tda_transports, s_active_link) {
+    if(t->s_dvb_mux_instance != tda->tda_mux_current ||
+       t->s_status != SERVICE_RUNNING)
+      continue;
+
+    /* Components are only read (racy) as a hint here, the packet path
+       verifies the generation again with s_stream_mutex held */
+    if(t->s_dvb_pid_dispatch_gen != t->s_components_gen)
+      dirty = 1;
+
+    /* Services used to see every packet on the mux, flag hardware input
+       even if none of their PIDs are present */
+    if(!(t->s_streaming_status & TSS_INPUT_HARDWARE)) {
+      pthread_mutex_lock(&t->s_stream_mutex);
+      service_set_streaming_status_flags(t, TSS_INPUT_HARDWARE);
+      pthread_mutex_unlock(&t->s_stream_mutex);
+    }
+  }
+
+  if(dirty)
+    dvb_adapter_pid_dispatch_rebuild(tda);
+}
+
+
+/**
+ * Packets gathered for one service from one read() of the DVR device,
+ * so they can be handed over to the demuxer in one go
+ */
+typedef struct dvb_batch {
+  service_t *db_service;
+  int db_gen;
+  int db_num;
+  const uint8_t **db_tsb;
+  elementary_stream_t **db_st;
+} dvb_batch_t;
+
+
+/**
+ * Make sure there is a batch for each dispatch slot
+ */
+static void
+dvb_batch_resize(dvb_batch_t **bp, int *sizep, int nsvc, int maxpkts)
+{
+  dvb_batch_t *b;
+  int i;
+
+  if(nsvc <= *sizep)
+    return;
+
+  *bp = realloc(*bp, nsvc * sizeof(dvb_batch_t));
+  for(i = *sizep; i < nsvc; i++) {
+    b = *bp + i;
+    b->db_num = 0;
+    b->db_tsb = malloc(maxpkts * sizeof(uint8_t *));
+    b->db_st  = malloc(maxpkts * sizeof(elementary_stream_t *));
+  }
+  *sizep = nsvc;
+}
+
+
+/**
+ *
+ */
+static void
+dvb_batch_free(dvb_batch_t *b, int size)
+{
+  int i;
+
+  for(i = 0; i < size; i++) {
+    free(b[i].db_tsb);
+    free(b[i].db_st);
+  }
+  free(b);
+}
+
 
 /**
  *
@@ -868,9 +1098,15 @@ static void *
 dvb_adapter_input_dvr(void *aux)
 {
   th_dvb_adapter_t *tda = aux;
-  int fd, i, r, c, efd, nfds, dmx = -1;
-  uint8_t tsb[188 * 10];
-  service_t *t;
+  int fd, i, i0, r, c, efd, nfds, dmx = -1;
+  int read_cfg = -1, read_max = 0, read_cur = 0, chunk_size = 0;
+  uint32_t syscalls = 0, packets = 0;
+  time_t last = dispatch_clock;
+  pktbuf_t *chunk = NULL, *pb;
+  uint8_t *tsb;
+  dvb_pid_dispatch_t *dpd;
+  dvb_batch_t *batch = NULL, *b;
+  int j, batch_size = 0;
   struct epoll_event ev;
   char path[256];
 
@@ -922,15 +1158,58 @@ dvb_adapter_input_dvr(void *aux)
   ev.data.fd = tda->tda_dvr_pipe.rd;
   epoll_ctl(efd, EPOLL_CTL_ADD, tda->tda_dvr_pipe.rd, &ev);
 
+  tsb = NULL;
   r = i = 0;
   while(1) {
 
+    /* Update statistics */
+    if (dispatch_clock != last) {
+      if (dispatch_clock > last) {
+        tda->tda_syscall_rate = syscalls / (dispatch_clock - last);
+        tda->tda_packet_rate  = packets / (dispatch_clock - last);
+      }
+      syscalls = packets = 0;
+      last = dispatch_clock;
+    }
+
+    /* Pick up read size changes */
+    if (tda->tda_read_size != read_cfg) {
+      read_cfg   = tda->tda_read_size;
+      read_max   = read_cfg ?: DVB_READ_SIZE_DEFAULT;
+      read_cur   = tda->tda_read_adaptive ? DVB_READ_BLOCK : read_max;
+      chunk_size = MAX(DVB_CHUNK_SIZE_MIN, read_max * 2);
+      dvb_batch_free(batch, batch_size);
+      batch = NULL;
+      batch_size = 0;
+    }
+    if (!tda->tda_read_adaptive)
+      read_cur = read_max;
+    tda->tda_read_cur = read_cur;
+
     /* Wait for input */
     nfds = epoll_wait(efd, &ev, 1, -1);
+    syscalls++;
     if (nfds < 1) continue;
     if (ev.data.fd != fd) break;
 
-    c = read(fd, tsb+r, sizeof(tsb)-r);
+    /* Make room, slices handed to subscribers keep the old chunk alive */
+    if (chunk == NULL || chunk->pb_size != chunk_size ||
+        i + r + read_cur > chunk_size) {
+      if (chunk != NULL && chunk->pb_size == chunk_size &&
+          chunk->pb_refcount == 1) {
+        memmove(tsb, tsb+i, r);
+      } else {
+        pb = pktbuf_alloc(NULL, chunk_size);
+        if (r) memcpy(pktbuf_ptr(pb), tsb+i, r);
+        if (chunk != NULL) pktbuf_ref_dec(chunk);
+        chunk = pb;
+        tsb = pktbuf_ptr(chunk);
+      }
+      i = 0;
+    }
+
+    c = read(fd, tsb+i+r, read_cur);
+    syscalls++;
     if (c < 0) {
       if (errno == EAGAIN || errno == EINTR)
         continue;
@@ -947,6 +1226,16 @@ dvb_adapter_input_dvr(void *aux)
     }
     r += c;
 
+    /* Grow reads while they come back full, shrink when mostly idle */
+    if (tda->tda_read_adaptive) {
+      if (c == read_cur && read_cur < read_max) {
+        read_cur = MIN(read_cur * 2, read_max);
+      } else if (c < read_cur / 4 && read_cur > DVB_READ_BLOCK) {
+        read_cur /= 2;
+        read_cur = MAX(read_cur - read_cur % DVB_READ_BLOCK, DVB_READ_BLOCK);
+      }
+    }
+
     /* not enough data */
     if (r < 188) continue;
 
@@ -954,17 +1243,12 @@ dvb_adapter_input_dvr(void *aux)
 
     pthread_mutex_lock(&tda->tda_delivery_mutex);
 
-    if(LIST_FIRST(&tda->tda_streaming_pad.sp_targets) != NULL) {
-      streaming_message_t sm;
-      pktbuf_t *pb = pktbuf_alloc(tsb, r);
-      memset(&sm, 0, sizeof(sm));
-      sm.sm_type = SMT_MPEGTS;
-      sm.sm_data = pb;
-      streaming_pad_deliver(&tda->tda_streaming_pad, &sm);
-      pktbuf_ref_dec(pb);
-    }
+    dvb_adapter_pid_dispatch_check(tda);
+    dvb_batch_resize(&batch, &batch_size, tda->tda_pid_dispatch_nsvc,
+                     read_max / 188 + 1);
 
     /* Process */
+    i0 = i;
     while (r >= 188) {
   
       /* sync */
@@ -979,9 +1263,16 @@ dvb_adapter_input_dvr(void *aux)
 	          wakeup_table_feed = 1;
 	        }
 	      } else {
-          LIST_FOREACH(t, &tda->tda_transports, s_active_link)
-            if(t->s_dvb_mux_instance == tda->tda_mux_current)
-              ts_recv_packet1(t, tsb + i, NULL);
+          int e = tda->tda_pid_dispatch_idx[pid + 1];
+          for(j = tda->tda_pid_dispatch_idx[pid]; j < e; j++) {
+            dpd = &tda->tda_pid_dispatch[j];
+            b = &batch[dpd->dpd_slot];
+            b->db_service = dpd->dpd_service;
+            b->db_gen     = dpd->dpd_gen;
+            b->db_tsb[b->db_num] = tsb + i;
+            b->db_st[b->db_num]  = dpd->dpd_stream;
+            b->db_num++;
+          }
         }
 
         i += 188;
@@ -995,16 +1286,43 @@ dvb_adapter_input_dvr(void *aux)
       }
     }
 
+    /* Deliver to services, one batch per service */
+    for(j = 0; j < tda->tda_pid_dispatch_nsvc; j++) {
+      b = &batch[j];
+      if(b->db_num == 0)
+        continue;
+      ts_recv_packetv(b->db_service, b->db_tsb, b->db_st, b->db_gen,
+                      b->db_num);
+      b->db_num = 0;
+    }
+
+    packets += (i - i0) / 188;
+
+    /* Full mux subscribers get the processed packets without a copy */
+    if(i > i0 && LIST_FIRST(&tda->tda_streaming_pad.sp_targets) != NULL) {
+      streaming_message_t sm;
+      pb = pktbuf_slice(chunk, i0, i - i0);
+      memset(&sm, 0, sizeof(sm));
+      sm.sm_type = SMT_MPEGTS;
+      sm.sm_data = pb;
+      streaming_pad_deliver(&tda->tda_streaming_pad, &sm);
+      pktbuf_ref_dec(pb);
+    }
+
     if(wakeup_table_feed)
       pthread_cond_signal(&tda->tda_table_feed_cond);
 
     pthread_mutex_unlock(&tda->tda_delivery_mutex);
 
-    /* reset buffer */
-    if (r) memmove(tsb, tsb+i, r);
-    i = 0;
+    /* start over at the beginning of the chunk when all is consumed */
+    if (r == 0 && chunk->pb_refcount == 1)
+      i = 0;
   }
 
+  if (chunk != NULL)
+    pktbuf_ref_dec(chunk);
+  dvb_batch_free(batch, batch_size);
+
   if(dmx != -1)
     close(dmx);
   close(efd);
@@ -1044,6 +1362,10 @@ dvb_adapter_build_msg(th_dvb_adapter_t *tda)
   htsmsg_add_u32(m, "muxes", nummux);
   htsmsg_add_u32(m, "initialMuxes", tda->tda_initial_num_mux);
 
+  htsmsg_add_u32(m, "readSize", tda->tda_read_cur);
+  htsmsg_add_u32(m, "syscallRate", tda->tda_syscall_rate);
+  htsmsg_add_u32(m, "packetRate", tda->tda_packet_rate);
+
   if(tda->tda_mux_current != NULL) {
     th_dvb_mux_instance_t *tdmi = tda->tda_mux_current;
 
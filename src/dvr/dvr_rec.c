@@ -35,6 +35,17 @@
 
 #include "muxer.h"
 
+/**
+ * Recording queue, ring slots and max number of messages per dequeue
+ */
+#define DVR_QUEUE_SLOTS 16384
+#define DVR_QUEUE_BATCH 32
+
+/**
+ * Min interval (seconds) between reports of data lost to a full queue
+ */
+#define DVR_DROP_REPORT 10
+
 /**
  *
  */
@@ -72,13 +83,13 @@ dvr_rec_subscribe(dvr_entry_t *de)
   snprintf(buf, sizeof(buf), "DVR: %s", lang_str_get(de->de_title, NULL));
 
   if(de->de_mc == MC_PASS) {
-    streaming_queue_init(&de->de_sq, SMT_PACKET);
+    streaming_queue_init_ring(&de->de_sq, SMT_PACKET, 0, DVR_QUEUE_SLOTS);
     de->de_gh = NULL;
     de->de_tsfix = NULL;
     st = &de->de_sq.sq_st;
     flags = SUBSCRIPTION_RAW_MPEGTS;
   } else {
-    streaming_queue_init(&de->de_sq, 0);
+    streaming_queue_init_ring(&de->de_sq, 0, 0, DVR_QUEUE_SLOTS);
     de->de_gh = globalheaders_create(&de->de_sq.sq_st);
     de->de_tsfix = tsfix_create(de->de_gh);
     st = de->de_tsfix;
@@ -88,6 +99,8 @@ dvr_rec_subscribe(dvr_entry_t *de)
   de->de_s = subscription_create_from_channel(de->de_channel, weight,
 					      buf, st, flags,
 					      NULL, NULL, NULL);
+  if(de->de_s != NULL)
+    de->de_s->ths_output_sq = &de->de_sq;
 
   pthread_create(&de->de_thread, NULL, dvr_thread, de);
 }
@@ -107,6 +120,8 @@ dvr_rec_unsubscribe(dvr_entry_t *de, int stopcode)
   pthread_join(de->de_thread, NULL);
   de->de_s = NULL;
 
+  streaming_queue_deinit(&de->de_sq);
+
   if(de->de_tsfix)
     tsfix_destroy(de->de_tsfix);
 
@@ -399,22 +414,37 @@ dvr_thread(void *aux)
 {
   dvr_entry_t *de = aux;
   streaming_queue_t *sq = &de->de_sq;
-  streaming_message_t *sm;
+  streaming_message_t *sm, *smv[DVR_QUEUE_BATCH];
+  int idx = 0, num = 0;
   int run = 1;
   int started = 0;
-
-  pthread_mutex_lock(&sq->sq_mutex);
+  uint32_t seen = 0, drops = 0;
+  int lost = 0;
+  time_t reported = 0;
 
   while(run) {
-    sm = TAILQ_FIRST(&sq->sq_queue);
-    if(sm == NULL) {
-      pthread_cond_wait(&sq->sq_cond, &sq->sq_mutex);
+    if(idx == num) {
+      idx = 0;
+      num = streaming_queue_get(sq, smv, DVR_QUEUE_BATCH, -1);
+
+      /* The queue overflowed, storage can't keep up */
+      drops += streaming_queue_dropped(sq, &seen);
+      if(drops && dispatch_clock - reported >= DVR_DROP_REPORT) {
+	tvhlog(LOG_ERR,
+	       "dvr", "Recording \"%s\": %u packets dropped, %s",
+	       de->de_filename ?: lang_str_get(de->de_title, NULL),
+	       drops, streaming_code2txt(SM_CODE_DATA_LOST));
+	if(started) {
+	  de->de_errors++;
+	  lost = 1;
+	}
+	drops = 0;
+	reported = dispatch_clock;
+      }
       continue;
     }
-    
-    TAILQ_REMOVE(&sq->sq_queue, sm, sm_link);
 
-    pthread_mutex_unlock(&sq->sq_mutex);
+    sm = smv[idx++];
 
     switch(sm->sm_type) {
     case SMT_MPEGTS:
@@ -457,7 +487,8 @@ dvr_thread(void *aux)
        } else if(sm->sm_code == 0) {
 	 // Recording is completed
 
-	de->de_last_error = 0;
+	de->de_last_error = lost ? SM_CODE_DATA_LOST : 0;
+	lost = 0;
 	tvhlog(LOG_INFO, 
 	       "dvr", "Recording completed: \"%s\"",
 	       de->de_filename ?: lang_str_get(de->de_title, NULL));
@@ -524,9 +555,10 @@ dvr_thread(void *aux)
     }
 
     streaming_msg_free(sm);
-    pthread_mutex_lock(&sq->sq_mutex);
   }
-  pthread_mutex_unlock(&sq->sq_mutex);
+
+  while(idx < num)
+    streaming_msg_free(smv[idx++]);
 
   if(de->de_mux)
     dvr_thread_epilog(de);
@@ -32,6 +32,7 @@
 #include "dvr/dvr.h"
 #include "htsp_server.h"
 #include "epggrab.h"
+#include "strpool.h"
 
 /* Broadcast hashing */
 #define EPG_HASH_WIDTH 1024
@@ -51,6 +52,22 @@ epg_object_list_t epg_object_updated;
 /* Global counter */
 static uint32_t _epg_object_idx    = 0;
 
+/* Change tracking */
+#define EPG_JOURNAL_SIZE 65536
+
+typedef struct epg_journal_entry {
+  uint64_t seq;
+  uint32_t id;
+} epg_journal_entry_t;
+
+uint64_t epg_change_seq;
+time_t   epg_change_epoch;
+static epg_object_tree_t   epg_object_seq_tree;
+static epg_journal_entry_t epg_journal[EPG_JOURNAL_SIZE];
+static int                 epg_journal_head;  ///< Oldest entry
+static int                 epg_journal_count;
+static uint64_t            epg_journal_floor; ///< Newest dropped entry
+
 /* **************************************************************************
  * Comparators / Ordering
  * *************************************************************************/
@@ -60,6 +77,12 @@ static int _uri_cmp ( const void *a, const void *b )
   return strcmp(((epg_object_t*)a)->uri, ((epg_object_t*)b)->uri);
 }
 
+static int _seq_cmp ( const void *a, const void *b )
+{
+  uint64_t x = ((epg_object_t*)a)->changed, y = ((epg_object_t*)b)->changed;
+  return x < y ? -1 : x > y;
+}
+
 static int _ebc_start_cmp ( const void *a, const void *b )
 {
   return ((epg_broadcast_t*)a)->start - ((epg_broadcast_t*)b)->start;
@@ -108,8 +131,15 @@ void epg_updated ( void )
   //       to be useful to DVR since they will relate to episode/seasons/brands
   //       with no valid broadcasts etc..
 
+  /* Record on disk */
+  epgdb_journal_updated();
+
   /* Update updated */
   while ((eo = LIST_FIRST(&epg_object_updated))) {
+    if (eo->changed) RB_REMOVE(&epg_object_seq_tree, eo, seq_link);
+    eo->changed = ++epg_change_seq;
+    if (!eo->added) eo->added = eo->changed;
+    RB_INSERT_SORTED(&epg_object_seq_tree, eo, seq_link, _seq_cmp);
     eo->update(eo);
     LIST_REMOVE(eo, up_link);
     eo->_updated = 0;
@@ -129,9 +159,10 @@ static void _epg_object_destroy
   tvhlog(LOG_DEBUG, "epg", "eo [%p, %u, %d, %s] destroy",
          eo, eo->id, eo->type, eo->uri);
 #endif
-  if (eo->uri) free(eo->uri);
+  strpool_put(eo->uri);
   if (tree) RB_REMOVE(tree, eo, uri_link);
   if (eo->_updated) LIST_REMOVE(eo, up_link);
+  if (eo->changed) RB_REMOVE(&epg_object_seq_tree, eo, seq_link);
   LIST_REMOVE(eo, id_link);
 }
 
@@ -197,7 +228,7 @@ static epg_object_t *_epg_object_find_by_uri
   assert(skel != NULL);
   lock_assert(&global_lock);
 
-  (*skel)->uri = (char*)uri;
+  (*skel)->uri = uri;
 
   /* Find only */
   if ( !create ) {
@@ -210,13 +241,63 @@ static epg_object_t *_epg_object_find_by_uri
       *save        = 1;
       eo           = *skel;
       *skel        = NULL;
-      eo->uri      = strdup(uri);
+      eo->uri      = strpool_get(uri);
       _epg_object_create(eo);
     }
   }
   return eo;
 }
 
+/* **************************************************************************
+ * Change tracking
+ * *************************************************************************/
+
+epg_object_t *epg_object_changed_after ( uint64_t seq )
+{
+  epg_object_t skel;
+  skel.changed = seq;
+  return RB_FIND_GT(&epg_object_seq_tree, &skel, seq_link, _seq_cmp);
+}
+
+static void _epg_journal_add ( uint32_t id )
+{
+  epg_journal_entry_t *je;
+  if (epg_journal_count == EPG_JOURNAL_SIZE) {
+    epg_journal_floor = epg_journal[epg_journal_head].seq;
+    epg_journal_head  = (epg_journal_head + 1) % EPG_JOURNAL_SIZE;
+    epg_journal_count--;
+  }
+  je = &epg_journal[(epg_journal_head + epg_journal_count) % EPG_JOURNAL_SIZE];
+  je->seq = ++epg_change_seq;
+  je->id  = id;
+  epg_journal_count++;
+}
+
+int epg_journal_complete ( uint64_t seq )
+{
+  return seq >= epg_journal_floor && seq <= epg_change_seq;
+}
+
+int epg_journal_deleted_after ( uint64_t seq, uint64_t *dseq, uint32_t *id )
+{
+  int lo = 0, hi = epg_journal_count, mid;
+  epg_journal_entry_t *je;
+
+  /* Entries are in sequence order, find the first one after seq */
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (epg_journal[(epg_journal_head + mid) % EPG_JOURNAL_SIZE].seq <= seq)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == epg_journal_count) return 1;
+  je    = &epg_journal[(epg_journal_head + lo) % EPG_JOURNAL_SIZE];
+  *dseq = je->seq;
+  *id   = je->id;
+  return 0;
+}
+
 epg_object_t *epg_object_find_by_id ( uint32_t id, epg_object_type_t type )
 {
   epg_object_t *eo;
@@ -236,7 +317,7 @@ static htsmsg_t * _epg_object_serialize ( void *o )
 #endif
   htsmsg_t *m;
   if ( !eo->id || !eo->type ) return NULL;
-  m = htsmsg_create_map();
+  m = htsmsg_create_map_arena();
   htsmsg_add_u32(m, "id", eo->id);
   htsmsg_add_u32(m, "type", eo->type);
   if (eo->uri)
@@ -255,7 +336,7 @@ static epg_object_t *_epg_object_deserialize ( htsmsg_t *m, epg_object_t *eo )
   if (htsmsg_get_u32(m, "id",   &eo->id)) return NULL;
   if (htsmsg_get_u32(m, "type", &u32))    return NULL;
   if (u32 != eo->type)                    return NULL;
-  eo->uri = (char*)htsmsg_get_str(m, "uri");
+  eo->uri = htsmsg_get_str(m, "uri");
   if ((s = htsmsg_get_str(m, "grabber")))
     eo->grabber = epggrab_module_find_by_id(s);
   if (!htsmsg_get_s64(m, "updated", &s64)) {
@@ -387,6 +468,224 @@ epg_object_t *epg_object_deserialize ( htsmsg_t *msg, int create, int *save )
   return NULL;
 }
 
+/* **************************************************************************
+ * Title index
+ * *************************************************************************/
+
+/*
+ * Episode titles (all languages) are split into lower cased byte trigrams,
+ * each trigram lists the episodes containing it in id order. Literal title
+ * searches intersect these lists instead of scanning every broadcast.
+ */
+
+#define EPG_TRIGRAM_LC(c) ((c) >= 'A' && (c) <= 'Z' ? (c) + 32 : (c))
+
+typedef struct epg_trigram
+{
+  RB_ENTRY(epg_trigram) link;
+  uint32_t              key;
+  uint32_t              count;
+  uint32_t              alloced;
+  epg_episode_t       **episodes;      ///< Ordered by id
+} epg_trigram_t;
+
+RB_HEAD(epg_trigram_tree, epg_trigram);
+
+static struct epg_trigram_tree epg_trigrams;
+
+static int _epg_trigram_cmp ( const void *a, const void *b )
+{
+  uint32_t ka = ((epg_trigram_t*)a)->key, kb = ((epg_trigram_t*)b)->key;
+  return ka < kb ? -1 : ka > kb;
+}
+
+static int _epg_trigram_key_cmp ( const void *a, const void *b )
+{
+  uint32_t ka = *(uint32_t*)a, kb = *(uint32_t*)b;
+  return ka < kb ? -1 : ka > kb;
+}
+
+static inline uint32_t _epg_trigram_key ( const uint8_t *s )
+{
+  return (EPG_TRIGRAM_LC(s[0]) << 16) |
+         (EPG_TRIGRAM_LC(s[1]) << 8)  |
+          EPG_TRIGRAM_LC(s[2]);
+}
+
+static epg_trigram_t *_epg_trigram_find ( uint32_t key )
+{
+  epg_trigram_t skel;
+  skel.key = key;
+  return RB_FIND(&epg_trigrams, &skel, link, _epg_trigram_cmp);
+}
+
+/* Position of the first episode with an id >= id */
+static uint32_t _epg_trigram_pos ( epg_trigram_t *et, uint32_t id )
+{
+  uint32_t lo = 0, hi = et->count, mid;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (et->episodes[mid]->id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/* Append the trigrams of a string to tri */
+static int _epg_trigrams_add
+  ( const char *str, uint32_t **tri, int cnt, int *alloced )
+{
+  const uint8_t *s;
+  for (s = (const uint8_t*)str; s[0] && s[1] && s[2]; s++) {
+    if (cnt == *alloced) {
+      *alloced = MAX(32, *alloced * 2);
+      *tri     = realloc(*tri, *alloced * sizeof(uint32_t));
+    }
+    (*tri)[cnt++] = _epg_trigram_key(s);
+  }
+  return cnt;
+}
+
+/* Sort and de-duplicate */
+static int _epg_trigrams_sort ( uint32_t *tri, int cnt )
+{
+  int i, j;
+  if (cnt < 2) return cnt;
+  qsort(tri, cnt, sizeof(uint32_t), _epg_trigram_key_cmp);
+  for (i = j = 1; i < cnt; i++)
+    if (tri[i] != tri[j-1]) tri[j++] = tri[i];
+  return j;
+}
+
+static void _epg_trigram_add ( uint32_t key, epg_episode_t *ee )
+{
+  static epg_trigram_t *skel = NULL;
+  epg_trigram_t *et;
+  uint32_t pos;
+
+  if (!skel) skel = calloc(1, sizeof(epg_trigram_t));
+  skel->key = key;
+  if (!(et = RB_INSERT_SORTED(&epg_trigrams, skel, link, _epg_trigram_cmp))) {
+    et   = skel;
+    skel = NULL;
+  }
+  if (et->count == et->alloced) {
+    et->alloced  = MAX(4, et->alloced * 2);
+    et->episodes = realloc(et->episodes, et->alloced * sizeof(epg_episode_t*));
+  }
+
+  /* Ids are allocated in order, so this is normally an append */
+  if (!et->count || et->episodes[et->count-1]->id < ee->id)
+    pos = et->count;
+  else
+    pos = _epg_trigram_pos(et, ee->id);
+  memmove(et->episodes + pos + 1, et->episodes + pos,
+          (et->count - pos) * sizeof(epg_episode_t*));
+  et->episodes[pos] = ee;
+  et->count++;
+}
+
+static void _epg_trigram_rem ( uint32_t key, epg_episode_t *ee )
+{
+  epg_trigram_t *et;
+  uint32_t pos;
+
+  if (!(et = _epg_trigram_find(key))) return;
+  pos = _epg_trigram_pos(et, ee->id);
+  if (pos == et->count || et->episodes[pos] != ee) return;
+  memmove(et->episodes + pos, et->episodes + pos + 1,
+          (et->count - pos - 1) * sizeof(epg_episode_t*));
+  if (!--et->count) {
+    RB_REMOVE(&epg_trigrams, et, link);
+    free(et->episodes);
+    free(et);
+  }
+}
+
+static void _epg_episode_unindex ( epg_episode_t *ee )
+{
+  int i;
+  for (i = 0; i < ee->trigram_cnt; i++)
+    _epg_trigram_rem(ee->trigrams[i], ee);
+  free(ee->trigrams);
+  ee->trigrams    = NULL;
+  ee->trigram_cnt = 0;
+}
+
+static void _epg_episode_index ( epg_episode_t *ee )
+{
+  lang_str_ele_t *ls;
+  uint32_t *tri = NULL;
+  int i, cnt = 0, alloced = 0;
+
+  if (ee->title)
+    RB_FOREACH(ls, ee->title, link)
+      cnt = _epg_trigrams_add(ls->str, &tri, cnt, &alloced);
+  cnt = _epg_trigrams_sort(tri, cnt);
+
+  /* Unchanged */
+  if (cnt == ee->trigram_cnt &&
+      (!cnt || !memcmp(tri, ee->trigrams, cnt * sizeof(uint32_t)))) {
+    free(tri);
+    return;
+  }
+
+  _epg_episode_unindex(ee);
+  for (i = 0; i < cnt; i++)
+    _epg_trigram_add(tri[i], ee);
+  ee->trigrams    = tri;
+  ee->trigram_cnt = cnt;
+}
+
+/*
+ * Episodes whose title contains every trigram of str, NULL (and 0) if
+ * there are none
+ */
+static epg_episode_t **_epg_trigram_match ( const char *str, int *ret )
+{
+  uint32_t *tri = NULL;
+  epg_trigram_t **ets, *et;
+  epg_episode_t **eps, *ee;
+  uint32_t j, pos;
+  int i, k, cnt, alloced = 0, neps = 0;
+
+  cnt = _epg_trigrams_sort(tri, _epg_trigrams_add(str, &tri, 0, &alloced));
+  if (cnt <= 0) {
+    free(tri);
+    *ret = 0;
+    return NULL;
+  }
+  ets = alloca(cnt * sizeof(epg_trigram_t*));
+  for (i = 0; i < cnt; i++) {
+    if (!(ets[i] = _epg_trigram_find(tri[i]))) {
+      free(tri);
+      *ret = 0;
+      return NULL;
+    }
+  }
+  free(tri);
+
+  /* Start from the shortest list */
+  for (i = 1; i < cnt; i++) {
+    if (ets[i]->count < ets[0]->count) {
+      et = ets[0]; ets[0] = ets[i]; ets[i] = et;
+    }
+  }
+  eps = malloc(ets[0]->count * sizeof(epg_episode_t*));
+  for (j = 0; j < ets[0]->count; j++) {
+    ee = ets[0]->episodes[j];
+    for (k = 1; k < cnt; k++) {
+      pos = _epg_trigram_pos(ets[k], ee->id);
+      if (pos == ets[k]->count || ets[k]->episodes[pos] != ee) break;
+    }
+    if (k == cnt) eps[neps++] = ee;
+  }
+  *ret = neps;
+  return eps;
+}
+
 /* **************************************************************************
  * Brand
  * *************************************************************************/
@@ -805,12 +1104,14 @@ static void _epg_episode_destroy ( void *eo )
   }
   if (ee->image)       free(ee->image);
   if (ee->epnum.text)  free(ee->epnum.text);
+  _epg_episode_unindex(ee);
   _epg_object_destroy(eo, &epg_episodes);
   free(ee);
 }
 
 static void _epg_episode_updated ( void *eo )
 {
+  _epg_episode_index(eo);
 }
 
 static epg_object_t **_epg_episode_skel ( void )
@@ -1354,6 +1655,7 @@ static void _epg_channel_rem_broadcast
   ( channel_t *ch, epg_broadcast_t *ebc, epg_broadcast_t *new )
 {
   if (new) dvr_event_replaced(ebc, new);
+  if (ebc->created) epgdb_journal_deleted(ebc);
   RB_REMOVE(&ch->ch_epg_schedule, ebc, sched_link);
   if (ch->ch_epg_now  == ebc) ch->ch_epg_now  = NULL;
   if (ch->ch_epg_next == ebc) ch->ch_epg_next = NULL;
@@ -1509,7 +1811,10 @@ void epg_channel_unlink ( channel_t *ch )
 static void _epg_broadcast_destroy ( void *eo )
 {
   epg_broadcast_t *ebc = eo;
-  if (ebc->created)     htsp_event_delete(ebc);
+  if (ebc->created) {
+    _epg_journal_add(ebc->id);
+    htsp_event_delete(ebc);
+  }
   if (ebc->episode)     _epg_episode_rem_broadcast(ebc->episode, ebc);
   if (ebc->serieslink)  _epg_serieslink_rem_broadcast(ebc->serieslink, ebc);
   if (ebc->summary)     lang_str_destroy(ebc->summary);
@@ -1565,6 +1870,12 @@ epg_broadcast_t *epg_broadcast_find_by_id ( uint32_t id, channel_t *ch )
   return (epg_broadcast_t*)epg_object_find_by_id(id, EPG_BROADCAST);
 }
 
+void epg_broadcast_remove ( epg_broadcast_t *broadcast )
+{
+  if ( broadcast->channel )
+    _epg_channel_rem_broadcast(broadcast->channel, broadcast, NULL);
+}
+
 epg_broadcast_t *epg_broadcast_find_by_eid ( channel_t *ch, uint16_t eid )
 {
   epg_broadcast_t *e;
@@ -2203,14 +2514,95 @@ static void _eqr_add
   eqr->eqr_array[eqr->eqr_entries++] = e;
 }
 
+/*
+ * Index candidates are grouped by channel and ordered by start time,
+ * matching the schedule walk
+ */
+typedef struct epg_query_index {
+  epg_broadcast_t **eqi_array;
+  int               eqi_entries;
+} epg_query_index_t;
+
+static int _eqi_cmp ( const void *a, const void *b )
+{
+  epg_broadcast_t *ea = *(epg_broadcast_t**)a, *eb = *(epg_broadcast_t**)b;
+  if (ea->channel != eb->channel)
+    return (uintptr_t)ea->channel < (uintptr_t)eb->channel ? -1 : 1;
+  return ea->start < eb->start ? -1 : ea->start > eb->start;
+}
+
+/*
+ * Reduce a title expression to the literal text every match must contain,
+ * allowing only leading/trailing anchors. Non-ASCII text is left to the
+ * full scan since case folding is locale specific.
+ */
+static int _eqr_literal ( const char *title, char *buf, size_t len )
+{
+  size_t i = 0;
+  if (*title == '^') title++;
+  for (; *title; title++) {
+    if (*title == '$' && !title[1]) break;
+    if ((uint8_t)*title >= 0x80 || strchr(".[]()*+?{}|^$\\", *title))
+      return 0;
+    if (i + 1 >= len) return 0;
+    buf[i++] = *title;
+  }
+  buf[i] = '\0';
+  return i >= 3;
+}
+
+static void _eqi_build
+  ( epg_query_index_t *eqi, const char *literal, time_t start )
+{
+  epg_episode_t **eps;
+  epg_broadcast_t *ebc;
+  int i, neps, alloced = 0;
+
+  memset(eqi, 0, sizeof(epg_query_index_t));
+  eps = _epg_trigram_match(literal, &neps);
+  for (i = 0; i < neps; i++) {
+    LIST_FOREACH(ebc, &eps[i]->broadcasts, ep_link) {
+      if (ebc->stop < start || !ebc->channel) continue;
+      if (eqi->eqi_entries == alloced) {
+        alloced = MAX(100, alloced * 2);
+        eqi->eqi_array = realloc(eqi->eqi_array,
+                                 alloced * sizeof(epg_broadcast_t*));
+      }
+      eqi->eqi_array[eqi->eqi_entries++] = ebc;
+    }
+  }
+  free(eps);
+  if (eqi->eqi_entries)
+    qsort(eqi->eqi_array, eqi->eqi_entries, sizeof(epg_broadcast_t*),
+          _eqi_cmp);
+}
+
 static void _eqr_add_channel 
   ( epg_query_result_t *eqr, channel_t *ch, epg_genre_t *genre,
-    regex_t *preg, time_t start, const char *lang )
+    regex_t *preg, time_t start, const char *lang, epg_query_index_t *eqi )
 {
   epg_broadcast_t *ebc;
-  RB_FOREACH(ebc, &ch->ch_epg_schedule, sched_link) {
-    if ( ebc->episode ) _eqr_add(eqr, ebc, genre, preg, start, lang);
+  int lo, hi, mid;
+
+  /* Full schedule */
+  if (!eqi) {
+    RB_FOREACH(ebc, &ch->ch_epg_schedule, sched_link) {
+      if ( ebc->episode ) _eqr_add(eqr, ebc, genre, preg, start, lang);
+    }
+    return;
   }
+
+  /* Index candidates */
+  lo = 0; hi = eqi->eqi_entries;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if ((uintptr_t)eqi->eqi_array[mid]->channel < (uintptr_t)ch)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (; lo < eqi->eqi_entries && eqi->eqi_array[lo]->channel == ch; lo++)
+    _eqr_add(eqr, eqi->eqi_array[lo], genre, preg, start, lang);
 }
 
 void epg_query0
@@ -2220,6 +2612,8 @@ void epg_query0
   time_t now;
   channel_tag_mapping_t *ctm;
   regex_t preg0, *preg;
+  epg_query_index_t eqi0, *eqi = NULL;
+  char literal[256];
   time(&now);
 
   /* Clear (just incase) */
@@ -2230,28 +2624,36 @@ void epg_query0
     if (regcomp(&preg0, title, REG_ICASE | REG_EXTENDED | REG_NOSUB) )
       return;
     preg = &preg0;
+
+    /* Candidates from the title index, still checked against preg
+     * (a single schedule is cheaper to walk) */
+    if (!channel && _eqr_literal(title, literal, sizeof(literal))) {
+      _eqi_build(&eqi0, literal, now);
+      eqi = &eqi0;
+    }
   } else {
     preg = NULL;
   }
   
   /* Single channel */
   if (channel && !tag) {
-    _eqr_add_channel(eqr, channel, genre, preg, now, lang);
+    _eqr_add_channel(eqr, channel, genre, preg, now, lang, eqi);
   
   /* Tag based */
   } else if ( tag ) {
     LIST_FOREACH(ctm, &tag->ct_ctms, ctm_tag_link) {
       if(channel == NULL || ctm->ctm_channel == channel)
-        _eqr_add_channel(eqr, ctm->ctm_channel, genre, preg, now, lang);
+        _eqr_add_channel(eqr, ctm->ctm_channel, genre, preg, now, lang, eqi);
     }
 
   /* All channels */
   } else {
     RB_FOREACH(channel, &channel_name_tree, ch_name_link) {
-      _eqr_add_channel(eqr, channel, genre, preg, now, lang);
+      _eqr_add_channel(eqr, channel, genre, preg, now, lang, eqi);
     }
   }
   if (preg) regfree(preg);
+  if (eqi)  free(eqi->eqi_array);
 
   return;
 }
@@ -109,9 +109,12 @@ struct epg_object
  
   epg_object_type_t       type;       ///< Specific object type
   uint32_t                id;         ///< Internal ID
-  char                   *uri;        ///< Unique ID (from grabber)
+  const char             *uri;        ///< Unique ID (from grabber, pooled)
   time_t                  created;    ///< Time the object was created
   time_t                  updated;    ///< Last time object was changed
+  uint64_t                changed;    ///< Change sequence number (0=none)
+  uint64_t                added;      ///< Sequence number it first got
+  RB_ENTRY(epg_object)    seq_link;   ///< Global change sequence link
 
   int                     _updated;   ///< Flag to indicate updated
   int                     refcount;   ///< Reference counting
@@ -127,6 +130,24 @@ struct epg_object
 
 /* Get an object by ID (special case usage) */
 epg_object_t *epg_object_find_by_id  ( uint32_t id, epg_object_type_t type );
+
+/* Change tracking
+ *
+ * Every update round (epg_updated()) gives each changed object a new
+ * value of the global change sequence, deleted broadcasts are recorded
+ * in a bounded journal. epg_change_epoch identifies the lifetime of the
+ * sequence, numbers from another epoch are meaningless.
+ */
+extern uint64_t epg_change_seq;
+extern time_t   epg_change_epoch;
+
+/* First object changed after seq, in sequence order */
+epg_object_t *epg_object_changed_after ( uint64_t seq );
+/* Check all broadcast deletions after seq are still in the journal */
+int           epg_journal_complete     ( uint64_t seq );
+/* First broadcast deleted after seq, returns 0 if found */
+int           epg_journal_deleted_after
+  ( uint64_t seq, uint64_t *dseq, uint32_t *id );
 htsmsg_t     *epg_object_serialize   ( epg_object_t *eo );
 epg_object_t *epg_object_deserialize ( htsmsg_t *msg, int create, int *save );
 
@@ -276,6 +297,9 @@ struct epg_episode
   epg_brand_t               *brand;         ///< (Grand-)Parent brand
   epg_season_t              *season;        ///< Parent season
   epg_broadcast_list_t       broadcasts;    ///< Broadcast list
+
+  uint32_t                  *trigrams;      ///< Indexed title trigrams
+  int                        trigram_cnt;   ///< Number of indexed trigrams
 };
 
 /* Lookup */
@@ -452,6 +476,9 @@ epg_broadcast_t *epg_broadcast_find_by_time
 epg_broadcast_t *epg_broadcast_find_by_eid ( struct channel *ch, uint16_t eid );
 epg_broadcast_t *epg_broadcast_find_by_id  ( uint32_t id, struct channel *ch );
 
+/* Removal */
+void epg_broadcast_remove ( epg_broadcast_t *b );
+
 /* Mutators */
 int epg_broadcast_set_episode
   ( epg_broadcast_t *b, epg_episode_t *e, struct epggrab_module *src )
@@ -559,6 +586,10 @@ void epg_init    (void);
 void epg_save    (void);
 void epg_updated (void);
 
+/* Journal of changes between database saves (epgdb.c) */
+void epgdb_journal_updated ( void );
+void epgdb_journal_deleted ( epg_broadcast_t *b );
+
 /* ************************************************************************
  * Miscellaneous
  * ***********************************************************************/
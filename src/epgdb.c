@@ -28,13 +28,346 @@
 #include "channels.h"
 #include "epg.h"
 #include "epggrab.h"
+#include "strpool.h"
 
-#define EPG_DB_VERSION 2
+#define EPG_DB_VERSION 3
 
 extern epg_object_tree_t epg_brands;
 extern epg_object_tree_t epg_seasons;
 extern epg_object_tree_t epg_episodes;
 extern epg_object_tree_t epg_serieslinks;
+extern epg_object_list_t epg_object_updated;
+
+/* Journal */
+static int                 epgdb_journal_fd = -1;
+static int                 epgdb_journal_ver;    ///< Database it applies to
+static int                 epgdb_journal_skip;   ///< Loading, nothing to record
+static int64_t             epgdb_journal_size;
+static int64_t             epgdb_snapshot_size;
+static htsmsg_binary_buf_t epgdb_journal_buf;    ///< Not yet written
+static htsmsg_binary_buf_t epgdb_journal_next;   ///< Since the save started
+static gtimer_t            epgdb_journal_timer;
+
+/* Save */
+static int                 epgdb_save_pending;
+static int                 epgdb_saving;
+static int                 epgdb_loaded_ver = -1; ///< Version of the file
+
+static void _epgdb_journal_load   ( struct stat *snap, int ver );
+static void _epgdb_journal_create ( struct stat *snap,
+                                    htsmsg_binary_buf_t *pending, int ver );
+static void _epg_save_init        ( void );
+static void _epg_save_request     ( void );
+
+/* **************************************************************************
+ * Format v3
+ * *************************************************************************/
+
+/*
+ * Layout (integers are big endian):
+ *
+ *   header   "TVHEPGDB", u32 version, u32 string count, u64 string table
+ *            offset, u64 chunk table offset, u32 chunk count, u32 spare
+ *   chunks   records of a single object type
+ *   strings  varint length, bytes, NUL; every field name and string value
+ *   table    per chunk: u32 object type, u32 records, u64 offset, u64 length
+ *
+ * A record is the htsmsg produced by the object serialiser: a varint field
+ * count then, per field, a varint name (string index + 1, 0 for none), the
+ * HMF_* type byte and the value. Values are zigzag varints (S64), string
+ * indexes (STR), varint length and bytes (BIN), 8 bytes (DBL) or a nested
+ * record (MAP/LIST).
+ *
+ * Chunks hold at most EPG_V3_CHUNK records so they can be decoded by
+ * several threads while the main thread creates the objects in file order.
+ */
+#define EPG_V3_MAGIC   "TVHEPGDB"
+#define EPG_V3_HEADER  40
+#define EPG_V3_CHUNK   4096
+#define EPG_V3_THREADS 8
+#define EPG_V3_DEPTH   8
+
+static inline uint8_t *_epgdb_reserve ( htsmsg_binary_buf_t *hbb, size_t len )
+{
+  if (hbb->hbb_len + len > hbb->hbb_size) {
+    hbb->hbb_size = MAX(hbb->hbb_size * 2, hbb->hbb_len + len + 4096);
+    hbb->hbb_data = realloc(hbb->hbb_data, hbb->hbb_size);
+  }
+  return hbb->hbb_data + hbb->hbb_len;
+}
+
+static inline void _epgdb_put
+  ( htsmsg_binary_buf_t *hbb, const void *data, size_t len )
+{
+  memcpy(_epgdb_reserve(hbb, len), data, len);
+  hbb->hbb_len += len;
+}
+
+static inline void _epgdb_put_varint ( htsmsg_binary_buf_t *hbb, uint64_t v )
+{
+  uint8_t *p = _epgdb_reserve(hbb, 10), *s = p;
+  while (v >= 0x80) {
+    *p++ = (v & 0x7f) | 0x80;
+    v  >>= 7;
+  }
+  *p++ = v;
+  hbb->hbb_len += p - s;
+}
+
+static inline void _epgdb_put_be ( uint8_t *p, uint64_t v, int len )
+{
+  while (len--) {
+    p[len] = v & 0xff;
+    v    >>= 8;
+  }
+}
+
+static inline uint64_t _epgdb_get_be ( const uint8_t *p, int len )
+{
+  uint64_t v = 0;
+  while (len--)
+    v = (v << 8) | *p++;
+  return v;
+}
+
+static inline int _epgdb_get_varint
+  ( const uint8_t **p, const uint8_t *end, uint64_t *v )
+{
+  int shift = 0;
+  *v = 0;
+  while (*p < end && shift < 64) {
+    *v |= (uint64_t)(**p & 0x7f) << shift;
+    if (!(*(*p)++ & 0x80)) return 0;
+    shift += 7;
+  }
+  return 1;
+}
+
+/*
+ * String table built while saving
+ */
+typedef struct epgdb_strtab {
+  uint32_t           *st_hash;   ///< Open addressing, string index + 1
+  uint32_t            st_hsize;
+  uint32_t            st_count;
+  uint32_t           *st_off;    ///< Position of each string in st_data
+  htsmsg_binary_buf_t st_data;   ///< Encoded table
+} epgdb_strtab_t;
+
+static uint32_t _epgdb_strhash ( const char *s )
+{
+  uint32_t h = 2166136261U;
+  while (*s)
+    h = (h ^ (uint8_t)*s++) * 16777619U;
+  return h;
+}
+
+static void _epgdb_strtab_free ( epgdb_strtab_t *st )
+{
+  free(st->st_hash);
+  free(st->st_off);
+  htsmsg_binary_buf_free(&st->st_data);
+  memset(st, 0, sizeof(epgdb_strtab_t));
+}
+
+static uint32_t _epgdb_strtab_add ( epgdb_strtab_t *st, const char *s )
+{
+  uint32_t i, h, idx, len;
+
+  /* Keep below half full */
+  if (st->st_count * 2 >= st->st_hsize) {
+    uint32_t *old = st->st_hash, osize = st->st_hsize;
+    st->st_hsize = MAX(1024, osize * 2);
+    st->st_hash  = calloc(st->st_hsize, sizeof(uint32_t));
+    st->st_off   = realloc(st->st_off, st->st_hsize / 2 * sizeof(uint32_t));
+    for (i = 0; i < osize; i++) {
+      if (!old[i]) continue;
+      h = _epgdb_strhash((char*)st->st_data.hbb_data + st->st_off[old[i]-1]);
+      while (st->st_hash[h & (st->st_hsize - 1)]) h++;
+      st->st_hash[h & (st->st_hsize - 1)] = old[i];
+    }
+    free(old);
+  }
+
+  for (h = _epgdb_strhash(s); (idx = st->st_hash[h & (st->st_hsize - 1)]); h++)
+    if (!strcmp((char*)st->st_data.hbb_data + st->st_off[idx-1], s))
+      return idx - 1;
+
+  len = strlen(s);
+  _epgdb_put_varint(&st->st_data, len);
+  st->st_off[st->st_count] = st->st_data.hbb_len;
+  _epgdb_put(&st->st_data, s, len + 1);
+  st->st_hash[h & (st->st_hsize - 1)] = ++st->st_count;
+  return st->st_count - 1;
+}
+
+static void _epgdb_v3_encode
+  ( htsmsg_binary_buf_t *hbb, epgdb_strtab_t *st, htsmsg_t *m )
+{
+  htsmsg_field_t *f;
+  uint64_t cnt = 0, u64;
+  uint8_t type;
+
+  HTSMSG_FOREACH(f, m)
+    cnt++;
+  _epgdb_put_varint(hbb, cnt);
+  HTSMSG_FOREACH(f, m) {
+    _epgdb_put_varint(hbb, f->hmf_name ?
+                           _epgdb_strtab_add(st, f->hmf_name) + 1 : 0);
+    type = f->hmf_type;
+    _epgdb_put(hbb, &type, 1);
+    switch (f->hmf_type) {
+      case HMF_MAP:
+      case HMF_LIST:
+        _epgdb_v3_encode(hbb, st, &f->hmf_msg);
+        break;
+      case HMF_S64:
+        _epgdb_put_varint(hbb, ((uint64_t)f->hmf_s64 << 1) ^
+                               (uint64_t)(f->hmf_s64 >> 63));
+        break;
+      case HMF_STR:
+        _epgdb_put_varint(hbb, _epgdb_strtab_add(st, f->hmf_str));
+        break;
+      case HMF_BIN:
+        _epgdb_put_varint(hbb, f->hmf_binsize);
+        _epgdb_put(hbb, f->hmf_bin, f->hmf_binsize);
+        break;
+      case HMF_DBL:
+        memcpy(&u64, &f->hmf_dbl, sizeof(u64));
+        _epgdb_put_be(_epgdb_reserve(hbb, 8), u64, 8);
+        hbb->hbb_len += 8;
+        break;
+    }
+  }
+}
+
+/*
+ * Database being loaded
+ */
+typedef struct epgdb_v3_chunk {
+  uint32_t        type;
+  uint32_t        count;
+  const uint8_t  *data;
+  size_t          len;
+  htsmsg_t      **msgs;   ///< Decoded records (NULL if corrupt)
+  int             done;
+} epgdb_v3_chunk_t;
+
+typedef struct epgdb_v3 {
+  const char      **strs;
+  uint32_t          nstrs;
+  epgdb_v3_chunk_t *chunks;
+  uint32_t          nchunks;
+  uint32_t          next;     ///< Next chunk to decode
+  uint32_t          consumed; ///< Chunks processed and freed
+  uint32_t          ahead;    ///< Max chunks decoded but not consumed
+  pthread_mutex_t   mutex;
+  pthread_cond_t    cond;
+} epgdb_v3_t;
+
+/*
+ * Decode fields into m, names, strings and binaries reference the
+ * (still mapped) file rather than being copied
+ */
+static int _epgdb_v3_decode
+  ( epgdb_v3_t *db, const uint8_t **p, const uint8_t *end,
+    htsmsg_t *m, int depth )
+{
+  htsmsg_field_t *f;
+  htsmsg_t *sub;
+  const char *name;
+  uint64_t cnt, u64;
+  uint8_t type;
+
+  if (depth > EPG_V3_DEPTH || _epgdb_get_varint(p, end, &cnt))
+    return -1;
+  while (cnt--) {
+    if (_epgdb_get_varint(p, end, &u64) || u64 > db->nstrs || *p >= end)
+      return -1;
+    name = u64 ? db->strs[u64 - 1] : NULL;
+    if (m->hm_islist != (name == NULL))
+      return -1;
+    type = *(*p)++;
+    if (type < HMF_MAP || type > HMF_DBL)
+      return -1;
+    f = htsmsg_field_add(m, name, type, 0);
+    switch (type) {
+      case HMF_MAP:
+      case HMF_LIST:
+        sub = &f->hmf_msg;
+        TAILQ_INIT(&sub->hm_fields);
+        sub->hm_islist = type == HMF_LIST;
+        sub->hm_nfields = 0;
+        sub->hm_index = NULL;
+        sub->hm_arena = m->hm_arena;
+        sub->hm_data = NULL;
+        if (_epgdb_v3_decode(db, p, end, sub, depth + 1))
+          return -1;
+        break;
+      case HMF_S64:
+        if (_epgdb_get_varint(p, end, &u64)) return -1;
+        f->hmf_s64 = (int64_t)(u64 >> 1) ^ -(int64_t)(u64 & 1);
+        break;
+      case HMF_STR:
+        if (_epgdb_get_varint(p, end, &u64) || u64 >= db->nstrs) return -1;
+        f->hmf_str = db->strs[u64];
+        break;
+      case HMF_BIN:
+        if (_epgdb_get_varint(p, end, &u64) || u64 > end - *p) return -1;
+        f->hmf_bin     = (const char*)*p;
+        f->hmf_binsize = u64;
+        *p += u64;
+        break;
+      case HMF_DBL:
+        if (end - *p < 8) return -1;
+        u64 = _epgdb_get_be(*p, 8);
+        memcpy(&f->hmf_dbl, &u64, sizeof(f->hmf_dbl));
+        *p += 8;
+        break;
+    }
+  }
+  return 0;
+}
+
+static void _epgdb_v3_decode_chunk ( epgdb_v3_t *db, epgdb_v3_chunk_t *c )
+{
+  const uint8_t *p = c->data, *end = c->data + c->len;
+  uint32_t i;
+
+  c->msgs = calloc(MAX(1, c->count), sizeof(htsmsg_t*));
+  for (i = 0; i < c->count; i++) {
+    c->msgs[i] = htsmsg_create_map_arena();
+    if (_epgdb_v3_decode(db, &p, end, c->msgs[i], 0)) {
+      do htsmsg_destroy(c->msgs[i]); while (i--);
+      free(c->msgs);
+      c->msgs = NULL;
+      return;
+    }
+  }
+}
+
+static void *_epgdb_v3_thread ( void *aux )
+{
+  epgdb_v3_t *db = aux;
+  epgdb_v3_chunk_t *c;
+
+  pthread_mutex_lock(&db->mutex);
+  while (db->next < db->nchunks) {
+    /* Don't get too far ahead, decoded chunks take a lot more memory */
+    if (db->next - db->consumed >= db->ahead) {
+      pthread_cond_wait(&db->cond, &db->mutex);
+      continue;
+    }
+    c = &db->chunks[db->next++];
+    pthread_mutex_unlock(&db->mutex);
+    _epgdb_v3_decode_chunk(db, c);
+    pthread_mutex_lock(&db->mutex);
+    c->done = 1;
+    pthread_cond_broadcast(&db->cond);
+  }
+  pthread_mutex_unlock(&db->mutex);
+  return NULL;
+}
 
 /* **************************************************************************
  * Load
@@ -136,48 +469,140 @@ static void _epgdb_v2_process ( htsmsg_t *m, epggrab_stats_t *stats )
 }
 
 /*
- * Load data
+ * Process v3 data
  */
-void epg_init ( void )
+static void _epgdb_v3_process
+  ( uint32_t type, htsmsg_t *m, epggrab_stats_t *stats )
 {
-  int fd = -1;
-  struct stat st;
-  size_t remain;
-  uint8_t *mem, *rp;
-  epggrab_stats_t stats;
-  int ver = EPG_DB_VERSION;
-
-  /* Find the right file (and version) */
-  while (fd < 0 && ver > 0) {
-    fd = hts_settings_open_file(0, "epgdb.v%d", ver);
-    if (fd > 0) break;
-    ver--;
-  }
-  if ( fd < 0 )
-    fd = hts_settings_open_file(0, "epgdb");
-  if ( fd < 0 ) {
-    tvhlog(LOG_DEBUG, "epgdb", "database does not exist");
-    return;
+  int save = 0;
+  switch (type) {
+    case EPG_BRAND:
+      if (epg_brand_deserialize(m, 1, &save)) stats->brands.total++;
+      break;
+    case EPG_SEASON:
+      if (epg_season_deserialize(m, 1, &save)) stats->seasons.total++;
+      break;
+    case EPG_EPISODE:
+      if (epg_episode_deserialize(m, 1, &save)) stats->episodes.total++;
+      break;
+    case EPG_SERIESLINK:
+      if (epg_serieslink_deserialize(m, 1, &save)) stats->seasons.total++;
+      break;
+    case EPG_BROADCAST:
+      if (epg_broadcast_deserialize(m, 1, &save)) stats->broadcasts.total++;
+      break;
+    default:
+      tvhlog(LOG_DEBUG, "epgdb", "malformed database chunk [%u]", type);
+      break;
   }
-  
-  /* Map file to memory */
-  if ( fstat(fd, &st) != 0 ) {
-    tvhlog(LOG_ERR, "epgdb", "failed to detect database size");
-    return;
+}
+
+/*
+ * Load a v3 file, returns 1 if (some) data was lost
+ */
+static int _epgdb_v3_load
+  ( const uint8_t *mem, size_t size, epggrab_stats_t *stats )
+{
+  epgdb_v3_t db;
+  epgdb_v3_chunk_t *c;
+  pthread_t tids[EPG_V3_THREADS];
+  const uint8_t *p, *end = mem + size;
+  uint64_t stroff, taboff, u64;
+  uint32_t i, j;
+  int nthreads, ret = 1;
+
+  /* Header */
+  if (size < EPG_V3_HEADER || memcmp(mem, EPG_V3_MAGIC, 8) ||
+      _epgdb_get_be(mem + 8, 4) != 3)
+    return 1;
+  memset(&db, 0, sizeof(db));
+  db.nstrs   = _epgdb_get_be(mem + 12, 4);
+  stroff     = _epgdb_get_be(mem + 16, 8);
+  taboff     = _epgdb_get_be(mem + 24, 8);
+  db.nchunks = _epgdb_get_be(mem + 32, 4);
+  if (stroff > size || db.nstrs > size - stroff ||
+      taboff > size || db.nchunks > (size - taboff) / 24)
+    return 1;
+
+  /* Strings (used in place) */
+  db.strs = malloc(MAX(1, db.nstrs) * sizeof(char*));
+  p = mem + stroff;
+  for (i = 0; i < db.nstrs; i++) {
+    if (_epgdb_get_varint(&p, end, &u64) || u64 >= end - p || p[u64])
+      goto out;
+    db.strs[i] = (const char*)p;
+    p += u64 + 1;
   }
-  if ( !st.st_size ) {
-    tvhlog(LOG_DEBUG, "epgdb", "database is empty");
-    return;
+
+  /* Chunks */
+  db.chunks = calloc(MAX(1, db.nchunks), sizeof(epgdb_v3_chunk_t));
+  for (i = 0; i < db.nchunks; i++) {
+    c        = &db.chunks[i];
+    p        = mem + taboff + i * 24;
+    c->type  = _epgdb_get_be(p, 4);
+    c->count = _epgdb_get_be(p + 4, 4);
+    u64      = _epgdb_get_be(p + 8, 8);
+    c->len   = _epgdb_get_be(p + 16, 8);
+    if (u64 > size || c->len > size - u64) goto out;
+    c->data  = mem + u64;
   }
-  remain   = st.st_size;
-  rp = mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-  if ( mem == MAP_FAILED ) {
-    tvhlog(LOG_ERR, "epgdb", "failed to mmap database");
-    return;
+
+  /* Decode ahead in worker threads (this one helps out) */
+  pthread_mutex_init(&db.mutex, NULL);
+  pthread_cond_init(&db.cond, NULL);
+  nthreads = MIN(EPG_V3_THREADS, sysconf(_SC_NPROCESSORS_ONLN) - 1);
+  nthreads = MIN(nthreads, (int)db.nchunks - 1);
+  db.ahead = 2 * MAX(nthreads, 1);
+  for (i = j = 0; (int)i < nthreads; i++)
+    if (!pthread_create(&tids[j], NULL, _epgdb_v3_thread, &db)) j++;
+  nthreads = j;
+
+  /* Create the objects in order */
+  ret = 0;
+  for (i = 0; i < db.nchunks; i++) {
+    c = &db.chunks[i];
+    pthread_mutex_lock(&db.mutex);
+    if (db.next == i) {
+      db.next++;
+      pthread_mutex_unlock(&db.mutex);
+      _epgdb_v3_decode_chunk(&db, c);
+      pthread_mutex_lock(&db.mutex);
+      c->done = 1;
+    }
+    while (!c->done)
+      pthread_cond_wait(&db.cond, &db.mutex);
+    pthread_mutex_unlock(&db.mutex);
+    if (!c->msgs) {
+      ret = 1;
+    } else {
+      for (j = 0; j < c->count; j++) {
+        _epgdb_v3_process(c->type, c->msgs[j], stats);
+        htsmsg_destroy(c->msgs[j]);
+      }
+      free(c->msgs);
+    }
+    pthread_mutex_lock(&db.mutex);
+    db.consumed = i + 1;
+    pthread_cond_broadcast(&db.cond);
+    pthread_mutex_unlock(&db.mutex);
   }
+  for (i = 0; i < nthreads; i++)
+    pthread_join(tids[i], NULL);
+  pthread_cond_destroy(&db.cond);
+  pthread_mutex_destroy(&db.mutex);
 
-  /* Process */
-  memset(&stats, 0, sizeof(stats));
+out:
+  free(db.chunks);
+  free(db.strs);
+  return ret;
+}
+
+/*
+ * Load a v0-2 file, returns 1 if (some) data was lost
+ */
+static int _epgdb_v2_load
+  ( const uint8_t *rp, size_t remain, int ver, epggrab_stats_t *stats )
+{
   while ( remain > 4 ) {
 
     /* Get message length */
@@ -186,10 +611,8 @@ void epg_init ( void )
     rp        += 4;
 
     /* Safety check */
-    if (msglen > remain) {
-      tvhlog(LOG_ERR, "epgdb", "corruption detected, some/all data lost");
-      break;
-    }
+    if (msglen > remain)
+      return 1;
     
     /* Extract message */
     htsmsg_t *m = htsmsg_binary_deserialize(rp, msglen, NULL);
@@ -204,16 +627,68 @@ void epg_init ( void )
     /* Process */
     switch (ver) {
       case 2:
-        _epgdb_v2_process(m, &stats);
+        _epgdb_v2_process(m, stats);
         break;
       default: /* v0/1 */
-        _epgdb_v1_process(m, &stats);
+        _epgdb_v1_process(m, stats);
         break;
     }
 
     /* Cleanup */
     htsmsg_destroy(m);
   }
+  return 0;
+}
+
+/*
+ * Load data, returns the version of the file or -1
+ */
+static int _epgdb_load ( struct stat *st )
+{
+  int fd = -1, r;
+  uint8_t *mem;
+  epggrab_stats_t stats;
+  int ver = EPG_DB_VERSION;
+
+  /* Find the right file (and version) */
+  while (fd < 0 && ver > 0) {
+    fd = hts_settings_open_file(0, "epgdb.v%d", ver);
+    if (fd > 0) break;
+    ver--;
+  }
+  if ( fd < 0 )
+    fd = hts_settings_open_file(0, "epgdb");
+  if ( fd < 0 ) {
+    tvhlog(LOG_DEBUG, "epgdb", "database does not exist");
+    return -1;
+  }
+  
+  /* Map file to memory */
+  if ( fstat(fd, st) != 0 ) {
+    tvhlog(LOG_ERR, "epgdb", "failed to detect database size");
+    close(fd);
+    return -1;
+  }
+  if ( !st->st_size ) {
+    tvhlog(LOG_DEBUG, "epgdb", "database is empty");
+    close(fd);
+    return ver;
+  }
+  mem = mmap(NULL, st->st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if ( mem == MAP_FAILED ) {
+    tvhlog(LOG_ERR, "epgdb", "failed to mmap database");
+    close(fd);
+    return -1;
+  }
+
+  /* Process */
+  memset(&stats, 0, sizeof(stats));
+  if (ver == 3)
+    r = _epgdb_v3_load(mem, st->st_size, &stats);
+  else
+    r = _epgdb_v2_load(mem, st->st_size, ver, &stats);
+  if (r)
+    tvhlog(LOG_ERR, "epgdb", "corruption detected, some/all data lost");
 
   /* Stats */
   tvhlog(LOG_INFO, "epgdb", "loaded v%d", ver);
@@ -224,89 +699,598 @@ void epg_init ( void )
   tvhlog(LOG_INFO, "epgdb", "  broadcasts %d", stats.broadcasts.total);
 
   /* Close file */
-  munmap(mem, st.st_size);
+  munmap(mem, st->st_size);
   close(fd);
+  return ver;
+}
+
+void epg_init ( void )
+{
+  struct stat st;
+
+  epg_change_epoch = time(NULL);
+  _epg_save_init();
+
+  /* Snapshot then the changes since */
+  memset(&st, 0, sizeof(st));
+  epgdb_journal_skip = 1;
+  epgdb_loaded_ver = _epgdb_load(&st);
+  _epgdb_journal_load(&st, epgdb_loaded_ver < 0 ? EPG_DB_VERSION
+                                                 : epgdb_loaded_ver);
+
+  /* Convert older files */
+  if (epgdb_loaded_ver >= 0 && epgdb_loaded_ver != EPG_DB_VERSION)
+    _epg_save_request();
 }
 
 /* **************************************************************************
- * Save
+ * Journal
  * *************************************************************************/
 
-static int _epg_write ( int fd, htsmsg_t *m )
+/*
+ * Changes between saves are appended to epgdb.vN.journal (N being the
+ * version of the database file, records are always htsmsg binary): each
+ * object updated by epg_updated() is written in full and broadcasts
+ * removed from a schedule are recorded as deletions. The first message
+ * identifies the database file the journal applies to, on load the
+ * journal is replayed over it (and ignored if it belongs to another
+ * file).
+ *
+ * Records are written at the end of every update round, or within
+ * EPG_JOURNAL_FLUSH seconds for deletions. Once the journal grows past
+ * 1/EPG_JOURNAL_RATIO of the database (and EPG_JOURNAL_MIN) a full save
+ * is done in the background, which starts a new journal.
+ */
+#define EPG_JOURNAL_RATIO 2
+#define EPG_JOURNAL_MIN   (1024 * 1024)
+#define EPG_JOURNAL_FLUSH 5
+
+static htsmsg_t *_epgdb_journal_header ( struct stat *snap, int ver )
 {
-  int ret = 1;
-  size_t msglen;
-  void *msgdata;
-  if (m) {
-    int r = htsmsg_binary_serialize(m, &msgdata, &msglen, 0x10000);
+  htsmsg_t *m = htsmsg_create_map();
+  htsmsg_add_u32(m, "__journal__", ver);
+  htsmsg_add_s64(m, "ino",   snap->st_ino);
+  htsmsg_add_s64(m, "size",  snap->st_size);
+  htsmsg_add_s64(m, "mtime", snap->st_mtime);
+  return m;
+}
+
+static int _epgdb_journal_match ( htsmsg_t *m, struct stat *snap, int ver )
+{
+  int64_t ino, size, mtime;
+  if (htsmsg_get_u32_or_default(m, "__journal__", 0) != ver)
+    return 0;
+  if (htsmsg_get_s64(m, "ino", &ino) ||
+      htsmsg_get_s64(m, "size", &size) ||
+      htsmsg_get_s64(m, "mtime", &mtime))
+    return 0;
+  return ino == snap->st_ino && size == snap->st_size &&
+         mtime == snap->st_mtime;
+}
+
+static int _epgdb_journal_replay ( htsmsg_t *m )
+{
+  channel_t *ch;
+  epg_broadcast_t *ebc;
+  uint32_t chid;
+  int64_t start, stop;
+  int save = 0;
+
+  /* Deleted broadcast */
+  if (htsmsg_get_u32_or_default(m, "__delete__", 0) == EPG_BROADCAST) {
+    if (htsmsg_get_u32(m, "channel", &chid) ||
+        htsmsg_get_s64(m, "start", &start) ||
+        htsmsg_get_s64(m, "stop", &stop))
+      return 0;
+    if (!(ch = channel_find_by_identifier(chid))) return 0;
+    ebc = epg_broadcast_find_by_time(ch, start, stop, 0, 0, NULL);
+    if (ebc) epg_broadcast_remove(ebc);
+    return 1;
+  }
+
+  /* Updated object */
+  return epg_object_deserialize(m, 1, &save) != NULL;
+}
+
+static void _epgdb_journal_load ( struct stat *snap, int ver )
+{
+  int fd;
+  struct stat st;
+  size_t remain, msglen;
+  uint8_t *mem = NULL, *rp;
+  htsmsg_t *m;
+  int valid = 0, cnt = 0;
+
+  if ((fd = hts_settings_open_file(0, "epgdb.v%d.journal", ver)) < 0) {
+    _epgdb_journal_create(snap, NULL, ver);
+    return;
+  }
+  if (!fstat(fd, &st) && st.st_size > 4)
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (!mem || mem == MAP_FAILED) {
+    _epgdb_journal_create(snap, NULL, ver);
+    return;
+  }
+
+  /* Process */
+  rp     = mem;
+  remain = st.st_size;
+  while ( remain > 4 ) {
+    msglen = (rp[0] << 24) | (rp[1] << 16) | (rp[2] << 8) | rp[3];
+    if (msglen > remain - 4) break;
+    m = htsmsg_binary_deserialize(rp + 4, msglen, NULL);
+    if (!m) break;
+    if (!valid) {
+      if (!(valid = _epgdb_journal_match(m, snap, ver))) {
+        htsmsg_destroy(m);
+        break;
+      }
+    } else {
+      cnt += _epgdb_journal_replay(m);
+    }
     htsmsg_destroy(m);
-    if (!r) {
-      ssize_t w = write(fd, msgdata, msglen);
-      free(msgdata);
-      if(w == msglen) ret = 0;
+    rp     += 4 + msglen;
+    remain -= 4 + msglen;
+  }
+  munmap(mem, st.st_size);
+
+  if (!valid) {
+    tvhlog(LOG_INFO, "epgdb", "journal does not match database, ignored");
+    _epgdb_journal_create(snap, NULL, ver);
+    return;
+  }
+  tvhlog(LOG_INFO, "epgdb", "journal replayed %d changes", cnt);
+
+  /* Continue after the last complete record */
+  epgdb_snapshot_size = snap->st_size;
+  epgdb_journal_size  = st.st_size - remain;
+  epgdb_journal_ver   = ver;
+  epgdb_journal_fd    = hts_settings_open_file(2, "epgdb.v%d.journal", ver);
+  if (epgdb_journal_fd >= 0 && remain) {
+    tvhlog(LOG_ERR, "epgdb", "journal truncated, %zu bytes lost", remain);
+    if (ftruncate(epgdb_journal_fd, epgdb_journal_size)) {
+      close(epgdb_journal_fd);
+      epgdb_journal_fd = -1;
     }
+  }
+}
+
+/*
+ * Start a new journal for the given database file, holding pending
+ */
+static void _epgdb_journal_create
+  ( struct stat *snap, htsmsg_binary_buf_t *pending, int ver )
+{
+  char path[32], tmp[40];
+  htsmsg_binary_buf_t hbb;
+  int fd, r = 1;
+
+  if (epgdb_journal_fd >= 0) close(epgdb_journal_fd);
+  epgdb_journal_fd = -1;
+  gtimer_disarm(&epgdb_journal_timer);
+  epgdb_journal_buf.hbb_len = 0;
+
+  snprintf(path, sizeof(path), "epgdb.v%d.journal", ver);
+  snprintf(tmp,  sizeof(tmp),  "%s.tmp", path);
+  memset(&hbb, 0, sizeof(hbb));
+  if ((fd = hts_settings_open_file(1, "%s", tmp)) >= 0) {
+    htsmsg_t *m = _epgdb_journal_header(snap, ver);
+    r = htsmsg_binary_serialize_buf(m, &hbb, 0x10000);
+    htsmsg_destroy(m);
+    if (!r && write(fd, hbb.hbb_data, hbb.hbb_len) != hbb.hbb_len)
+      r = 1;
+    if (!r && pending && pending->hbb_len &&
+        write(fd, pending->hbb_data, pending->hbb_len) != pending->hbb_len)
+      r = 1;
+    if (close(fd)) r = 1;
+    if (!r) r = hts_settings_rename(tmp, path);
+  }
+  if (r) {
+    tvhlog(LOG_ERR, "epgdb", "failed to create journal");
+    hts_settings_remove("%s", tmp);
   } else {
-    ret = 0;
+    epgdb_snapshot_size = snap->st_size;
+    epgdb_journal_size  = hbb.hbb_len + (pending ? pending->hbb_len : 0);
+    epgdb_journal_ver   = ver;
+    epgdb_journal_fd    = hts_settings_open_file(2, "%s", path);
   }
-  if(ret) {
-    tvhlog(LOG_ERR, "epgdb", "failed to store epg to disk");
-    close(fd);
-    hts_settings_remove("epgdb.v%d", EPG_DB_VERSION);
+  htsmsg_binary_buf_free(&hbb);
+}
+
+static void _epgdb_journal_flush ( void )
+{
+  htsmsg_binary_buf_t *hbb = &epgdb_journal_buf;
+
+  gtimer_disarm(&epgdb_journal_timer);
+  if (epgdb_journal_fd < 0 || !hbb->hbb_len) return;
+
+  if (write(epgdb_journal_fd, hbb->hbb_data, hbb->hbb_len) != hbb->hbb_len) {
+    tvhlog(LOG_ERR, "epgdb", "failed to write journal");
+    close(epgdb_journal_fd);
+    epgdb_journal_fd = -1;
+    _epg_save_request();
+  } else {
+    epgdb_journal_size += hbb->hbb_len;
   }
-  return ret;
+  hbb->hbb_len = 0;
+  if (hbb->hbb_size > EPG_JOURNAL_MIN)
+    htsmsg_binary_buf_free(hbb);
+
+  /* Compact */
+  if (epgdb_journal_size >
+      MAX(EPG_JOURNAL_MIN, epgdb_snapshot_size / EPG_JOURNAL_RATIO))
+    _epg_save_request();
 }
 
-static int _epg_write_sect ( int fd, const char *sect )
+static void _epgdb_journal_timer ( void *p )
 {
-  htsmsg_t *m = htsmsg_create_map();
-  htsmsg_add_str(m, "__section__", sect);
-  return _epg_write(fd, m);
+  _epgdb_journal_flush();
 }
 
-void epg_save ( void )
+static void _epgdb_journal_add ( htsmsg_t *m )
 {
-  int fd;
+  if (!m) return;
+  if (!epgdb_journal_buf.hbb_len)
+    gtimer_arm(&epgdb_journal_timer, _epgdb_journal_timer, NULL,
+               EPG_JOURNAL_FLUSH);
+  htsmsg_binary_serialize_buf(m, &epgdb_journal_buf, 0x10000);
+  if (epgdb_saving)
+    htsmsg_binary_serialize_buf(m, &epgdb_journal_next, 0x10000);
+  htsmsg_destroy(m);
+}
+
+/* Still scheduled (a removed broadcast can outlive its deletion record) */
+static int _epgdb_journal_live ( epg_object_t *eo )
+{
+  epg_broadcast_t *ebc = (epg_broadcast_t*)eo;
+  if (eo->type != EPG_BROADCAST) return 1;
+  return ebc->channel &&
+         epg_broadcast_find_by_time(ebc->channel, ebc->start, ebc->stop,
+                                    0, 0, NULL) == ebc;
+}
+
+void epgdb_journal_updated ( void )
+{
+  static const int types[] = {
+    EPG_BRAND, EPG_SEASON, EPG_EPISODE, EPG_SERIESLINK, EPG_BROADCAST
+  };
   epg_object_t *eo;
-  epg_broadcast_t *ebc;
+  int i;
+
+  /* The round following load covers what was read */
+  if (epgdb_journal_skip) {
+    epgdb_journal_skip = 0;
+    return;
+  }
+  if (epgdb_journal_fd < 0 && !epgdb_saving) return;
+
+  /* In the order objects refer to each other */
+  for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    LIST_FOREACH(eo, &epg_object_updated, up_link)
+      if (eo->type == types[i] && _epgdb_journal_live(eo))
+        _epgdb_journal_add(epg_object_serialize(eo));
+  _epgdb_journal_flush();
+}
+
+void epgdb_journal_deleted ( epg_broadcast_t *ebc )
+{
+  htsmsg_t *m;
+
+  if (epgdb_journal_skip || !ebc->channel) return;
+  if (epgdb_journal_fd < 0 && !epgdb_saving) return;
+  m = htsmsg_create_map();
+  htsmsg_add_u32(m, "__delete__", EPG_BROADCAST);
+  htsmsg_add_u32(m, "channel", ebc->channel->ch_id);
+  htsmsg_add_s64(m, "start", ebc->start);
+  htsmsg_add_s64(m, "stop", ebc->stop);
+  _epgdb_journal_add(m);
+}
+
+/* **************************************************************************
+ * Save
+ * *************************************************************************/
+
+/*
+ * Saving runs with global_lock held but drops it each time about
+ * EPG_WRITE_BLOCK bytes have been serialised, while that block is written.
+ * The walk then resumes after the last key written (uri, or channel and
+ * start time for broadcasts), so objects changed in between may or may not
+ * be included (changes made meanwhile are also kept for the new journal,
+ * replaying them over the result gives the current state). The file is
+ * written to a .tmp and renamed into place once complete.
+ *
+ * Saves are done by a background thread when the journal needs compacting
+ * (or an older version file was loaded).
+ */
+#define EPG_WRITE_BLOCK (64 * 1024)
+
+typedef struct epgdb_save {
+  int                 fd;
+  htsmsg_binary_buf_t hbb;       ///< Not yet written
+  uint64_t            off;       ///< File offset of hbb
+  epgdb_strtab_t      strtab;
+  htsmsg_binary_buf_t chunks;    ///< Chunk table
+  uint32_t            nchunks;
+  uint32_t            type;      ///< Current chunk
+  uint32_t            count;
+  uint64_t            start;
+  epggrab_stats_t     stats;
+} epgdb_save_t;
+
+static pthread_cond_t epgdb_save_cond;
+
+static int _epg_uri_cmp ( const void *a, const void *b )
+{
+  return strcmp(((epg_object_t*)a)->uri, ((epg_object_t*)b)->uri);
+}
+
+static int _epg_start_cmp ( const void *a, const void *b )
+{
+  time_t x = ((epg_broadcast_t*)a)->start, y = ((epg_broadcast_t*)b)->start;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * Close the current chunk, and start the next one (of type)
+ */
+static void _epg_write_chunk ( epgdb_save_t *es, uint32_t type )
+{
+  uint64_t end = es->off + es->hbb.hbb_len;
+  uint8_t *p;
+
+  if (es->count) {
+    p = _epgdb_reserve(&es->chunks, 24);
+    _epgdb_put_be(p,      es->type,  4);
+    _epgdb_put_be(p + 4,  es->count, 4);
+    _epgdb_put_be(p + 8,  es->start, 8);
+    _epgdb_put_be(p + 16, end - es->start, 8);
+    es->chunks.hbb_len += 24;
+    es->nchunks++;
+  }
+  es->type  = type;
+  es->count = 0;
+  es->start = end;
+}
+
+static int _epg_write_out ( epgdb_save_t *es, const void *data, size_t len )
+{
+  if (len && write(es->fd, data, len) != len) return 1;
+  es->off += len;
+  return 0;
+}
+
+/*
+ * Serialise m, returns 1 on error and -1 if global_lock was dropped (the
+ * caller must look up its position again)
+ */
+static int _epg_write ( epgdb_save_t *es, htsmsg_t *m )
+{
+  int r;
+  if (!m) return 0;
+  _epgdb_v3_encode(&es->hbb, &es->strtab, m);
+  htsmsg_destroy(m);
+  if (++es->count == EPG_V3_CHUNK)
+    _epg_write_chunk(es, es->type);
+  if (es->hbb.hbb_len < EPG_WRITE_BLOCK) return 0;
+  pthread_mutex_unlock(&global_lock);
+  r = _epg_write_out(es, es->hbb.hbb_data, es->hbb.hbb_len);
+  es->hbb.hbb_len = 0;
+  pthread_mutex_lock(&global_lock);
+  return r ? 1 : -1;
+}
+
+static int _epg_save_tree ( epgdb_save_t *es, epg_object_tree_t *tree,
+                            uint32_t type, int *total )
+{
+  epg_object_t *eo, skel;
+  int r;
+
+  _epg_write_chunk(es, type);
+  eo = RB_FIRST(tree);
+  while (eo) {
+    skel.uri = strpool_ref(eo->uri);
+    r = _epg_write(es, epg_object_serialize(eo));
+    if (r > 0) {
+      strpool_put(skel.uri);
+      return 1;
+    }
+    (*total)++;
+    if (r < 0)
+      eo = RB_FIND_GT(tree, &skel, uri_link, _epg_uri_cmp);
+    else
+      eo = RB_NEXT(eo, uri_link);
+    strpool_put(skel.uri);
+  }
+  return 0;
+}
+
+static int _epg_save_broadcasts ( epgdb_save_t *es )
+{
   channel_t *ch;
-  epggrab_stats_t stats;
-  
-  fd = hts_settings_open_file(1, "epgdb.v%d", EPG_DB_VERSION);
+  epg_broadcast_t *ebc, skel;
+  int i, r, cnt = 0, *ids;
 
-  memset(&stats, 0, sizeof(stats));
-  if ( _epg_write_sect(fd, "brands") ) return;
-  RB_FOREACH(eo,  &epg_brands, uri_link) {
-    if (_epg_write(fd, epg_brand_serialize((epg_brand_t*)eo))) return;
-    stats.brands.total++;
-  }
-  if ( _epg_write_sect(fd, "seasons") ) return;
-  RB_FOREACH(eo,  &epg_seasons, uri_link) {
-    if (_epg_write(fd, epg_season_serialize((epg_season_t*)eo))) return;
-    stats.seasons.total++;
-  }
-  if ( _epg_write_sect(fd, "episodes") ) return;
-  RB_FOREACH(eo,  &epg_episodes, uri_link) {
-    if (_epg_write(fd, epg_episode_serialize((epg_episode_t*)eo))) return;
-    stats.episodes.total++;
-  }
-  if ( _epg_write_sect(fd, "serieslinks") ) return;
-  RB_FOREACH(eo, &epg_serieslinks, uri_link) {
-    if (_epg_write(fd, epg_serieslink_serialize((epg_serieslink_t*)eo)))
-      return;
-    stats.seasons.total++;
+  _epg_write_chunk(es, EPG_BROADCAST);
+
+  /* Channels may go away while unlocked, remember them by id */
+  RB_FOREACH(ch, &channel_name_tree, ch_name_link)
+    cnt++;
+  ids = malloc(MAX(1, cnt) * sizeof(int));
+  cnt = 0;
+  RB_FOREACH(ch, &channel_name_tree, ch_name_link)
+    ids[cnt++] = ch->ch_id;
+
+  for (i = 0; i < cnt; i++) {
+    if (!(ch = channel_find_by_identifier(ids[i]))) continue;
+    ebc = RB_FIRST(&ch->ch_epg_schedule);
+    while (ebc) {
+      skel.start = ebc->start;
+      if ((r = _epg_write(es, epg_broadcast_serialize(ebc))) > 0) {
+        free(ids);
+        return 1;
+      }
+      es->stats.broadcasts.total++;
+      if (r == 0)
+        ebc = RB_NEXT(ebc, sched_link);
+      else if ((ch = channel_find_by_identifier(ids[i])))
+        ebc = RB_FIND_GT(&ch->ch_epg_schedule, &skel, sched_link,
+                         _epg_start_cmp);
+      else
+        ebc = NULL;
+    }
   }
-  if ( _epg_write_sect(fd, "broadcasts") ) return;
-  RB_FOREACH(ch, &channel_name_tree, ch_name_link) {
-    RB_FOREACH(ebc, &ch->ch_epg_schedule, sched_link) {
-      if (_epg_write(fd, epg_broadcast_serialize(ebc))) return;
-      stats.broadcasts.total++;
+  free(ids);
+  return 0;
+}
+
+static int _epg_save ( epgdb_save_t *es )
+{
+  uint8_t hdr[EPG_V3_HEADER];
+  uint64_t stroff, taboff;
+  int r;
+
+  /* Header is filled in last */
+  memset(_epgdb_reserve(&es->hbb, EPG_V3_HEADER), 0, EPG_V3_HEADER);
+  es->hbb.hbb_len = EPG_V3_HEADER;
+
+  /* Objects */
+  if ( _epg_save_tree(es, &epg_brands, EPG_BRAND,
+                      &es->stats.brands.total) ) return 1;
+  if ( _epg_save_tree(es, &epg_seasons, EPG_SEASON,
+                      &es->stats.seasons.total) ) return 1;
+  if ( _epg_save_tree(es, &epg_episodes, EPG_EPISODE,
+                      &es->stats.episodes.total) ) return 1;
+  if ( _epg_save_tree(es, &epg_serieslinks, EPG_SERIESLINK,
+                      &es->stats.seasons.total) ) return 1;
+  if ( _epg_save_broadcasts(es) ) return 1;
+  _epg_write_chunk(es, 0);
+
+  /* Strings, chunk table and header */
+  pthread_mutex_unlock(&global_lock);
+  r = _epg_write_out(es, es->hbb.hbb_data, es->hbb.hbb_len);
+  stroff = es->off;
+  if (!r)
+    r = _epg_write_out(es, es->strtab.st_data.hbb_data,
+                       es->strtab.st_data.hbb_len);
+  taboff = es->off;
+  if (!r)
+    r = _epg_write_out(es, es->chunks.hbb_data, es->chunks.hbb_len);
+  if (!r) {
+    memcpy(hdr, EPG_V3_MAGIC, 8);
+    _epgdb_put_be(hdr + 8,  EPG_DB_VERSION,        4);
+    _epgdb_put_be(hdr + 12, es->strtab.st_count,   4);
+    _epgdb_put_be(hdr + 16, stroff,                8);
+    _epgdb_put_be(hdr + 24, taboff,                8);
+    _epgdb_put_be(hdr + 32, es->nchunks,           4);
+    _epgdb_put_be(hdr + 36, 0,                     4);
+    if (pwrite(es->fd, hdr, sizeof(hdr), 0) != sizeof(hdr)) r = 1;
+  }
+  pthread_mutex_lock(&global_lock);
+  return r;
+}
+
+/*
+ * Write the database, called with global_lock held (which is dropped
+ * while writing)
+ */
+static void _epg_save_run ( void )
+{
+  char path[32], tmp[40];
+  struct stat st;
+  epgdb_save_t es;
+  int r;
+
+  while (epgdb_saving)
+    pthread_cond_wait(&epgdb_save_cond, &global_lock);
+  epgdb_saving = 1;
+  epgdb_journal_next.hbb_len = 0;
+
+  snprintf(path, sizeof(path), "epgdb.v%d", EPG_DB_VERSION);
+  snprintf(tmp,  sizeof(tmp),  "%s.tmp", path);
+  memset(&es, 0, sizeof(es));
+  if ((es.fd = hts_settings_open_file(1, "%s", tmp)) < 0) {
+    r = 1;
+  } else {
+    r = _epg_save(&es);
+    if (!r && fstat(es.fd, &st)) r = 1;
+    if (close(es.fd)) r = 1;
+  }
+  htsmsg_binary_buf_free(&es.hbb);
+  htsmsg_binary_buf_free(&es.chunks);
+  _epgdb_strtab_free(&es.strtab);
+  if (!r && hts_settings_rename(tmp, path)) r = 1;
+
+  if (r) {
+    tvhlog(LOG_ERR, "epgdb", "failed to store epg to disk");
+    hts_settings_remove("%s", tmp);
+  } else {
+    _epgdb_journal_create(&st, &epgdb_journal_next, EPG_DB_VERSION);
+
+    /* Replaced an older version */
+    if (epgdb_loaded_ver >= 0 && epgdb_loaded_ver != EPG_DB_VERSION) {
+      tvhlog(LOG_INFO, "epgdb", "converted v%d database to v%d",
+             epgdb_loaded_ver, EPG_DB_VERSION);
+      if (epgdb_loaded_ver)
+        hts_settings_remove("epgdb.v%d", epgdb_loaded_ver);
+      else
+        hts_settings_remove("epgdb");
+      hts_settings_remove("epgdb.v%d.journal", epgdb_loaded_ver);
     }
+    epgdb_loaded_ver = EPG_DB_VERSION;
+
+    /* Stats */
+    tvhlog(LOG_INFO, "epgdb", "saved");
+    tvhlog(LOG_INFO, "epgdb", "  brands     %d", es.stats.brands.total);
+    tvhlog(LOG_INFO, "epgdb", "  seasons    %d", es.stats.seasons.total);
+    tvhlog(LOG_INFO, "epgdb", "  episodes   %d", es.stats.episodes.total);
+    tvhlog(LOG_INFO, "epgdb", "  broadcasts %d", es.stats.broadcasts.total);
   }
 
-  /* Stats */
-  tvhlog(LOG_INFO, "epgdb", "saved");
-  tvhlog(LOG_INFO, "epgdb", "  brands     %d", stats.brands.total);
-  tvhlog(LOG_INFO, "epgdb", "  seasons    %d", stats.seasons.total);
-  tvhlog(LOG_INFO, "epgdb", "  episodes   %d", stats.episodes.total);
-  tvhlog(LOG_INFO, "epgdb", "  broadcasts %d", stats.broadcasts.total);
+  htsmsg_binary_buf_free(&epgdb_journal_next);
+  epgdb_saving = 0;
+  pthread_cond_broadcast(&epgdb_save_cond);
+}
+
+static void *_epg_save_thread ( void *aux )
+{
+  pthread_mutex_lock(&global_lock);
+  while (1) {
+    while (!epgdb_save_pending)
+      pthread_cond_wait(&epgdb_save_cond, &global_lock);
+    epgdb_save_pending = 0;
+    _epg_save_run();
+  }
+  return NULL;
+}
+
+static void _epg_save_request ( void )
+{
+  if (epgdb_saving || epgdb_save_pending) return;
+  epgdb_save_pending = 1;
+  pthread_cond_broadcast(&epgdb_save_cond);
+}
+
+static void _epg_save_init ( void )
+{
+  pthread_t tid;
+  pthread_cond_init(&epgdb_save_cond, NULL);
+  pthread_create(&tid, NULL, _epg_save_thread, NULL);
+}
+
+/*
+ * On exit, the journal is enough unless it was due for compaction (or
+ * could not be written)
+ */
+void epg_save ( void )
+{
+  pthread_mutex_lock(&global_lock);
+  while (epgdb_saving)
+    pthread_cond_wait(&epgdb_save_cond, &global_lock);
+  _epgdb_journal_flush();
+  if (epgdb_journal_fd < 0 || epgdb_save_pending) {
+    epgdb_save_pending = 0;
+    _epg_save_run();
+  }
+  pthread_mutex_unlock(&global_lock);
 }
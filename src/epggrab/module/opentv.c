@@ -24,6 +24,7 @@
 #include "dvb/dvb.h"
 #include "channels.h"
 #include "huffman.h"
+#include "strpool.h"
 #include "epg.h"
 #include "epggrab.h"
 #include "epggrab/private.h"
@@ -47,9 +48,9 @@ typedef struct opentv_event
   uint16_t               eid;         ///< Events ID
   time_t                 start;       ///< Start time
   time_t                 stop;        ///< Event stop time
-  char                  *title;       ///< Event title
-  char                  *summary;     ///< Event summary
-  char                  *desc;        ///< Event description
+  const char            *title;       ///< Event title (pooled)
+  const char            *summary;     ///< Event summary (pooled)
+  const char            *desc;        ///< Event description (pooled)
   uint8_t                cat;         ///< Event category
   uint16_t               serieslink;  ///< Series link ID
   
@@ -100,9 +101,9 @@ static void _opentv_status_remove_events ( opentv_status_t *sta )
   opentv_event_t *ev;
   while ((ev = RB_FIRST(&sta->events))) {
     RB_REMOVE(&sta->events, ev, ev_link);
-    if (ev->title)   free(ev->title);
-    if (ev->summary) free(ev->summary);
-    if (ev->desc)    free(ev->desc);
+    strpool_put(ev->title);
+    strpool_put(ev->summary);
+    strpool_put(ev->desc);
     free(ev);
   }
 }
@@ -210,33 +211,33 @@ static int _ev_cmp ( void *_a, void *_b )
   return a->eid - b->eid;
 }
 
-/* Parse huffman encoded string */
-static char *_opentv_parse_string 
+/* Parse huffman encoded string (result is pooled) */
+static const char *_opentv_parse_string 
   ( opentv_module_t *prov, uint8_t *buf, int len )
 {
   int ok = 0;
-  char *ret, *tmp;
+  char *tmp, *p;
+  const char *ret = NULL;
 
   if (len <= 0) return NULL;
 
   // Note: unlikely decoded string will be longer (though its possible)
-  ret = tmp = malloc(2*len);
-  *ret = 0;
+  p = tmp = malloc(2*len);
+  *tmp = 0;
   if (huffman_decode(prov->dict->codes, buf, len, 0x20, tmp, 2*len)) {
 
     /* Ignore (empty) strings */
-    while (*tmp) {
-      if (*tmp > 0x20) {
+    while (*p) {
+      if (*p > 0x20) {
         ok = 1;
         break;
       }
-      tmp++;
+      p++;
     }
   }
-  if (!ok) {
-    free(ret);
-    ret = NULL;
-  }
+  if (ok)
+    ret = strpool_get(tmp);
+  free(tmp);
   return ret;
 }
 
@@ -400,9 +401,9 @@ static int _opentv_parse_event_section
     }
 
     /* Cleanup */
-    if (ev.title)   free(ev.title);
-    if (ev.summary) free(ev.summary);
-    if (ev.desc)    free(ev.desc);
+    strpool_put(ev.title);
+    strpool_put(ev.summary);
+    strpool_put(ev.desc);
   }
 
   /* Update EPG */
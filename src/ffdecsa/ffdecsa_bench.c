@@ -0,0 +1,293 @@
+/*
+ *  CSA descrambling throughput benchmark (make bench-csa)
+ *  Copyright (C) 2013
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs every FFdecsa group implementation built into this tree (and
+ * libdvbcsa when enabled) over synthetic scrambled TS clusters with
+ * fixed control words, on a single thread, and reports packets/s and
+ * Mbit/s per core for a range of cluster sizes.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "config.h"
+
+#if ENABLE_DVBCSA
+#include <dvbcsa/dvbcsa.h>
+#endif
+
+typedef struct {
+  const char *name;
+  int (*supported)(void);
+  int (*get_internal_parallelism)(void);
+  int (*get_suggested_cluster_size)(void);
+  void *(*get_key_struct)(void);
+  void (*free_key_struct)(void *keys);
+  void (*set_control_words)(void *keys, const unsigned char *even, const unsigned char *odd);
+  int (*decrypt_packets)(void *keys, unsigned char **cluster);
+} benchfuncs_t;
+
+#define MAKEFUNCS(x, sup) \
+extern int get_internal_parallelism_##x(void);\
+extern int get_suggested_cluster_size_##x(void);\
+extern void *get_key_struct_##x(void);\
+extern void free_key_struct_##x(void *keys);\
+extern void set_control_words_##x(void *keys, const unsigned char *even, const unsigned char *odd);\
+extern int decrypt_packets_##x(void *keys, unsigned char **cluster);\
+static int supported_##x(void) { return sup; }\
+static const benchfuncs_t funcs_##x = { \
+  #x,\
+  &supported_##x,\
+  &get_internal_parallelism_##x,\
+  &get_suggested_cluster_size_##x,\
+  &get_key_struct_##x,\
+  &free_key_struct_##x,\
+  &set_control_words_##x,\
+  &decrypt_packets_##x\
+};
+
+MAKEFUNCS(32int, 1);
+#ifdef CONFIG_MMX
+MAKEFUNCS(64mmx, __builtin_cpu_supports("mmx"));
+#endif
+#ifdef CONFIG_SSE2
+MAKEFUNCS(128sse2, __builtin_cpu_supports("sse2"));
+#endif
+#ifdef CONFIG_AVX2
+MAKEFUNCS(256avx2, __builtin_cpu_supports("avx2"));
+#endif
+#ifdef CONFIG_AVX512F
+MAKEFUNCS(512avx512, __builtin_cpu_supports("avx512f"));
+#endif
+
+static const benchfuncs_t *benchfuncs[] = {
+  &funcs_32int,
+#ifdef CONFIG_MMX
+  &funcs_64mmx,
+#endif
+#ifdef CONFIG_SSE2
+  &funcs_128sse2,
+#endif
+#ifdef CONFIG_AVX2
+  &funcs_256avx2,
+#endif
+#ifdef CONFIG_AVX512F
+  &funcs_512avx512,
+#endif
+  NULL
+};
+
+static const unsigned char cw_even[8] = { 0x11, 0x22, 0x33, 0x66, 0x44, 0x55, 0x66, 0xff };
+static const unsigned char cw_odd[8]  = { 0x99, 0x88, 0x77, 0x96, 0x55, 0x44, 0x33, 0xcc };
+
+static double bench_time = 1.0;
+
+
+/**
+ *
+ */
+static double
+bench_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/**
+ * Every packet scrambled with a full 184 byte payload, alternating
+ * even and odd keys in runs of 8 as a real stream would (roughly)
+ */
+static void
+bench_scramble(unsigned char *tsb, int num)
+{
+  int i;
+
+  for(i = 0; i < num; i++, tsb += 188) {
+    tsb[0] = 0x47;
+    tsb[1] = 0x01;
+    tsb[2] = 0x00;
+    tsb[3] = ((i / 8) & 1 ? 0xc0 : 0x80) | 0x10 | (i & 0xf);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+bench_report(const char *name, int cluster, long packets, double elapsed)
+{
+  double pps = packets / elapsed;
+
+  printf("%-12s %8d %14.0f %12.1f\n",
+         name, cluster, pps, pps * 188 * 8 / 1000000.0);
+  fflush(stdout);
+}
+
+
+/**
+ *
+ */
+static void
+bench_ffdecsa(const benchfuncs_t *bf, int cluster, unsigned char *tsb,
+              const unsigned char *src)
+{
+  unsigned char *vec[3];
+  void *keys = bf->get_key_struct();
+  long packets = 0;
+  double start, elapsed = 0;
+
+  bf->set_control_words(keys, cw_even, cw_odd);
+
+  /* Only the decryption is timed, not refilling the buffer */
+  do {
+    memcpy(tsb, src, cluster * 188);
+    vec[0] = tsb;
+    vec[1] = tsb + cluster * 188;
+    vec[2] = NULL;
+    start = bench_clock();
+    while(bf->decrypt_packets(keys, vec) > 0)
+      ;
+    elapsed += bench_clock() - start;
+    packets += cluster;
+  } while(elapsed < bench_time);
+
+  bf->free_key_struct(keys);
+  bench_report(bf->name, cluster, packets, elapsed);
+}
+
+
+#if ENABLE_DVBCSA
+/**
+ * Same batching as the libdvbcsa path in tvhcsa.c
+ */
+static void
+bench_dvbcsa(int cluster, unsigned char *tsb, const unsigned char *src)
+{
+  struct dvbcsa_bs_key_s *key_even = dvbcsa_bs_key_alloc();
+  struct dvbcsa_bs_key_s *key_odd  = dvbcsa_bs_key_alloc();
+  struct dvbcsa_bs_batch_s *batch_even, *batch_odd;
+  unsigned char *pkt;
+  int i, fill_even, fill_odd;
+  long packets = 0;
+  double start, elapsed = 0;
+
+  batch_even = malloc((cluster + 1) * sizeof(struct dvbcsa_bs_batch_s));
+  batch_odd  = malloc((cluster + 1) * sizeof(struct dvbcsa_bs_batch_s));
+  dvbcsa_bs_key_set(cw_even, key_even);
+  dvbcsa_bs_key_set(cw_odd, key_odd);
+
+  do {
+    memcpy(tsb, src, cluster * 188);
+    start = bench_clock();
+    fill_even = fill_odd = 0;
+    for(i = 0, pkt = tsb; i < cluster; i++, pkt += 188) {
+      if(pkt[3] & 0x40) {
+        batch_odd[fill_odd].data = pkt + 4;
+        batch_odd[fill_odd++].len = 184;
+      } else {
+        batch_even[fill_even].data = pkt + 4;
+        batch_even[fill_even++].len = 184;
+      }
+      pkt[3] &= 0x3f;
+    }
+    batch_even[fill_even].data = NULL;
+    batch_odd[fill_odd].data = NULL;
+    dvbcsa_bs_decrypt(key_even, batch_even, 184);
+    dvbcsa_bs_decrypt(key_odd, batch_odd, 184);
+    elapsed += bench_clock() - start;
+    packets += cluster;
+  } while(elapsed < bench_time);
+
+  free(batch_odd);
+  free(batch_even);
+  dvbcsa_bs_key_free(key_odd);
+  dvbcsa_bs_key_free(key_even);
+  bench_report("dvbcsa", cluster, packets, elapsed);
+}
+#endif
+
+
+/**
+ *
+ */
+int
+main(int argc, char **argv)
+{
+  const benchfuncs_t **bfp, *bf;
+  unsigned char *src, *tsb;
+  int c, i, maxcluster = 0, sizes[4];
+
+  while((c = getopt(argc, argv, "t:")) != -1) {
+    switch(c) {
+    case 't':
+      bench_time = atof(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t seconds per run]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  for(bfp = benchfuncs; *bfp != NULL; bfp++)
+    if((*bfp)->get_suggested_cluster_size() * 4 > maxcluster)
+      maxcluster = (*bfp)->get_suggested_cluster_size() * 4;
+#if ENABLE_DVBCSA
+  if(dvbcsa_bs_batch_size() * 4 > maxcluster)
+    maxcluster = dvbcsa_bs_batch_size() * 4;
+#endif
+
+  src = malloc(maxcluster * 188);
+  tsb = malloc(maxcluster * 188);
+  srand(1);
+  for(i = 0; i < maxcluster * 188; i++)
+    src[i] = rand();
+  bench_scramble(src, maxcluster);
+
+  printf("%-12s %8s %14s %12s\n", "backend", "cluster", "packets/s", "Mbit/s");
+
+  for(bfp = benchfuncs; *bfp != NULL; bfp++) {
+    bf = *bfp;
+    if(!bf->supported()) {
+      printf("%-12s (not supported by this CPU)\n", bf->name);
+      continue;
+    }
+    sizes[0] = bf->get_internal_parallelism();
+    sizes[1] = bf->get_suggested_cluster_size();
+    sizes[2] = sizes[1] * 2;
+    sizes[3] = sizes[1] * 4;
+    for(i = 0; i < 4; i++)
+      bench_ffdecsa(bf, sizes[i], tsb, src);
+  }
+
+#if ENABLE_DVBCSA
+  sizes[0] = dvbcsa_bs_batch_size();
+  for(i = 0; i < 4; i++)
+    bench_dvbcsa(sizes[0] << i, tsb, src);
+#endif
+
+  free(tsb);
+  free(src);
+  return 0;
+}
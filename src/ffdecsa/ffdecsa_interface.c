@@ -67,6 +67,14 @@ MAKEFUNCS(64mmx);
 MAKEFUNCS(128sse2);
 #endif
 
+#ifdef CONFIG_AVX2
+MAKEFUNCS(256avx2);
+#endif
+
+#ifdef CONFIG_AVX512F
+MAKEFUNCS(512avx512);
+#endif
+
 static csafuncs_t current;
 
 
@@ -126,6 +134,30 @@ typedef int x86_reg;
            "=c" (ecx), "=d" (edx)\
          : "0" (index));
 
+#define cpuid_count(index,count,eax,ebx,ecx,edx)\
+    __asm__ volatile\
+        ("mov %%"REG_b", %%"REG_S"\n\t"\
+         "cpuid\n\t"\
+         "xchg %%"REG_b", %%"REG_S\
+         : "=a" (eax), "=S" (ebx),\
+           "=c" (ecx), "=d" (edx)\
+         : "0" (index), "2" (count));
+
+/* XCR0 state components the OS saves on context switch */
+#define XCR0_SSE      0x02
+#define XCR0_AVX      0x04
+#define XCR0_AVX512   0xe0
+
+#if defined(CONFIG_AVX2) || defined(CONFIG_AVX512F)
+static int
+xgetbv0(void)
+{
+  int eax, edx;
+  __asm__ volatile ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  return eax;
+}
+#endif
+
 
 
 void
@@ -137,7 +169,7 @@ ffdecsa_init(void)
 #if defined(__i386__) || defined(__x86_64__)
 
   int eax, ebx, ecx, edx;
-  int max_std_level, std_caps=0;
+  int max_std_level, std_caps=0, ext_caps=0, ext7_caps=0, xcr0=0;
   
 #if defined(__i386__)
 
@@ -168,7 +200,34 @@ ffdecsa_init(void)
     cpuid(0, max_std_level, ebx, ecx, edx);
 
     if(max_std_level >= 1){
-      cpuid(1, eax, ebx, ecx, std_caps);
+      cpuid(1, eax, ebx, ext_caps, std_caps);
+
+#if defined(CONFIG_AVX2) || defined(CONFIG_AVX512F)
+      /* OSXSAVE, otherwise the OS does not preserve the wide registers */
+      if (ext_caps & (1<<27))
+        xcr0 = xgetbv0();
+      if (max_std_level >= 7)
+        cpuid_count(7, 0, eax, ext7_caps, ecx, edx);
+#endif
+
+#ifdef CONFIG_AVX512F
+      if ((ext7_caps & (1<<16)) &&
+          (xcr0 & (XCR0_SSE|XCR0_AVX|XCR0_AVX512)) ==
+                  (XCR0_SSE|XCR0_AVX|XCR0_AVX512)) {
+	current = funcs_512avx512;
+	tvhlog(LOG_INFO, "CSA", "Using AVX-512 512bit parallel descrambling");
+	return;
+      }
+#endif
+
+#ifdef CONFIG_AVX2
+      if ((ext7_caps & (1<<5)) &&
+          (xcr0 & (XCR0_SSE|XCR0_AVX)) == (XCR0_SSE|XCR0_AVX)) {
+	current = funcs_256avx2;
+	tvhlog(LOG_INFO, "CSA", "Using AVX2 256bit parallel descrambling");
+	return;
+      }
+#endif
 
 #ifdef CONFIG_SSE2
       if (std_caps & (1<<26)) {
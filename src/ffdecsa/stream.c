@@ -432,6 +432,70 @@ static inline void trasp64_128_88cw(unsigned char *data){
   }
 #undef halfrow
 }
+
+//64-256/512------------------------------------------------------
+#if GROUP_PARALLELISM>=256
+/* Every 64 bit column of a wide row is transposed on its own, exactly
+   like the two halves of a 128 bit row */
+#define WORDS_PER_ROW (GROUP_PARALLELISM/64)
+#define TRASP_STEP(span,mask_lo,mask_hi,sh,cw) \
+  for(j=0;j<64;j+=2*(span)){ \
+    unsigned long long int t,b; \
+    for(i=0;i<(span);i++){ \
+      for(w=0;w<WORDS_PER_ROW;w++){ \
+        t=row[WORDS_PER_ROW*(j+i)+w]; \
+        b=row[WORDS_PER_ROW*(j+(span)+i)+w]; \
+        if(cw){ \
+          row[WORDS_PER_ROW*(j+i)+w]       =((t&(mask_hi))>>(sh)) |  (b&(mask_hi)); \
+          row[WORDS_PER_ROW*(j+(span)+i)+w]= (t&(mask_lo))        | ((b&(mask_lo))<<(sh)); \
+        }else{ \
+          row[WORDS_PER_ROW*(j+i)+w]       =((t&(mask_lo))<<(sh)) |  (b&(mask_lo)); \
+          row[WORDS_PER_ROW*(j+(span)+i)+w]= (t&(mask_hi))        | ((b&(mask_hi))>>(sh)); \
+        } \
+      } \
+    } \
+  }
+#define TRASP_SWAP(span,mask_lo,mask_hi,sh) \
+  for(j=0;j<64;j+=2*(span)){ \
+    unsigned long long int t,b; \
+    for(i=0;i<(span);i++){ \
+      for(w=0;w<WORDS_PER_ROW;w++){ \
+        t=row[WORDS_PER_ROW*(j+i)+w]; \
+        b=row[WORDS_PER_ROW*(j+(span)+i)+w]; \
+        row[WORDS_PER_ROW*(j+i)+w]       = (t&(mask_lo))        | ((b&(mask_lo))<<(sh)); \
+        row[WORDS_PER_ROW*(j+(span)+i)+w]=((t&(mask_hi))>>(sh)) |  (b&(mask_hi)); \
+      } \
+    } \
+  }
+
+static inline void trasp64_wide_88ccw(unsigned char *data){
+/* 64 rows of 256/512 bits transposition (bytes transp. - 8x8 rotate counterclockwise)*/
+#define row ((unsigned long long int *)data)
+  int i,j,w;
+  TRASP_SWAP(32,0x00000000ffffffffULL,0xffffffff00000000ULL,32)
+  TRASP_SWAP(16,0x0000ffff0000ffffULL,0xffff0000ffff0000ULL,16)
+  TRASP_SWAP( 8,0x00ff00ff00ff00ffULL,0xff00ff00ff00ff00ULL, 8)
+  TRASP_STEP( 4,0x0f0f0f0f0f0f0f0fULL,0xf0f0f0f0f0f0f0f0ULL, 4,0)
+  TRASP_STEP( 2,0x3333333333333333ULL,0xccccccccccccccccULL, 2,0)
+  TRASP_STEP( 1,0x5555555555555555ULL,0xaaaaaaaaaaaaaaaaULL, 1,0)
+#undef row
+}
+
+static inline void trasp64_wide_88cw(unsigned char *data){
+/* 64 rows of 256/512 bits transposition (bytes transp. - 8x8 rotate clockwise)*/
+#define row ((unsigned long long int *)data)
+  int i,j,w;
+  TRASP_SWAP(32,0x00000000ffffffffULL,0xffffffff00000000ULL,32)
+  TRASP_SWAP(16,0x0000ffff0000ffffULL,0xffff0000ffff0000ULL,16)
+  TRASP_SWAP( 8,0x00ff00ff00ff00ffULL,0xff00ff00ff00ff00ULL, 8)
+  TRASP_STEP( 4,0x0f0f0f0f0f0f0f0fULL,0xf0f0f0f0f0f0f0f0ULL, 4,1)
+  TRASP_STEP( 2,0x3333333333333333ULL,0xccccccccccccccccULL, 2,1)
+  TRASP_STEP( 1,0x5555555555555555ULL,0xaaaaaaaaaaaaaaaaULL, 1,1)
+#undef row
+}
+#undef TRASP_STEP
+#undef TRASP_SWAP
+#endif
 #endif
 
 
@@ -489,6 +553,9 @@ trasp64_64_88ccw(sb);
 #if GROUP_PARALLELISM==128
 trasp64_128_88ccw(sb);
 #endif
+#if GROUP_PARALLELISM>=256
+trasp64_wide_88ccw(sb);
+#endif
 DBG(dump_mem("stream_postrot",sb,GROUP_PARALLELISM*8,BYPG));
 
 for(j=0;j<64;j++){
@@ -888,6 +955,9 @@ trasp64_64_88cw(cb);
 #if GROUP_PARALLELISM==128
 trasp64_128_88cw(cb);
 #endif
+#if GROUP_PARALLELISM>=256
+trasp64_wide_88cw(cb);
+#endif
 
 for(j=0;j<64;j++){
   DBG(fprintf(stderr,"postcall postrot cb[%2i]=",j));
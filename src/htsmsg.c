@@ -25,7 +25,170 @@
 #include <string.h>
 #include "htsmsg.h"
 
+/**
+ * Maps with at least this many fields get a name index
+ */
+#define HTSMSG_INDEX_MIN 32
+
+/**
+ * Open addressing hash table over the fields of a map, linear probing.
+ * Only the first field of a given name is indexed, so lookups return
+ * the same field as a walk over the list would. Kept at most half full
+ */
+typedef struct htsmsg_index {
+  uint32_t hi_mask;
+  uint32_t hi_used;
+  htsmsg_field_t *hi_slots[0];
+} htsmsg_index_t;
+
+/**
+ * Arena chunk size, bigger allocations get a chunk of their own
+ */
+#define HTSMSG_ARENA_CHUNK 4096
+
+typedef struct htsmsg_arena_chunk {
+  struct htsmsg_arena_chunk *hac_next;
+  uint64_t hac_data[0];
+} htsmsg_arena_chunk_t;
+
+/**
+ * An arena lives at the start of its first chunk, together with the
+ * root message
+ */
+typedef struct htsmsg_arena {
+  htsmsg_arena_chunk_t ha_chunk;
+  htsmsg_arena_chunk_t *ha_chunks;  /* Further chunks */
+  uint8_t *ha_ptr;
+  size_t ha_left;
+  htsmsg_t ha_root;
+} htsmsg_arena_t;
+
 static void htsmsg_clear(htsmsg_t *msg);
+static void htsmsg_copy_i(htsmsg_t *src, htsmsg_t *dst);
+
+/*
+ *
+ */
+static void *
+htsmsg_arena_alloc(htsmsg_arena_t *ha, size_t size)
+{
+  htsmsg_arena_chunk_t *hac;
+  void *r;
+
+  size = (size + 7) & ~7;
+
+  if(size > ha->ha_left) {
+    if(size > HTSMSG_ARENA_CHUNK / 4) {
+      hac = malloc(sizeof(htsmsg_arena_chunk_t) + size);
+      hac->hac_next = ha->ha_chunks;
+      ha->ha_chunks = hac;
+      return hac->hac_data;
+    }
+    hac = malloc(HTSMSG_ARENA_CHUNK);
+    hac->hac_next = ha->ha_chunks;
+    ha->ha_chunks = hac;
+    ha->ha_ptr = (uint8_t *)hac->hac_data;
+    ha->ha_left = HTSMSG_ARENA_CHUNK - sizeof(htsmsg_arena_chunk_t);
+  }
+
+  r = ha->ha_ptr;
+  ha->ha_ptr  += size;
+  ha->ha_left -= size;
+  return r;
+}
+
+/*
+ * Copy of string or binary data belonging to field f, from the arena
+ * if the field is arena allocated
+ */
+static void *
+htsmsg_field_data(htsmsg_t *msg, htsmsg_field_t *f, const void *src,
+		  size_t len)
+{
+  void *d;
+
+  if(f->hmf_flags & HMF_ARENA) {
+    d = htsmsg_arena_alloc(msg->hm_arena, len);
+    f->hmf_flags &= ~HMF_ALLOCED;
+  } else {
+    d = malloc(len);
+  }
+  memcpy(d, src, len);
+  return d;
+}
+
+/*
+ *
+ */
+static inline uint32_t
+htsmsg_name_hash(const char *name)
+{
+  uint32_t h = 2166136261U;
+
+  while(*name)
+    h = (h ^ (uint8_t)*name++) * 16777619U;
+  return h;
+}
+
+/*
+ *
+ */
+static void
+htsmsg_index_insert(htsmsg_index_t *hi, htsmsg_field_t *f)
+{
+  uint32_t i = htsmsg_name_hash(f->hmf_name) & hi->hi_mask;
+  htsmsg_field_t *o;
+
+  while((o = hi->hi_slots[i]) != NULL) {
+    if(!strcmp(o->hmf_name, f->hmf_name))
+      return;
+    i = (i + 1) & hi->hi_mask;
+  }
+  hi->hi_slots[i] = f;
+  hi->hi_used++;
+}
+
+/*
+ * (Re)build the index from the field list, or drop it if the map has
+ * shrunk below the threshold
+ */
+static void
+htsmsg_index_build(htsmsg_t *msg)
+{
+  htsmsg_index_t *hi;
+  htsmsg_field_t *f;
+  uint32_t size = 2 * HTSMSG_INDEX_MIN;
+
+  free(msg->hm_index);
+  msg->hm_index = NULL;
+
+  if(msg->hm_islist || msg->hm_nfields < HTSMSG_INDEX_MIN)
+    return;
+
+  while(size < msg->hm_nfields * 2)
+    size *= 2;
+
+  hi = calloc(1, sizeof(htsmsg_index_t) + size * sizeof(htsmsg_field_t *));
+  hi->hi_mask = size - 1;
+  TAILQ_FOREACH(f, &msg->hm_fields, hmf_link)
+    if(f->hmf_name != NULL)
+      htsmsg_index_insert(hi, f);
+  msg->hm_index = hi;
+}
+
+/*
+ * Hand the fields of src, index included, over to dst
+ */
+static void
+htsmsg_move_fields(htsmsg_t *dst, htsmsg_t *src)
+{
+  TAILQ_MOVE(&dst->hm_fields, &src->hm_fields, hmf_link);
+  dst->hm_nfields = src->hm_nfields;
+  dst->hm_index = src->hm_index;
+  TAILQ_INIT(&src->hm_fields);
+  src->hm_nfields = 0;
+  src->hm_index = NULL;
+}
 
 /**
  *
@@ -33,7 +196,23 @@ static void htsmsg_clear(htsmsg_t *msg);
 void
 htsmsg_field_destroy(htsmsg_t *msg, htsmsg_field_t *f)
 {
+  htsmsg_index_t *hi = msg->hm_index;
+  uint32_t i;
+
   TAILQ_REMOVE(&msg->hm_fields, f, hmf_link);
+  msg->hm_nfields--;
+
+  if(hi != NULL && f->hmf_name != NULL) {
+    /* A later field of the same name may have to take its place */
+    i = htsmsg_name_hash(f->hmf_name) & hi->hi_mask;
+    while(hi->hi_slots[i] != NULL) {
+      if(hi->hi_slots[i] == f) {
+        htsmsg_index_build(msg);
+        break;
+      }
+      i = (i + 1) & hi->hi_mask;
+    }
+  }
 
   switch(f->hmf_type) {
   case HMF_MAP:
@@ -55,7 +234,8 @@ htsmsg_field_destroy(htsmsg_t *msg, htsmsg_field_t *f)
   }
   if(f->hmf_flags & HMF_NAME_ALLOCED)
     free((void *)f->hmf_name);
-  free(f);
+  if(!(f->hmf_flags & HMF_ARENA))
+    free(f);
 }
 
 /*
@@ -66,21 +246,43 @@ htsmsg_clear(htsmsg_t *msg)
 {
   htsmsg_field_t *f;
 
+  free(msg->hm_index);
+  msg->hm_index = NULL;
+
   while((f = TAILQ_FIRST(&msg->hm_fields)) != NULL)
     htsmsg_field_destroy(msg, f);
 }
 
 
 
+/*
+ *
+ */
+void
+htsmsg_field_insert(htsmsg_t *msg, htsmsg_field_t *f)
+{
+  htsmsg_index_t *hi = msg->hm_index;
+
+  TAILQ_INSERT_TAIL(&msg->hm_fields, f, hmf_link);
+  msg->hm_nfields++;
+
+  if(hi == NULL) {
+    if(msg->hm_nfields == HTSMSG_INDEX_MIN)
+      htsmsg_index_build(msg);
+  } else if((hi->hi_used + 1) * 2 > hi->hi_mask + 1) {
+    htsmsg_index_build(msg);
+  } else if(f->hmf_name != NULL) {
+    htsmsg_index_insert(hi, f);
+  }
+}
+
 /*
  *
  */
 htsmsg_field_t *
 htsmsg_field_add(htsmsg_t *msg, const char *name, int type, int flags)
 {
-  htsmsg_field_t *f = malloc(sizeof(htsmsg_field_t));
-  
-  TAILQ_INSERT_TAIL(&msg->hm_fields, f, hmf_link);
+  htsmsg_field_t *f;
 
   if(msg->hm_islist) {
     assert(name == NULL);
@@ -88,6 +290,16 @@ htsmsg_field_add(htsmsg_t *msg, const char *name, int type, int flags)
     assert(name != NULL);
   }
 
+  if(msg->hm_arena != NULL) {
+    f = htsmsg_arena_alloc(msg->hm_arena, sizeof(htsmsg_field_t));
+    if((flags & HMF_NAME_ALLOCED) && name != NULL)
+      name = strcpy(htsmsg_arena_alloc(msg->hm_arena, strlen(name) + 1),
+		    name);
+    flags = (flags & ~HMF_NAME_ALLOCED) | HMF_ARENA;
+  } else {
+    f = malloc(sizeof(htsmsg_field_t));
+  }
+
   if(flags & HMF_NAME_ALLOCED)
     f->hmf_name = name ? strdup(name) : NULL;
   else
@@ -95,6 +307,7 @@ htsmsg_field_add(htsmsg_t *msg, const char *name, int type, int flags)
 
   f->hmf_type = type;
   f->hmf_flags = flags;
+  htsmsg_field_insert(msg, f);
   return f;
 }
 
@@ -105,7 +318,19 @@ htsmsg_field_add(htsmsg_t *msg, const char *name, int type, int flags)
 htsmsg_field_t *
 htsmsg_field_find(htsmsg_t *msg, const char *name)
 {
+  htsmsg_index_t *hi = msg->hm_index;
   htsmsg_field_t *f;
+  uint32_t i;
+
+  if(hi != NULL) {
+    i = htsmsg_name_hash(name) & hi->hi_mask;
+    while((f = hi->hi_slots[i]) != NULL) {
+      if(!strcmp(f->hmf_name, name))
+        return f;
+      i = (i + 1) & hi->hi_mask;
+    }
+    return NULL;
+  }
 
   TAILQ_FOREACH(f, &msg->hm_fields, hmf_link) {
     if(f->hmf_name != NULL && !strcmp(f->hmf_name, name))
@@ -141,6 +366,9 @@ htsmsg_create_map(void)
 
   msg = malloc(sizeof(htsmsg_t));
   TAILQ_INIT(&msg->hm_fields);
+  msg->hm_nfields = 0;
+  msg->hm_index = NULL;
+  msg->hm_arena = NULL;
   msg->hm_data = NULL;
   msg->hm_islist = 0;
   return msg;
@@ -156,11 +384,36 @@ htsmsg_create_list(void)
 
   msg = malloc(sizeof(htsmsg_t));
   TAILQ_INIT(&msg->hm_fields);
+  msg->hm_nfields = 0;
+  msg->hm_index = NULL;
+  msg->hm_arena = NULL;
   msg->hm_data = NULL;
   msg->hm_islist = 1;
   return msg;
 }
 
+/*
+ *
+ */
+htsmsg_t *
+htsmsg_create_map_arena(void)
+{
+  htsmsg_arena_t *ha = malloc(HTSMSG_ARENA_CHUNK);
+  htsmsg_t *msg = &ha->ha_root;
+
+  ha->ha_chunks = NULL;
+  ha->ha_ptr  = (uint8_t *)(ha + 1);
+  ha->ha_left = HTSMSG_ARENA_CHUNK - sizeof(htsmsg_arena_t);
+
+  TAILQ_INIT(&msg->hm_fields);
+  msg->hm_nfields = 0;
+  msg->hm_index = NULL;
+  msg->hm_arena = ha;
+  msg->hm_data = NULL;
+  msg->hm_islist = 0;
+  return msg;
+}
+
 
 /*
  *
@@ -171,9 +424,24 @@ htsmsg_destroy(htsmsg_t *msg)
   if(msg == NULL)
     return;
 
+  htsmsg_arena_t *ha = msg->hm_arena;
+  htsmsg_arena_chunk_t *hac;
+
   htsmsg_clear(msg);
   free((void *)msg->hm_data);
-  free(msg);
+
+  if(ha == NULL) {
+    free(msg);
+    return;
+  }
+
+  /* Only an arena's root message can be destroyed on its own */
+  assert(msg == &ha->ha_root);
+  while((hac = ha->ha_chunks) != NULL) {
+    ha->ha_chunks = hac->hac_next;
+    free(hac);
+  }
+  free(ha);
 }
 
 /*
@@ -227,7 +495,7 @@ htsmsg_add_str(htsmsg_t *msg, const char *name, const char *str)
 {
   htsmsg_field_t *f = htsmsg_field_add(msg, name, HMF_STR, 
 				        HMF_ALLOCED | HMF_NAME_ALLOCED);
-  f->hmf_str = strdup(str);
+  f->hmf_str = htsmsg_field_data(msg, f, str, strlen(str) + 1);
 }
 
 /*
@@ -238,10 +506,8 @@ htsmsg_add_bin(htsmsg_t *msg, const char *name, const void *bin, size_t len)
 {
   htsmsg_field_t *f = htsmsg_field_add(msg, name, HMF_BIN, 
 				       HMF_ALLOCED | HMF_NAME_ALLOCED);
-  void *v;
-  f->hmf_bin = v = malloc(len);
+  f->hmf_bin = htsmsg_field_data(msg, f, bin, len);
   f->hmf_binsize = len;
-  memcpy(v, bin, len);
 }
 
 /*
@@ -269,7 +535,17 @@ htsmsg_add_msg(htsmsg_t *msg, const char *name, htsmsg_t *sub)
 
   assert(sub->hm_data == NULL);
   f->hmf_msg.hm_islist = sub->hm_islist;
-  TAILQ_MOVE(&f->hmf_msg.hm_fields, &sub->hm_fields, hmf_link);
+  f->hmf_msg.hm_arena = msg->hm_arena;
+  if(sub->hm_arena != NULL) {
+    /* Its arena goes away with it */
+    TAILQ_INIT(&f->hmf_msg.hm_fields);
+    f->hmf_msg.hm_nfields = 0;
+    f->hmf_msg.hm_index = NULL;
+    htsmsg_copy_i(sub, &f->hmf_msg);
+    htsmsg_destroy(sub);
+    return;
+  }
+  htsmsg_move_fields(&f->hmf_msg, sub);
   free(sub);
 }
 
@@ -286,8 +562,10 @@ htsmsg_add_msg_extname(htsmsg_t *msg, const char *name, htsmsg_t *sub)
   f = htsmsg_field_add(msg, name, sub->hm_islist ? HMF_LIST : HMF_MAP, 0);
 
   assert(sub->hm_data == NULL);
-  TAILQ_MOVE(&f->hmf_msg.hm_fields, &sub->hm_fields, hmf_link);
+  assert(sub->hm_arena == NULL);
+  htsmsg_move_fields(&f->hmf_msg, sub);
   f->hmf_msg.hm_islist = sub->hm_islist;
+  f->hmf_msg.hm_arena = msg->hm_arena;
   free(sub);
 }
 
@@ -547,9 +825,14 @@ htsmsg_detach_submsg(htsmsg_field_t *f)
 {
   htsmsg_t *r = htsmsg_create_map();
 
-  TAILQ_MOVE(&r->hm_fields, &f->hmf_msg.hm_fields, hmf_link);
-  TAILQ_INIT(&f->hmf_msg.hm_fields);
   r->hm_islist = f->hmf_type == HMF_LIST;
+  if(f->hmf_msg.hm_arena != NULL) {
+    /* Fields may live in the parent's arena */
+    htsmsg_copy_i(&f->hmf_msg, r);
+    htsmsg_clear(&f->hmf_msg);
+    return r;
+  }
+  htsmsg_move_fields(r, &f->hmf_msg);
   return r;
 }
 
@@ -658,7 +941,14 @@ htsmsg_copy_i(htsmsg_t *src, htsmsg_t *dst)
 htsmsg_t *
 htsmsg_copy(htsmsg_t *src)
 {
-  htsmsg_t *dst = src->hm_islist ? htsmsg_create_list() : htsmsg_create_map();
+  htsmsg_t *dst;
+
+  if(src->hm_islist)
+    dst = htsmsg_create_list();
+  else if(src->hm_arena != NULL)
+    dst = htsmsg_create_map_arena();
+  else
+    dst = htsmsg_create_map();
   htsmsg_copy_i(src, dst);
   return dst;
 }
@@ -26,6 +26,9 @@
 
 TAILQ_HEAD(htsmsg_field_queue, htsmsg_field);
 
+struct htsmsg_index;
+struct htsmsg_arena;
+
 typedef struct htsmsg {
   /**
    * fields 
@@ -37,6 +40,18 @@ typedef struct htsmsg {
    */
   int hm_islist;
 
+  /**
+   * Number of fields, and a name index once a map has grown past
+   * HTSMSG_INDEX_MIN fields (NULL until then)
+   */
+  uint32_t hm_nfields;
+  struct htsmsg_index *hm_index;
+
+  /**
+   * Set if fields added to this message are carved from an arena
+   */
+  struct htsmsg_arena *hm_arena;
+
   /**
    * Data to be free'd when the message is destroyed
    */
@@ -59,6 +74,7 @@ typedef struct htsmsg_field {
 
 #define HMF_ALLOCED 0x1
 #define HMF_NAME_ALLOCED 0x2
+#define HMF_ARENA 0x4
 
   union {
     int64_t  s64;
@@ -96,6 +112,16 @@ htsmsg_t *htsmsg_create_map(void);
  */
 htsmsg_t *htsmsg_create_list(void);
 
+/**
+ * Create a new map whose fields, names and string/binary data (also
+ * those of maps and lists added to it) are bump allocated from an arena
+ * that is released in one go by htsmsg_destroy(). Intended for the
+ * many short lived messages that are built, sent or written, and
+ * destroyed. Submessages taken out with htsmsg_detach_submsg() are
+ * copied, so they stay valid after the arena is gone
+ */
+htsmsg_t *htsmsg_create_map_arena(void);
+
 /**
  * Remove a given field from a msg
  */
@@ -297,6 +323,12 @@ void htsmsg_print(htsmsg_t *msg);
 htsmsg_field_t *htsmsg_field_add(htsmsg_t *msg, const char *name,
 				 int type, int flags);
 
+/**
+ * Append a field that's been set up by the caller, name included.
+ * Primarily intended for htsmsg internal functions.
+ */
+void htsmsg_field_insert(htsmsg_t *msg, htsmsg_field_t *f);
+
 /**
  * Get a field, return NULL if it does not exist
  */
@@ -18,6 +18,7 @@
 
 #include <assert.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -96,6 +97,10 @@ htsmsg_binary_des0(htsmsg_t *msg, const uint8_t *buf, size_t len)
     case HMF_LIST:
       sub = &f->hmf_msg;
       TAILQ_INIT(&sub->hm_fields);
+      sub->hm_islist = type == HMF_LIST;
+      sub->hm_nfields = 0;
+      sub->hm_index = NULL;
+      sub->hm_arena = NULL;
       sub->hm_data = NULL;
       if(htsmsg_binary_des0(sub, buf, datalen) < 0)
 	return -1;
@@ -107,7 +112,7 @@ htsmsg_binary_des0(htsmsg_t *msg, const uint8_t *buf, size_t len)
       return -1;
     }
 
-    TAILQ_INSERT_TAIL(&msg->hm_fields, f, hmf_link);
+    htsmsg_field_insert(msg, f);
     buf += datalen;
     len -= datalen;
   }
@@ -134,149 +139,140 @@ htsmsg_binary_deserialize(const void *data, size_t len, const void *buf)
 
 
 
+/* Initial output buffer size of htsmsg_binary_serialize(), per thread */
+static __thread size_t htsmsg_binary_hint = 256;
+
 /*
  *
  */
-static size_t
-htsmsg_binary_count(htsmsg_t *msg)
+void
+htsmsg_binary_buf_free(htsmsg_binary_buf_t *hbb)
 {
-  htsmsg_field_t *f;
-  size_t len = 0;
-  uint64_t u64;
-
-  TAILQ_FOREACH(f, &msg->hm_fields, hmf_link) {
-
-    len += 6;
-    len += f->hmf_name ? strlen(f->hmf_name) : 0;
-
-    switch(f->hmf_type) {
-    case HMF_MAP:
-    case HMF_LIST:
-      len += htsmsg_binary_count(&f->hmf_msg);
-      break;
-
-    case HMF_STR:
-      len += strlen(f->hmf_str);
-      break;
-
-    case HMF_BIN:
-      len += f->hmf_binsize;
-      break;
+  free(hbb->hbb_data);
+  memset(hbb, 0, sizeof(htsmsg_binary_buf_t));
+}
 
-    case HMF_S64:
-      u64 = f->hmf_s64;
-      while(u64 != 0) {
-	len++;
-	u64 = u64 >> 8;
-      }
-      break;
-    }
+/*
+ * Make room for len more bytes, returns where they go
+ */
+static inline uint8_t *
+htsmsg_binary_reserve(htsmsg_binary_buf_t *hbb, size_t len)
+{
+  if(hbb->hbb_len + len > hbb->hbb_size) {
+    hbb->hbb_size = MAX(hbb->hbb_size * 2, hbb->hbb_len + len);
+    hbb->hbb_data = realloc(hbb->hbb_data, hbb->hbb_size);
   }
-  return len;
+  hbb->hbb_len += len;
+  return hbb->hbb_data + hbb->hbb_len - len;
 }
 
-
 /*
  *
  */
-static void
-htsmsg_binary_write(htsmsg_t *msg, uint8_t *ptr)
+static inline void
+htsmsg_binary_put_u32(uint8_t *p, uint32_t u32)
+{
+  p[0] = u32 >> 24;
+  p[1] = u32 >> 16;
+  p[2] = u32 >> 8;
+  p[3] = u32;
+}
+
+/*
+ * Write the fields of msg in one pass. Each field's length is patched
+ * in once its contents are out. Returns the serialized size
+ */
+static size_t
+htsmsg_binary_write(htsmsg_t *msg, htsmsg_binary_buf_t *hbb)
 {
   htsmsg_field_t *f;
+  size_t hdr, l, total = 0;
   uint64_t u64;
-  int l, i, namelen;
+  uint8_t *p;
+  int namelen;
 
   TAILQ_FOREACH(f, &msg->hm_fields, hmf_link) {
     namelen = f->hmf_name ? strlen(f->hmf_name) : 0;
-    *ptr++ = f->hmf_type;
-    *ptr++ = namelen;
+    hdr = hbb->hbb_len;
+    p = htsmsg_binary_reserve(hbb, 6 + namelen);
+    p[0] = f->hmf_type;
+    p[1] = namelen;
+    if(namelen > 0)
+      memcpy(p + 6, f->hmf_name, namelen);
 
     switch(f->hmf_type) {
     case HMF_MAP:
     case HMF_LIST:
-      l = htsmsg_binary_count(&f->hmf_msg);
+      l = htsmsg_binary_write(&f->hmf_msg, hbb);
       break;
 
     case HMF_STR:
       l = strlen(f->hmf_str);
+      memcpy(htsmsg_binary_reserve(hbb, l), f->hmf_str, l);
       break;
 
     case HMF_BIN:
       l = f->hmf_binsize;
+      memcpy(htsmsg_binary_reserve(hbb, l), f->hmf_bin, l);
       break;
 
     case HMF_S64:
-      u64 = f->hmf_s64;
-      l = 0;
-      while(u64 != 0) {
-	l++;
-	u64 = u64 >> 8;
-      }
+      p = htsmsg_binary_reserve(hbb, 8);
+      for(l = 0, u64 = f->hmf_s64; u64 != 0; l++, u64 >>= 8)
+        p[l] = u64;
+      hbb->hbb_len -= 8 - l;
       break;
+
     default:
       abort();
     }
 
+    htsmsg_binary_put_u32(hbb->hbb_data + hdr + 2, l);
+    total += 6 + namelen + l;
+  }
+  return total;
+}
 
-    *ptr++ = l >> 24;
-    *ptr++ = l >> 16;
-    *ptr++ = l >> 8;
-    *ptr++ = l;
-
-    if(namelen > 0) {
-      memcpy(ptr, f->hmf_name, namelen);
-      ptr += namelen;
-    }
-
-    switch(f->hmf_type) {
-    case HMF_MAP:
-    case HMF_LIST:
-      htsmsg_binary_write(&f->hmf_msg, ptr);
-      break;
-
-    case HMF_STR:
-      memcpy(ptr, f->hmf_str, l);
-      break;
-
-    case HMF_BIN:
-      memcpy(ptr, f->hmf_bin, l);
-      break;
+/*
+ *
+ */
+int
+htsmsg_binary_serialize_buf(htsmsg_t *msg, htsmsg_binary_buf_t *hbb,
+			    int maxlen)
+{
+  size_t start = hbb->hbb_len, len;
 
-    case HMF_S64:
-      u64 = f->hmf_s64;
-      for(i = 0; i < l; i++) {
-	ptr[i] = u64;
-	u64 = u64 >> 8;
-      }
-      break;
-    }
-    ptr += l;
+  htsmsg_binary_reserve(hbb, 4);
+  len = htsmsg_binary_write(msg, hbb);
+  if(len + 4 > maxlen) {
+    hbb->hbb_len = start;
+    return -1;
   }
+  htsmsg_binary_put_u32(hbb->hbb_data + start, len);
+  return 0;
 }
 
-
 /*
  *
  */
 int
 htsmsg_binary_serialize(htsmsg_t *msg, void **datap, size_t *lenp, int maxlen)
 {
-  size_t len;
-  uint8_t *data;
+  htsmsg_binary_buf_t hbb;
 
-  len = htsmsg_binary_count(msg);
-  if(len + 4 > maxlen)
-    return -1;
+  memset(&hbb, 0, sizeof(hbb));
+  hbb.hbb_size = htsmsg_binary_hint;
+  hbb.hbb_data = malloc(hbb.hbb_size);
 
-  data = malloc(len + 4);
+  if(htsmsg_binary_serialize_buf(msg, &hbb, maxlen)) {
+    free(hbb.hbb_data);
+    return -1;
+  }
 
-  data[0] = len >> 24;
-  data[1] = len >> 16;
-  data[2] = len >> 8;
-  data[3] = len;
+  /* Next one is likely to be of similar size */
+  htsmsg_binary_hint = MAX(64, hbb.hbb_len + hbb.hbb_len / 4);
 
-  htsmsg_binary_write(msg, data + 4);
-  *datap = data;
-  *lenp  = len + 4;
+  *datap = hbb.hbb_data;
+  *lenp  = hbb.hbb_len;
   return 0;
 }
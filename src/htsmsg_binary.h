@@ -21,13 +21,35 @@
 
 #include "htsmsg.h"
 
+/**
+ * Output buffer for the serializers. Can be kept around and reused, so
+ * its allocation is amortized over many messages. Zero initialize
+ * before first use
+ */
+typedef struct htsmsg_binary_buf {
+  uint8_t *hbb_data;
+  size_t hbb_len;
+  size_t hbb_size;
+} htsmsg_binary_buf_t;
+
+void htsmsg_binary_buf_free(htsmsg_binary_buf_t *hbb);
+
 /**
  * htsmsg_binary_deserialize
  */
 htsmsg_t *htsmsg_binary_deserialize(const void *data, size_t len,
 				    const void *buf);
 
+/**
+ * Serialize into a malloc()ed buffer returned in *datap
+ */
 int htsmsg_binary_serialize(htsmsg_t *msg, void **datap, size_t *lenp,
 			    int maxlen);
 
+/**
+ * Serialize and append to hbb
+ */
+int htsmsg_binary_serialize_buf(htsmsg_t *msg, htsmsg_binary_buf_t *hbb,
+				int maxlen);
+
 #endif /* HTSMSG_BINARY_H_ */
@@ -29,6 +29,8 @@
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 
 #include "tvheadend.h"
 #include "channels.h"
@@ -47,6 +49,9 @@
 #endif
 
 #include <sys/statvfs.h>
+#if ENABLE_ZLIB
+#include <zlib.h>
+#endif
 #include "settings.h"
 #include <sys/time.h>
 
@@ -92,8 +97,81 @@ typedef struct htsp_msg {
 			   hm_msg can contain messages that points
 			   to packet payload so to avoid copy we
 			   keep a reference here */
+
+  /**
+   * Prebuilt muxpkt (hm_msg == NULL). hm_hdr is the serialized message
+   * up to and including the header of the payload field, the payload
+   * itself is written straight from hm_pb
+   */
+  uint8_t *hm_hdr;
+  size_t hm_hdrlen;
+  int64_t hm_dts;       /* As sent, for queue delay reports */
+
+  /**
+   * fileRead reply (hm_msg == NULL, hm_pb == NULL). hm_hdr is followed
+   * by hm_file_len bytes that are sent from hm_file_fd at hm_file_off
+   * with sendfile()
+   */
+  int hm_file_fd;
+  off_t hm_file_off;
+  size_t hm_file_len;
+
+  int hm_deflate;       /* Goes out through the connection's deflate stream */
 } htsp_msg_t;
 
+/* Worst case size of a serialized muxpkt without payload */
+#define HTSP_MUXPKT_HDR_MAX 192
+
+/* Worst case size of a serialized fileRead reply without data */
+#define HTSP_FILE_HDR_MAX   64
+
+/* Largest chunk returned by fileRead, bigger requests are cut short */
+#define HTSP_FILE_READ_MAX  (1024 * 1024)
+
+/* Most messages / bytes the writer hands to the kernel in one go */
+#define HTSP_WRITE_BATCH    64
+#define HTSP_WRITE_BYTES    (256 * 1024)
+
+/* Batches written per output callback before yielding the worker */
+#define HTSP_WRITE_ROUNDS   8
+
+/**
+ * A frame whose length has this bit set carries a piece of the
+ * connection's deflate stream rather than a message. Each piece ends on a
+ * sync flush and inflates to one or more ordinary length prefixed messages
+ */
+#define HTSP_FRAME_DEFLATE  0x80000000
+
+/* Output buffer growth step when deflating */
+#define HTSP_DEFLATE_CHUNK  (16 * 1024)
+
+/* Receive buffer growth step */
+#define HTSP_READ_CHUNK     (64 * 1024)
+
+/* Objects visited per global_lock hold when producing the initial sync */
+#define HTSP_SYNC_BATCH     64
+
+/**
+ * Initial sync phases, in the order they are sent
+ */
+typedef enum {
+  HTSP_SYNC_TAGS,
+  HTSP_SYNC_CHANNELS,
+  HTSP_SYNC_TAG_MEMBERS,
+  HTSP_SYNC_DVR,
+  HTSP_SYNC_EPG_DELETED,
+  HTSP_SYNC_EPG,
+  HTSP_SYNC_DONE,
+} htsp_sync_phase_t;
+
+
+/**
+ * Position of an object in the initial sync snapshot
+ */
+typedef struct htsp_sync_index {
+  uint32_t hsi_id;
+  int hsi_pos;
+} htsp_sync_index_t;
 
 /**
  *
@@ -131,21 +209,89 @@ typedef struct htsp_connection {
   LIST_ENTRY(htsp_connection) htsp_async_link;
 
   /**
-   * Writer thread
+   * Initial sync cursor, protected by global_lock. htsp_sync_ids is a
+   * snapshot of the object ids of the current phase, htsp_sync_pos the
+   * next one to send. htsp_sync_index is the same snapshot sorted by id,
+   * to look up where an object is in it.
+   *
+   * In delta mode the EPG phases send only what changed after the
+   * client's epgSeq, htsp_sync_seq is the change sequence cursor
    */
-  pthread_t htsp_writer_thread;
+  htsp_sync_phase_t htsp_sync_phase;
+  uint32_t *htsp_sync_ids;
+  htsp_sync_index_t *htsp_sync_index;
+  int htsp_sync_count;
+  int htsp_sync_pos;
+  time_t htsp_sync_epgstart; /* Start of last event sent on channel */
+  int htsp_sync_delta;
+  uint64_t htsp_sync_epgseq; /* As given by the client */
+  uint64_t htsp_sync_seq;
+  int64_t htsp_sync_lastupdate;
+  int64_t htsp_sync_epgmaxtime;
 
-  int htsp_writer_run;
+  /**
+   * Set while the initial sync is running, protected by htsp_out_mutex
+   * so the output side can check it without taking global_lock
+   */
+  int htsp_sync_active;
+
+  /**
+   * Connection engine handle, output is kicked with
+   * tcp_connection_wakeup() when the output queues go non-empty
+   */
+  tcp_connection_t *htsp_tc;
 
   struct htsp_msg_q_queue htsp_active_output_queues;
 
   pthread_mutex_t htsp_out_mutex;
-  pthread_cond_t htsp_out_cond;
 
   htsp_msg_q_t htsp_hmq_ctrl;
   htsp_msg_q_t htsp_hmq_epg;
   htsp_msg_q_t htsp_hmq_qstatus;
 
+  /**
+   * Writer statistics, protected by htsp_out_mutex
+   */
+  uint64_t htsp_stat_syscalls;
+  uint64_t htsp_stat_bytes;
+
+  /**
+   * Compression of control and EPG messages, negotiated in hello.
+   * htsp_deflate is protected by htsp_out_mutex, the stream itself is
+   * only touched by the output callback
+   */
+  int htsp_deflate_req;
+  int htsp_deflate;
+#if ENABLE_ZLIB
+  z_stream *htsp_zstream;
+  int htsp_zfailed;
+  htsmsg_binary_buf_t htsp_zbuf;
+  uint64_t htsp_stat_zin;
+  uint64_t htsp_stat_zout;
+#endif
+
+  /**
+   * Input buffer, holds received data up to a partial message
+   */
+  uint8_t *htsp_rbuf;
+  size_t htsp_rbuf_len;
+  size_t htsp_rbuf_size;
+
+  /**
+   * Batch currently being written, only touched by the output callback
+   */
+  htsp_msg_t *htsp_wbatch[HTSP_WRITE_BATCH];
+  void *htsp_wdptr[HTSP_WRITE_BATCH];
+  struct iovec htsp_wiov[HTSP_WRITE_BATCH * 2];
+  struct iovec *htsp_wcur;
+  int htsp_wn;
+  int htsp_wiovcnt;
+  int htsp_wmore;
+  size_t htsp_wbytes;
+  int htsp_wsyscalls;
+  htsp_msg_t *htsp_wfile; /* Last in batch, file data still to be sent */
+  htsmsg_binary_buf_t htsp_wbuf;
+
   struct htsp_subscription_list htsp_subscriptions;
   struct htsp_file_list htsp_files;
   int htsp_file_id;
@@ -235,6 +381,8 @@ htsp_msg_destroy(htsp_msg_t *hm)
   htsmsg_destroy(hm->hm_msg);
   if(hm->hm_pb != NULL)
     pktbuf_ref_dec(hm->hm_pb);
+  if(hm->hm_file_fd != -1)
+    close(hm->hm_file_fd);
   free(hm);
 }
 
@@ -293,21 +441,21 @@ htsp_subscription_destroy(htsp_connection_t *htsp, htsp_subscription_t *hs)
  *
  */
 static void
-htsp_send(htsp_connection_t *htsp, htsmsg_t *m, pktbuf_t *pb,
-	  htsp_msg_q_t *hmq, int payloadsize)
+htsp_enqueue(htsp_connection_t *htsp, htsp_msg_t *hm, htsp_msg_q_t *hmq)
 {
-  htsp_msg_t *hm = malloc(sizeof(htsp_msg_t));
+  int wakeup;
 
-  hm->hm_msg = m;
-  hm->hm_pb = pb;
-  if(pb != NULL)
-    pktbuf_ref_inc(pb);
-  hm->hm_payloadsize = payloadsize;
-  
   pthread_mutex_lock(&htsp->htsp_out_mutex);
 
+  /* If anything is queued already the writer is on its way */
+  wakeup = TAILQ_FIRST(&htsp->htsp_active_output_queues) == NULL;
+
   TAILQ_INSERT_TAIL(&hmq->hmq_q, hm, hm_link);
 
+  /* Streaming data stays uncompressed, it's latency sensitive */
+  hm->hm_deflate = htsp->htsp_deflate && hm->hm_hdr == NULL &&
+    (hmq == &htsp->htsp_hmq_ctrl || hmq == &htsp->htsp_hmq_epg);
+
   if(hmq->hmq_length == 0) {
     /* Activate queue */
 
@@ -319,9 +467,34 @@ htsp_send(htsp_connection_t *htsp, htsmsg_t *m, pktbuf_t *pb,
   }
 
   hmq->hmq_length++;
-  hmq->hmq_payload += payloadsize;
-  pthread_cond_signal(&htsp->htsp_out_cond);
+  hmq->hmq_payload += hm->hm_payloadsize;
   pthread_mutex_unlock(&htsp->htsp_out_mutex);
+
+  if(wakeup)
+    tcp_connection_wakeup(htsp->htsp_tc);
+}
+
+/**
+ *
+ */
+static void
+htsp_send(htsp_connection_t *htsp, htsmsg_t *m, pktbuf_t *pb,
+	  htsp_msg_q_t *hmq, int payloadsize)
+{
+  htsp_msg_t *hm = malloc(sizeof(htsp_msg_t));
+
+  hm->hm_msg = m;
+  hm->hm_pb = pb;
+  if(pb != NULL)
+    pktbuf_ref_inc(pb);
+  hm->hm_payloadsize = payloadsize;
+  hm->hm_hdr = NULL;
+  hm->hm_hdrlen = 0;
+  hm->hm_dts = PTS_UNSET;
+  hm->hm_file_fd = -1;
+  hm->hm_file_len = 0;
+
+  htsp_enqueue(htsp, hm, hmq);
 }
 
 /**
@@ -374,6 +547,65 @@ htsp_generate_challenge(htsp_connection_t *htsp)
   return n != 32;
 }
 
+/**
+ * Serialization of single htsmsg fields, in the same format as
+ * htsmsg_binary_serialize()
+ */
+static inline void
+htsp_put_u32(uint8_t *p, uint32_t u32)
+{
+  p[0] = u32 >> 24;
+  p[1] = u32 >> 16;
+  p[2] = u32 >> 8;
+  p[3] = u32;
+}
+
+static uint8_t *
+htsp_field_hdr(uint8_t *p, int type, const char *name, uint32_t len)
+{
+  int namelen = strlen(name);
+
+  *p++ = type;
+  *p++ = namelen;
+  htsp_put_u32(p, len);
+  memcpy(p + 4, name, namelen);
+  return p + 4 + namelen;
+}
+
+static uint8_t *
+htsp_field_s64(uint8_t *p, const char *name, int64_t s64)
+{
+  uint64_t u64 = s64;
+  int l = 0;
+
+  while(u64 != 0) {
+    l++;
+    u64 >>= 8;
+  }
+  p = htsp_field_hdr(p, HMF_S64, name, l);
+  for(u64 = s64; l > 0; l--) {
+    *p++ = u64;
+    u64 >>= 8;
+  }
+  return p;
+}
+
+static uint8_t *
+htsp_field_str(uint8_t *p, const char *name, const char *str)
+{
+  int l = strlen(str);
+
+  p = htsp_field_hdr(p, HMF_STR, name, l);
+  memcpy(p, str, l);
+  return p + l;
+}
+
+static uint8_t *
+htsp_field_bin_hdr(uint8_t *p, const char *name, uint32_t len)
+{
+  return htsp_field_hdr(p, HMF_BIN, name, len);
+}
+
 /* **************************************************************************
  * File helpers
  * *************************************************************************/
@@ -390,6 +622,9 @@ htsp_file_open(htsp_connection_t *htsp, const char *path)
   if(fd == -1)
     return htsp_error("Unable to open file");
 
+  /* Recordings are mostly played start to end */
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
   htsp_file_t *hf = calloc(1, sizeof(htsp_file_t));
   hf->hf_fd = fd;
   hf->hf_id = ++htsp->htsp_file_id;
@@ -452,7 +687,7 @@ htsp_build_channel(channel_t *ch, const char *method)
   service_t *t;
   epg_broadcast_t *now, *next = NULL;
 
-  htsmsg_t *out = htsmsg_create_map();
+  htsmsg_t *out = htsmsg_create_map_arena();
   htsmsg_t *tags = htsmsg_create_list();
   htsmsg_t *services = htsmsg_create_list();
 
@@ -499,7 +734,7 @@ static htsmsg_t *
 htsp_build_tag(channel_tag_t *ct, const char *method, int include_channels)
 {
   channel_tag_mapping_t *ctm;
-  htsmsg_t *out = htsmsg_create_map();
+  htsmsg_t *out = htsmsg_create_map_arena();
   htsmsg_t *members = include_channels ? htsmsg_create_list() : NULL;
  
   htsmsg_add_u32(out, "tagId", ct->ct_identifier);
@@ -524,7 +759,7 @@ htsp_build_tag(channel_tag_t *ct, const char *method, int include_channels)
 static htsmsg_t *
 htsp_build_dvrentry(dvr_entry_t *de, const char *method)
 {
-  htsmsg_t *out = htsmsg_create_map();
+  htsmsg_t *out = htsmsg_create_map_arena();
   const char *s = NULL, *error = NULL;
   const char *p;
   dvr_config_t *cfg;
@@ -603,7 +838,8 @@ htsp_build_event
     if (ignore) return NULL;
   }
 
-  out = htsmsg_create_map();
+  /* Replies may end up in a list, only messages of their own are arena */
+  out = method ? htsmsg_create_map_arena() : htsmsg_create_map();
 
   if (method)
     htsmsg_add_str(out, "method", method);
@@ -683,6 +919,9 @@ static htsmsg_t *
 htsp_method_hello(htsp_connection_t *htsp, htsmsg_t *in)
 {
   htsmsg_t *l, *r = htsmsg_create_map();
+#if ENABLE_ZLIB
+  htsmsg_field_t *f;
+#endif
   uint32_t v;
   const char *name;
   int i = 0;
@@ -713,6 +952,19 @@ htsp_method_hello(htsp_connection_t *htsp, htsmsg_t *in)
 
   htsmsg_add_msg(r, "servercapability", l);
 
+  /* Compression, enabled once this reply is queued */
+#if ENABLE_ZLIB
+  if((l = htsmsg_get_list(in, "compression")) != NULL) {
+    HTSMSG_FOREACH(f, l) {
+      if(f->hmf_type == HMF_STR && !strcmp(f->hmf_str, "zlib")) {
+        htsmsg_add_str(r, "compression", "zlib");
+        htsp->htsp_deflate_req = 1;
+        break;
+      }
+    }
+  }
+#endif
+
   /* Set version to lowest num */
   htsp->htsp_version = MIN(HTSP_PROTO_VERSION, v);
 
@@ -774,72 +1026,452 @@ htsp_method_getSysTime(htsp_connection_t *htsp, htsmsg_t *in)
 }
 
 /**
- * Switch the HTSP connection into async mode
+ *
  */
-static htsmsg_t *
-htsp_method_async(htsp_connection_t *htsp, htsmsg_t *in)
+static int
+htsp_sync_index_cmp(const void *a, const void *b)
+{
+  uint32_t x = ((const htsp_sync_index_t *)a)->hsi_id;
+  uint32_t y = ((const htsp_sync_index_t *)b)->hsi_id;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Start a phase of the initial sync by taking a snapshot of the ids
+ * of all objects it covers, global_lock is held
+ */
+static void
+htsp_sync_start_phase(htsp_connection_t *htsp, htsp_sync_phase_t phase)
 {
   channel_t *ch;
   channel_tag_t *ct;
   dvr_entry_t *de;
+  int i, n = 0;
+
+  if(phase >= HTSP_SYNC_EPG_DELETED &&
+     !(htsp->htsp_async_mode & HTSP_ASYNC_EPG))
+    phase = HTSP_SYNC_DONE;
+  if(phase == HTSP_SYNC_EPG_DELETED && !htsp->htsp_sync_delta)
+    phase = HTSP_SYNC_EPG;
+
+  free(htsp->htsp_sync_ids);
+  free(htsp->htsp_sync_index);
+  htsp->htsp_sync_ids = NULL;
+  htsp->htsp_sync_index = NULL;
+
+  switch(phase) {
+  case HTSP_SYNC_TAGS:
+  case HTSP_SYNC_TAG_MEMBERS:
+    TAILQ_FOREACH(ct, &channel_tags, ct_link)
+      n++;
+    htsp->htsp_sync_ids = malloc(sizeof(uint32_t) * (n + 1));
+    n = 0;
+    TAILQ_FOREACH(ct, &channel_tags, ct_link)
+      if(ct->ct_enabled && !ct->ct_internal)
+	htsp->htsp_sync_ids[n++] = ct->ct_identifier;
+    break;
+
+  case HTSP_SYNC_EPG_DELETED:
+    /* Cursor is htsp_sync_seq, count is just a 'not done' marker */
+    htsp->htsp_sync_seq = htsp->htsp_sync_epgseq;
+    n = 1;
+    break;
+
+  case HTSP_SYNC_EPG:
+    if(htsp->htsp_sync_delta) {
+      htsp->htsp_sync_seq = htsp->htsp_sync_epgseq;
+      n = 1;
+      break;
+    }
+    /* Fall through */
+  case HTSP_SYNC_CHANNELS:
+    RB_FOREACH(ch, &channel_name_tree, ch_name_link)
+      n++;
+    htsp->htsp_sync_ids = malloc(sizeof(uint32_t) * (n + 1));
+    n = 0;
+    RB_FOREACH(ch, &channel_name_tree, ch_name_link)
+      htsp->htsp_sync_ids[n++] = ch->ch_id;
+    break;
+
+  case HTSP_SYNC_DVR:
+    LIST_FOREACH(de, &dvrentries, de_global_link)
+      n++;
+    htsp->htsp_sync_ids = malloc(sizeof(uint32_t) * (n + 1));
+    n = 0;
+    LIST_FOREACH(de, &dvrentries, de_global_link)
+      htsp->htsp_sync_ids[n++] = de->de_id;
+    break;
+
+  case HTSP_SYNC_DONE:
+    break;
+  }
+
+  if(htsp->htsp_sync_ids != NULL) {
+    htsp->htsp_sync_index = malloc(sizeof(htsp_sync_index_t) * (n + 1));
+    for(i = 0; i < n; i++) {
+      htsp->htsp_sync_index[i].hsi_id  = htsp->htsp_sync_ids[i];
+      htsp->htsp_sync_index[i].hsi_pos = i;
+    }
+    qsort(htsp->htsp_sync_index, n, sizeof(htsp_sync_index_t),
+	  htsp_sync_index_cmp);
+  }
+
+  htsp->htsp_sync_phase = phase;
+  htsp->htsp_sync_count = n;
+  htsp->htsp_sync_pos = 0;
+  htsp->htsp_sync_epgstart = 0;
+}
+
+/**
+ *
+ */
+static int
+htsp_ebc_start_cmp(const epg_broadcast_t *a, const epg_broadcast_t *b)
+{
+  return a->start < b->start ? -1 : a->start > b->start;
+}
+
+/**
+ * Send the events of one channel from where we left off. Returns the
+ * number of events visited, the cursor moves on to the next channel
+ * once all have been sent
+ */
+static int
+htsp_sync_epg(htsp_connection_t *htsp, channel_t *ch, int max)
+{
+  epg_broadcast_t *ebc, skel;
+  htsmsg_t *e;
+  int n = 0;
+
+  skel.start = htsp->htsp_sync_epgstart;
+  ebc = RB_FIND_GT(&ch->ch_epg_schedule, &skel, sched_link,
+		   htsp_ebc_start_cmp);
+
+  for(; ebc != NULL; ebc = RB_NEXT(ebc, sched_link)) {
+    if(htsp->htsp_sync_epgmaxtime && ebc->start > htsp->htsp_sync_epgmaxtime)
+      break;
+    if(n == max)
+      return n;
+    e = htsp_build_event(ebc, "eventAdd", htsp->htsp_language,
+			 htsp->htsp_sync_lastupdate, htsp);
+    if(e != NULL)
+      htsp_send_message(htsp, e, NULL);
+    htsp->htsp_sync_epgstart = ebc->start;
+    n++;
+  }
+
+  htsp->htsp_sync_pos++;
+  htsp->htsp_sync_epgstart = 0;
+  return n;
+}
+
+/**
+ * Delta mode, send a broadcast if it's within the requested window.
+ * Broadcasts the client has never seen are sent as new ones
+ */
+static void
+htsp_sync_delta_broadcast(htsp_connection_t *htsp, epg_broadcast_t *ebc)
+{
+  const char *method;
+
+  if(ebc->channel == NULL)
+    return;
+  if(htsp->htsp_sync_epgmaxtime && ebc->start > htsp->htsp_sync_epgmaxtime)
+    return;
+  method = ebc->added > htsp->htsp_sync_epgseq ? "eventAdd" : "eventUpdate";
+  htsp_send_message(htsp, htsp_build_event(ebc, method,
+					   htsp->htsp_language, 0, htsp),
+		    NULL);
+}
+
+/**
+ * Delta mode, send the broadcasts affected by a change of 'eo'.
+ * Returns the number of broadcasts visited
+ */
+static int
+htsp_sync_delta_object(htsp_connection_t *htsp, epg_object_t *eo)
+{
+  epg_broadcast_t *ebc;
+  epg_episode_t *ee;
+  int n = 0;
+
+  switch(eo->type) {
+  case EPG_BROADCAST:
+    htsp_sync_delta_broadcast(htsp, (epg_broadcast_t *)eo);
+    return 1;
+
+  case EPG_EPISODE:
+    LIST_FOREACH(ebc, &((epg_episode_t *)eo)->broadcasts, ep_link) {
+      htsp_sync_delta_broadcast(htsp, ebc);
+      n++;
+    }
+    break;
+
+  case EPG_SEASON:
+    LIST_FOREACH(ee, &((epg_season_t *)eo)->episodes, slink)
+      LIST_FOREACH(ebc, &ee->broadcasts, ep_link) {
+	htsp_sync_delta_broadcast(htsp, ebc);
+	n++;
+      }
+    break;
+
+  case EPG_BRAND:
+    LIST_FOREACH(ee, &((epg_brand_t *)eo)->episodes, blink)
+      LIST_FOREACH(ebc, &ee->broadcasts, ep_link) {
+	htsp_sync_delta_broadcast(htsp, ebc);
+	n++;
+      }
+    break;
+
+  case EPG_SERIESLINK:
+    LIST_FOREACH(ebc, &((epg_serieslink_t *)eo)->broadcasts, sl_link) {
+      htsp_sync_delta_broadcast(htsp, ebc);
+      n++;
+    }
+    break;
+
+  default:
+    break;
+  }
+  return n;
+}
+
+/**
+ * Produce the next batch of the initial sync. Called from the output
+ * side once the queues have run dry so the amount of sync data held per
+ * client stays bounded. global_lock is only held for one batch
+ */
+static void
+htsp_sync_step(htsp_connection_t *htsp)
+{
+  channel_t *ch;
+  channel_tag_t *ct;
+  dvr_entry_t *de;
+  epg_object_t *eo;
   htsmsg_t *m;
+  uint64_t seq;
+  uint32_t id;
+  int n = 0;
+
+  pthread_mutex_lock(&global_lock);
+
+  while(n < HTSP_SYNC_BATCH && htsp->htsp_sync_phase != HTSP_SYNC_DONE) {
+
+    if(htsp->htsp_sync_pos == htsp->htsp_sync_count) {
+      htsp_sync_start_phase(htsp, htsp->htsp_sync_phase + 1);
+      if(htsp->htsp_sync_phase == HTSP_SYNC_DONE) {
+	/* Notify that initial sync has been completed */
+	m = htsmsg_create_map();
+	htsmsg_add_str(m, "method", "initialSyncCompleted");
+	htsmsg_add_s64(m, "epgSeq", epg_change_seq);
+	htsmsg_add_s64(m, "epgSeqEpoch", epg_change_epoch);
+	htsp_send_message(htsp, m, NULL);
+      }
+      continue;
+    }
+
+    if(htsp->htsp_sync_phase == HTSP_SYNC_EPG_DELETED) {
+      if(epg_journal_deleted_after(htsp->htsp_sync_seq, &seq, &id)) {
+	htsp->htsp_sync_pos++;
+	continue;
+      }
+      m = htsmsg_create_map();
+      htsmsg_add_str(m, "method", "eventDelete");
+      htsmsg_add_u32(m, "eventId", id);
+      htsp_send_message(htsp, m, NULL);
+      htsp->htsp_sync_seq = seq;
+      n++;
+      continue;
+    }
+
+    if(htsp->htsp_sync_phase == HTSP_SYNC_EPG && htsp->htsp_sync_delta) {
+      if((eo = epg_object_changed_after(htsp->htsp_sync_seq)) == NULL) {
+	htsp->htsp_sync_pos++;
+	continue;
+      }
+      n += 1 + htsp_sync_delta_object(htsp, eo);
+      htsp->htsp_sync_seq = eo->changed;
+      continue;
+    }
+
+    /* Objects may have gone away since the snapshot was taken */
+    id = htsp->htsp_sync_ids[htsp->htsp_sync_pos];
+    n++;
+
+    switch(htsp->htsp_sync_phase) {
+    case HTSP_SYNC_TAGS:
+    case HTSP_SYNC_TAG_MEMBERS:
+      ct = channel_tag_find_by_identifier(id);
+      if(ct != NULL && ct->ct_enabled && !ct->ct_internal)
+	htsp_send_message(htsp,
+			  htsp->htsp_sync_phase == HTSP_SYNC_TAGS ?
+			  htsp_build_tag(ct, "tagAdd", 0) :
+			  htsp_build_tag(ct, "tagUpdate", 1), NULL);
+      htsp->htsp_sync_pos++;
+      break;
+
+    case HTSP_SYNC_CHANNELS:
+      if((ch = channel_find_by_identifier(id)) != NULL)
+	htsp_send_message(htsp, htsp_build_channel(ch, "channelAdd"), NULL);
+      htsp->htsp_sync_pos++;
+      break;
+
+    case HTSP_SYNC_DVR:
+      if((de = dvr_entry_find_by_id(id)) != NULL)
+	htsp_send_message(htsp, htsp_build_dvrentry(de, "dvrEntryAdd"), NULL);
+      htsp->htsp_sync_pos++;
+      break;
+
+    case HTSP_SYNC_EPG_DELETED:
+      break;
+
+    case HTSP_SYNC_EPG:
+      if((ch = channel_find_by_identifier(id)) != NULL)
+	n += htsp_sync_epg(htsp, ch, HTSP_SYNC_BATCH - n);
+      else
+	htsp->htsp_sync_pos++;
+      break;
+
+    case HTSP_SYNC_DONE:
+      break;
+    }
+  }
+
+  if(htsp->htsp_sync_phase == HTSP_SYNC_DONE) {
+    free(htsp->htsp_sync_ids);
+    free(htsp->htsp_sync_index);
+    htsp->htsp_sync_ids = NULL;
+    htsp->htsp_sync_index = NULL;
+    pthread_mutex_lock(&htsp->htsp_out_mutex);
+    htsp->htsp_sync_active = 0;
+    pthread_mutex_unlock(&htsp->htsp_out_mutex);
+  }
+
+  pthread_mutex_unlock(&global_lock);
+}
+
+/**
+ * Position of object 'id' in the snapshot of the current phase,
+ * -1 if it's not in it. global_lock is held
+ */
+static int
+htsp_sync_find(htsp_connection_t *htsp, uint32_t id)
+{
+  htsp_sync_index_t skel, *hsi;
+
+  if(htsp->htsp_sync_index == NULL)
+    return -1;
+  skel.hsi_id = id;
+  hsi = bsearch(&skel, htsp->htsp_sync_index, htsp->htsp_sync_count,
+		sizeof(htsp_sync_index_t), htsp_sync_index_cmp);
+  return hsi != NULL ? hsi->hsi_pos : -1;
+}
+
+/**
+ * Check if the initial sync has passed object 'id' of 'phase'.
+ * Updates of objects that are still ahead of the cursor are not sent,
+ * the sync will send their current state when it gets there.
+ * global_lock is held
+ */
+static int
+htsp_sync_passed(htsp_connection_t *htsp, htsp_sync_phase_t phase,
+		 uint32_t id)
+{
+  int pos;
+
+  if(htsp->htsp_sync_phase != phase)
+    return htsp->htsp_sync_phase > phase;
+
+  pos = htsp_sync_find(htsp, id);
+  return pos < 0 || pos < htsp->htsp_sync_pos;
+}
+
+/**
+ * As above, for EPG events that are sent per channel in start order.
+ * In delta mode every change gets a new sequence number so the cursor
+ * will always get to it. Deletions are journalled the same way, so they
+ * are only sent live once the journal has been walked
+ */
+static int
+htsp_sync_passed_event(htsp_connection_t *htsp, epg_broadcast_t *ebc,
+		       int deleted)
+{
+  int pos;
+
+  if(htsp->htsp_sync_phase > HTSP_SYNC_EPG)
+    return 1;
+
+  if(htsp->htsp_sync_delta)
+    return deleted && htsp->htsp_sync_phase > HTSP_SYNC_EPG_DELETED;
+
+  if(htsp->htsp_sync_phase != HTSP_SYNC_EPG)
+    return 0;
+
+  if(ebc->channel == NULL)
+    return 1;
+
+  pos = htsp_sync_find(htsp, ebc->channel->ch_id);
+  if(pos < 0 || pos < htsp->htsp_sync_pos)
+    return 1;
+  return pos == htsp->htsp_sync_pos &&
+    ebc->start <= htsp->htsp_sync_epgstart;
+}
+
+/**
+ * Switch the HTSP connection into async mode
+ *
+ * The initial sync is not built here, it's produced in batches by
+ * htsp_sync_step() as the client consumes it
+ */
+static htsmsg_t *
+htsp_method_async(htsp_connection_t *htsp, htsmsg_t *in)
+{
   uint32_t epg = 0;
   int64_t lastUpdate = 0;
   int64_t epgMaxTime = 0;
+  int64_t epgSeq = 0, epgSeqEpoch = 0;
   const char *lang;
-  epg_broadcast_t *ebc;
+  htsmsg_t *out;
 
   /* Get optional flags */
   htsmsg_get_u32(in, "epg", &epg);
   htsmsg_get_s64(in, "lastUpdate", &lastUpdate);
   htsmsg_get_s64(in, "epgMaxTime", &epgMaxTime);
+  htsmsg_get_s64(in, "epgSeq", &epgSeq);
+  htsmsg_get_s64(in, "epgSeqEpoch", &epgSeqEpoch);
   if ((lang = htsmsg_get_str(in, "language")))
-    htsp->htsp_language = strdup(lang);
+    tvh_str_update(&htsp->htsp_language, lang);
 
-  /* First, just OK the async request */
-  htsp_reply(htsp, in, htsmsg_create_map()); 
-
-  if(htsp->htsp_async_mode)
+  if(htsp->htsp_async_mode) {
+    htsp_reply(htsp, in, htsmsg_create_map()); 
     return NULL; /* already in async mode */
+  }
+
+  /* Only send EPG changes if the client's view is from this epoch and
+     we still know about everything that's been deleted since */
+  htsp->htsp_sync_delta = epg && epgSeq > 0 &&
+    epgSeqEpoch == epg_change_epoch && epg_journal_complete(epgSeq);
+  htsp->htsp_sync_epgseq = epgSeq;
+
+  /* First, just OK the async request */
+  out = htsmsg_create_map();
+  if(htsp->htsp_sync_delta)
+    htsmsg_add_u32(out, "epgDelta", 1);
+  htsp_reply(htsp, in, out);
 
   htsp->htsp_async_mode = HTSP_ASYNC_ON;
   if(epg)
     htsp->htsp_async_mode |= HTSP_ASYNC_EPG;
 
-  /* Send all enabled and external tags */
-  TAILQ_FOREACH(ct, &channel_tags, ct_link)
-    if(ct->ct_enabled && !ct->ct_internal)
-      htsp_send_message(htsp, htsp_build_tag(ct, "tagAdd", 0), NULL);
-  
-  /* Send all channels */
-  RB_FOREACH(ch, &channel_name_tree, ch_name_link)
-    htsp_send_message(htsp, htsp_build_channel(ch, "channelAdd"), NULL);
-    
-  /* Send all enabled and external tags (now with channel mappings) */
-  TAILQ_FOREACH(ct, &channel_tags, ct_link)
-    if(ct->ct_enabled && !ct->ct_internal)
-      htsp_send_message(htsp, htsp_build_tag(ct, "tagUpdate", 1), NULL);
-
-  /* Send all DVR entries */
-  LIST_FOREACH(de, &dvrentries, de_global_link)
-    htsp_send_message(htsp, htsp_build_dvrentry(de, "dvrEntryAdd"), NULL);
-
-  /* Send EPG updates */
-  if (epg) {
-    RB_FOREACH(ch, &channel_name_tree, ch_name_link)
-      RB_FOREACH(ebc, &ch->ch_epg_schedule, sched_link) {
-        if (epgMaxTime && ebc->start > epgMaxTime) break;
-        htsmsg_t *e = htsp_build_event(ebc, "eventAdd", lang, lastUpdate, htsp);
-        if (e) htsp_send_message(htsp, e, NULL);
-      }
-  }
-
-  /* Notify that initial sync has been completed */
-  m = htsmsg_create_map();
-  htsmsg_add_str(m, "method", "initialSyncCompleted");
-  htsp_send_message(htsp, m, NULL);
+  htsp->htsp_sync_lastupdate = lastUpdate;
+  htsp->htsp_sync_epgmaxtime = epgMaxTime;
+  htsp_sync_start_phase(htsp, HTSP_SYNC_TAGS);
+  pthread_mutex_lock(&htsp->htsp_out_mutex);
+  htsp->htsp_sync_active = 1;
+  pthread_mutex_unlock(&htsp->htsp_out_mutex);
 
-  /* Insert in list so it will get all updates */
+  /* Insert in list so it will get all updates, htsp_sync_passed()
+     keeps them in order with the sync */
   LIST_INSERT_HEAD(&htsp_async_connections, htsp, htsp_async_link);
 
   return NULL;
@@ -1395,14 +2027,21 @@ htsp_method_file_open(htsp_connection_t *htsp, htsmsg_t *in)
 }
 
 /**
- *
+ * The reply is queued inline, its data is sent by the output callback
+ * straight from the file with sendfile(). At most HTSP_FILE_READ_MAX
+ * bytes are returned per call, the file position moves past them as
+ * with read()
  */
 static htsmsg_t *
 htsp_method_file_read(htsp_connection_t *htsp, htsmsg_t *in)
 {
   htsp_file_t *hf = htsp_file_find(htsp, in);
+  htsp_msg_t *hm;
+  struct stat st;
   int64_t off;
   int64_t size;
+  uint32_t seq;
+  uint8_t *p;
 
   if(hf == NULL)
     return htsp_error("Unknown file id");
@@ -1410,26 +2049,55 @@ htsp_method_file_read(htsp_connection_t *htsp, htsmsg_t *in)
   if(htsmsg_get_s64(in, "size", &size))
     return htsp_error("Missing field 'size'");
 
+  if(size < 0)
+    return htsp_error("Too big segment");
+
   /* Seek (optional) */
-  if (!htsmsg_get_s64(in, "offset", &off))
+  if (!htsmsg_get_s64(in, "offset", &off)) {
     if(lseek(hf->hf_fd, off, SEEK_SET) != off)
       return htsp_error("Seek error");
+  } else if((off = lseek(hf->hf_fd, 0, SEEK_CUR)) < 0) {
+    return htsp_error("Seek error");
+  }
 
-  /* Read */
-  void *m = malloc(size);
-  if(m == NULL)
-    return htsp_error("Too big segment");
+  if(fstat(hf->hf_fd, &st))
+    return htsp_error("Read error");
 
-  int r = read(hf->hf_fd, m, size);
-  if(r < 0) {
-    free(m);
+  size = MIN(size, HTSP_FILE_READ_MAX);
+  size = off < st.st_size ? MIN(size, st.st_size - off) : 0;
+
+  hm = malloc(sizeof(htsp_msg_t) + HTSP_FILE_HDR_MAX);
+  hm->hm_msg = NULL;
+  hm->hm_pb = NULL;
+  hm->hm_payloadsize = size;
+  hm->hm_hdr = (uint8_t *)(hm + 1);
+  hm->hm_dts = PTS_UNSET;
+  hm->hm_file_fd = -1;
+  hm->hm_file_off = off;
+  hm->hm_file_len = size;
+
+  /* Own descriptor, the file may be closed before the data is out */
+  if(size > 0 && (hm->hm_file_fd = dup(hf->hf_fd)) == -1) {
+    free(hm);
     return htsp_error("Read error");
   }
 
-  htsmsg_t *rep = htsmsg_create_map();
-  htsmsg_add_bin(rep, "data", m, r);
-  free(m);
-  return rep;
+  lseek(hf->hf_fd, off + size, SEEK_SET);
+
+  /* Get the next chunk on its way while this one is sent */
+  if(off + size < st.st_size)
+    posix_fadvise(hf->hf_fd, off + size, HTSP_FILE_READ_MAX,
+		  POSIX_FADV_WILLNEED);
+
+  p = hm->hm_hdr + 4;
+  if(!htsmsg_get_u32(in, "seq", &seq))
+    p = htsp_field_s64(p, "seq", seq);
+  p = htsp_field_bin_hdr(p, "data", size);
+  hm->hm_hdrlen = p - hm->hm_hdr;
+  htsp_put_u32(hm->hm_hdr, hm->hm_hdrlen - 4 + size);
+
+  htsp_enqueue(htsp, hm, &htsp->htsp_hmq_ctrl);
+  return NULL;
 }
 
 /**
@@ -1607,293 +2275,626 @@ htsp_authenticate(htsp_connection_t *htsp, htsmsg_t *m)
 }
 
 /**
- * timeout is in ms, 0 means infinite timeout
+ * Dispatch a received message, consumes 'm'
  */
-static int
-htsp_read_message(htsp_connection_t *htsp, htsmsg_t **mp, int timeout)
+static void
+htsp_dispatch(htsp_connection_t *htsp, htsmsg_t *m)
 {
-  int v;
-  size_t len;
-  uint8_t data[4];
-  void *buf;
+  htsmsg_t *reply;
+  int i;
+  const char *method;
+
+  pthread_mutex_lock(&global_lock);
+  htsp_authenticate(htsp, m);
 
-  v = timeout ? tcp_read_timeout(htsp->htsp_fd, data, 4, timeout) : 
-    tcp_read(htsp->htsp_fd, data, 4);
+  if((method = htsmsg_get_str(m, "method")) != NULL) {
+    for(i = 0; i < NUM_METHODS; i++) {
+      if(!strcmp(method, htsp_methods[i].name)) {
 
-  if(v != 0)
-    return v;
+	if((htsp->htsp_granted_access & htsp_methods[i].privmask) != 
+	   htsp_methods[i].privmask) {
 
-  len = (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
-  if(len > 1024 * 1024)
-    return EMSGSIZE;
-  if((buf = malloc(len)) == NULL)
-    return ENOMEM;
+	  pthread_mutex_unlock(&global_lock);
 
-  v = timeout ? tcp_read_timeout(htsp->htsp_fd, buf, len, timeout) : 
-    tcp_read(htsp->htsp_fd, buf, len);
-  
-  if(v != 0) {
-    free(buf);
-    return v;
+	  /* Classic authentication failed delay, not on a pool worker
+	     as a few clients could then put all of them to sleep */
+	  tcp_worker_detach();
+	  usleep(250000);
+	    
+	  reply = htsmsg_create_map();
+	  htsmsg_add_u32(reply, "noaccess", 1);
+	  htsp_reply(htsp, m, reply);
+
+	  htsmsg_destroy(m);
+	  return;
+
+	} else {
+	  reply = htsp_methods[i].fn(htsp, m);
+	}
+	break;
+      }
+    }
+
+    if(i == NUM_METHODS) {
+      reply = htsp_error("Method not found");
+    }
+
+  } else {
+    reply = htsp_error("No 'method' argument");
   }
 
-  /* buf will be tied to the message.
-   * NB: If the message can not be deserialized buf will be free'd by the
-   * function.
-   */
-  *mp = htsmsg_binary_deserialize(buf, len, buf);
-  if(*mp == NULL)
-    return EBADMSG;
+  pthread_mutex_unlock(&global_lock);
 
-  return 0;
+  if(reply != NULL) /* Methods can do all the replying inline */
+    htsp_reply(htsp, m, reply);
+
+  if(htsp->htsp_deflate_req) {
+    htsp->htsp_deflate_req = 0;
+    pthread_mutex_lock(&htsp->htsp_out_mutex);
+    htsp->htsp_deflate = 1;
+    pthread_mutex_unlock(&htsp->htsp_out_mutex);
+  }
+
+  htsmsg_destroy(m);
 }
 
 /**
- *
+ * Input callback, buffers what has arrived and dispatches all
+ * complete messages
  */
 static int
-htsp_read_loop(htsp_connection_t *htsp)
+htsp_input(void *conn)
 {
-  htsmsg_t *m = NULL, *reply;
-  int r, i;
-  const char *method;
+  htsp_connection_t *htsp = conn;
+  htsmsg_t *m;
+  uint8_t *p;
+  size_t len, off = 0;
+  ssize_t r;
+  void *buf;
 
-  if(htsp_generate_challenge(htsp)) {
-    tvhlog(LOG_ERR, "htsp", "%s: Unable to generate challenge",
-	   htsp->htsp_logname);
-    return 1;
+  if(htsp->htsp_rbuf_size - htsp->htsp_rbuf_len < HTSP_READ_CHUNK) {
+    htsp->htsp_rbuf_size = htsp->htsp_rbuf_len + HTSP_READ_CHUNK;
+    htsp->htsp_rbuf = realloc(htsp->htsp_rbuf, htsp->htsp_rbuf_size);
   }
 
-  pthread_mutex_lock(&global_lock);
-  htsp->htsp_granted_access = 
-    access_get_by_addr((struct sockaddr *)htsp->htsp_peer);
-  pthread_mutex_unlock(&global_lock);
+  r = recv(htsp->htsp_fd, htsp->htsp_rbuf + htsp->htsp_rbuf_len,
+	   htsp->htsp_rbuf_size - htsp->htsp_rbuf_len, MSG_DONTWAIT);
+  if(r == 0)
+    return -1;
+  if(r < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+
+  htsp->htsp_rbuf_len += r;
+
+  while(htsp->htsp_rbuf_len - off >= 4) {
+    p = htsp->htsp_rbuf + off;
+    len = (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    if(len > 1024 * 1024) {
+      tvhlog(LOG_INFO, "htsp", "%s: Message too large (%zu bytes)",
+	     htsp->htsp_logname, len);
+      return -1;
+    }
+    if(htsp->htsp_rbuf_len - off - 4 < len)
+      break;
 
-  tvhlog(LOG_INFO, "htsp", "Got connection from %s", htsp->htsp_logname);
+    if((buf = malloc(len)) == NULL)
+      return -1;
+    memcpy(buf, p + 4, len);
+    off += 4 + len;
 
-  /* Session main loop */
+    /* buf will be tied to the message.
+     * NB: If the message can not be deserialized buf will be free'd by the
+     * function.
+     */
+    if((m = htsmsg_binary_deserialize(buf, len, buf)) == NULL)
+      return -1;
 
-  while(1) {
-readmsg:
-    if((r = htsp_read_message(htsp, &m, 0)) != 0)
-      return r;
+    htsp_dispatch(htsp, m);
+  }
 
-    pthread_mutex_lock(&global_lock);
-    htsp_authenticate(htsp, m);
+  htsp->htsp_rbuf_len -= off;
+  if(htsp->htsp_rbuf_len == 0 && htsp->htsp_rbuf_size > HTSP_READ_CHUNK) {
+    /* Don't keep a big buffer around after a large message */
+    free(htsp->htsp_rbuf);
+    htsp->htsp_rbuf = NULL;
+    htsp->htsp_rbuf_size = 0;
+  } else if(off) {
+    memmove(htsp->htsp_rbuf, htsp->htsp_rbuf + off, htsp->htsp_rbuf_len);
+  }
+  return 0;
+}
 
-    if((method = htsmsg_get_str(m, "method")) != NULL) {
-      for(i = 0; i < NUM_METHODS; i++) {
-	      if(!strcmp(method, htsp_methods[i].name)) {
+/**
+ * Write as much of the current batch as the socket takes. Returns 0 when
+ * the batch is out, 1 if the socket is full or -1 if it's broken
+ */
+static int
+htsp_writev(htsp_connection_t *htsp)
+{
+  struct msghdr mh;
+  struct iovec *iov;
+  ssize_t r;
+
+  memset(&mh, 0, sizeof(mh));
+
+  while(htsp->htsp_wiovcnt > 0) {
+    mh.msg_iov    = htsp->htsp_wcur;
+    mh.msg_iovlen = htsp->htsp_wiovcnt;
+    r = sendmsg(htsp->htsp_fd, &mh,
+		MSG_DONTWAIT | (htsp->htsp_wmore ? MSG_MORE : 0));
+    htsp->htsp_wsyscalls++;
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      tvhlog(LOG_INFO, "htsp", "%s: Write error -- %s",
+             htsp->htsp_logname, strerror(errno));
+      return -1;
+    }
+    if(r == 0) {
+      tvhlog(LOG_ERR, "htsp", "%s: write() returned 0",
+             htsp->htsp_logname);
+    }
+    iov = htsp->htsp_wcur;
+    while(htsp->htsp_wiovcnt > 0 && r >= iov->iov_len) {
+      r -= iov->iov_len;
+      iov++;
+      htsp->htsp_wiovcnt--;
+    }
+    if(htsp->htsp_wiovcnt > 0) {
+      iov->iov_base += r;
+      iov->iov_len  -= r;
+    }
+    htsp->htsp_wcur = iov;
+  }
+  return 0;
+}
 
-	        if((htsp->htsp_granted_access & htsp_methods[i].privmask) != 
-	           htsp_methods[i].privmask) {
+/**
+ * Send the file data of the batch's last message, same return values
+ * as htsp_writev()
+ */
+static int
+htsp_sendfile(htsp_connection_t *htsp)
+{
+  htsp_msg_t *hm = htsp->htsp_wfile;
+  ssize_t r;
+
+  while(hm->hm_file_len > 0) {
+    r = sendfile(htsp->htsp_fd, hm->hm_file_fd, &hm->hm_file_off,
+		 hm->hm_file_len);
+    htsp->htsp_wsyscalls++;
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      tvhlog(LOG_INFO, "htsp", "%s: Write error -- %s",
+             htsp->htsp_logname, strerror(errno));
+      return -1;
+    }
+    if(r == 0) {
+      /* File was truncated, the announced length can't be honoured */
+      tvhlog(LOG_ERR, "htsp", "%s: File shrunk while being sent",
+             htsp->htsp_logname);
+      return -1;
+    }
+    hm->hm_file_len -= r;
+    htsp->htsp_wbytes += r;
+  }
+  htsp->htsp_wfile = NULL;
+  return 0;
+}
 
-      	    pthread_mutex_unlock(&global_lock);
+/**
+ * Pick the next message to send, htsp_out_mutex is held
+ *
+ * Strict priority queues are served until they are empty, all other
+ * queues are served round robin, one message at a time
+ */
+static htsp_msg_t *
+htsp_dequeue(htsp_connection_t *htsp)
+{
+  htsp_msg_q_t *hmq;
+  htsp_msg_t *hm;
 
-	          /* Classic authentication failed delay */
-	          usleep(250000);
-	    
-	          reply = htsmsg_create_map();
-	          htsmsg_add_u32(reply, "noaccess", 1);
-	          htsp_reply(htsp, m, reply);
-
-	          htsmsg_destroy(m);
-	          goto readmsg;
-
-	        } else {
-	          reply = htsp_methods[i].fn(htsp, m);
-	        }
-	        break;
-	      }
-      }
+  if((hmq = TAILQ_FIRST(&htsp->htsp_active_output_queues)) == NULL)
+    return NULL;
 
-      if(i == NUM_METHODS) {
-	      reply = htsp_error("Method not found");
-      }
+  hm = TAILQ_FIRST(&hmq->hmq_q);
+  TAILQ_REMOVE(&hmq->hmq_q, hm, hm_link);
+  hmq->hmq_length--;
+  hmq->hmq_payload -= hm->hm_payloadsize;
 
+  TAILQ_REMOVE(&htsp->htsp_active_output_queues, hmq, hmq_link);
+  if(hmq->hmq_length) {
+    /* Still messages to be sent, put back in active queues */
+    if(hmq->hmq_strict_prio) {
+      TAILQ_INSERT_HEAD(&htsp->htsp_active_output_queues, hmq, hmq_link);
     } else {
-      reply = htsp_error("No 'method' argument");
+      TAILQ_INSERT_TAIL(&htsp->htsp_active_output_queues, hmq, hmq_link);
     }
+  }
+  return hm;
+}
+
+#if ENABLE_ZLIB
+/**
+ * Turn compression off for the rest of the connection, messages that
+ * are already queued for it go out uncompressed
+ */
+static void
+htsp_deflate_fail(htsp_connection_t *htsp, const char *what)
+{
+  int was;
 
-    pthread_mutex_unlock(&global_lock);
+  htsp->htsp_zfailed = 1;
+  pthread_mutex_lock(&htsp->htsp_out_mutex);
+  was = htsp->htsp_deflate;
+  htsp->htsp_deflate = 0;
+  pthread_mutex_unlock(&htsp->htsp_out_mutex);
+  if(was)
+    tvhlog(LOG_ERR, "htsp", "%s: Unable to %s, compression disabled",
+	   htsp->htsp_logname, what);
+}
+
+/**
+ * Set up the deflate stream on first use
+ */
+static int
+htsp_deflate_init(htsp_connection_t *htsp)
+{
+  z_stream *z;
 
-    if(reply != NULL) /* Methods can do all the replying inline */
-      htsp_reply(htsp, m, reply);
+  if(htsp->htsp_zfailed)
+    return -1;
+  if(htsp->htsp_zstream != NULL)
+    return 0;
 
-    htsmsg_destroy(m);
+  if((z = calloc(1, sizeof(z_stream))) != NULL) {
+    if(deflateInit(z, Z_DEFAULT_COMPRESSION) == Z_OK) {
+      htsp->htsp_zstream = z;
+      return 0;
+    }
+    free(z);
   }
+
+  htsp_deflate_fail(htsp, "set up deflate");
+  return -1;
 }
 
 /**
+ * Run the leading compressed messages of hmv through the deflate stream
+ * and return them as a single frame in *outp, their count in *np. The
+ * stream must have been set up with htsp_deflate_init().
  *
+ * Returns 0 if out of memory. The stream has then taken data the client
+ * will never see, so compression is turned off for good
  */
-static void *
-htsp_write_scheduler(void *aux)
+static size_t
+htsp_deflate_batch(htsp_connection_t *htsp, htsp_msg_t **hmv, int n,
+		   void **outp, int *np)
+{
+  z_stream *z = htsp->htsp_zstream;
+  uint8_t *out = NULL, *tmp;
+  size_t size = 0, len = 4;
+  uint32_t flen;
+  int i;
+
+  for(i = 1; i < n && hmv[i]->hm_deflate; i++)
+    ;
+  n = *np = i;
+
+  for(i = 0; i < n; i++) {
+    htsp->htsp_zbuf.hbb_len = 0;
+    htsmsg_binary_serialize_buf(hmv[i]->hm_msg, &htsp->htsp_zbuf, INT32_MAX);
+    htsp->htsp_stat_zin += htsp->htsp_zbuf.hbb_len;
+
+    z->next_in  = htsp->htsp_zbuf.hbb_data;
+    z->avail_in = htsp->htsp_zbuf.hbb_len;
+    do {
+      if(size < len + HTSP_DEFLATE_CHUNK / 4) {
+        size = len + HTSP_DEFLATE_CHUNK;
+        if((tmp = realloc(out, size)) == NULL) {
+          free(out);
+          htsp_deflate_fail(htsp, "allocate deflate buffer");
+          return 0;
+        }
+        out = tmp;
+      }
+      z->next_out  = out + len;
+      z->avail_out = size - len;
+      deflate(z, i == n - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+      len = size - z->avail_out;
+    } while(z->avail_in > 0 || z->avail_out == 0);
+
+  }
+
+  htsp->htsp_stat_zout += len;
+
+  flen = (len - 4) | HTSP_FRAME_DEFLATE;
+  out[0] = flen >> 24;
+  out[1] = flen >> 16;
+  out[2] = flen >> 8;
+  out[3] = flen;
+  *outp = out;
+  return len;
+}
+#endif
+
+/**
+ * Drain up to HTSP_WRITE_BATCH messages or HTSP_WRITE_BYTES of payload
+ * into the write batch, returns the number of messages picked
+ */
+static int
+htsp_write_batch_fill(htsp_connection_t *htsp)
 {
-  htsp_connection_t *htsp = aux;
-  int r;
-  htsp_msg_q_t *hmq;
   htsp_msg_t *hm;
-  void *dptr;
+  struct iovec *iov = htsp->htsp_wiov;
+  struct iovec *fixiov[HTSP_WRITE_BATCH];
+  size_t fixoff[HTSP_WRITE_BATCH];
+  size_t bytes = 0;
+  int i, n = 0, nfix = 0;
+#if ENABLE_ZLIB
   size_t dlen;
+  int j;
+#endif
 
   pthread_mutex_lock(&htsp->htsp_out_mutex);
+  while(n < HTSP_WRITE_BATCH && bytes < HTSP_WRITE_BYTES &&
+        (hm = htsp_dequeue(htsp)) != NULL) {
+    htsp->htsp_wbatch[n++] = hm;
+    bytes += hm->hm_payloadsize;
+    /* File data goes out after the batch, so it has to end it */
+    if(hm->hm_file_len > 0)
+      break;
+  }
+  htsp->htsp_wmore = TAILQ_FIRST(&htsp->htsp_active_output_queues) != NULL;
+  pthread_mutex_unlock(&htsp->htsp_out_mutex);
 
-  while(1) {
-
-    if((hmq = TAILQ_FIRST(&htsp->htsp_active_output_queues)) == NULL) {
-      /* No active queues at all */
-      if(!htsp->htsp_writer_run)
-	      break; /* Should not run anymore, bail out */
-      
-      /* Nothing to be done, go to sleep */
-      pthread_cond_wait(&htsp->htsp_out_cond, &htsp->htsp_out_mutex);
-      continue;
+  bytes = 0;
+  for(i = 0; i < n; i++) {
+    hm = htsp->htsp_wbatch[i];
+    htsp->htsp_wdptr[i] = NULL;
+    if(hm->hm_hdr != NULL) {
+      /* Prebuilt muxpkt, payload goes out straight from the pktbuf */
+      iov->iov_base = hm->hm_hdr;
+      iov->iov_len  = hm->hm_hdrlen;
+      iov++;
+      bytes += hm->hm_hdrlen;
+      if(hm->hm_pb != NULL) {
+        iov->iov_base = pktbuf_ptr(hm->hm_pb);
+        iov->iov_len  = pktbuf_len(hm->hm_pb);
+        iov++;
+        bytes += pktbuf_len(hm->hm_pb);
+      } else if(hm->hm_file_len > 0) {
+        htsp->htsp_wfile = hm;
+        htsp->htsp_wmore = 1;
+      }
+#if ENABLE_ZLIB
+    } else if(hm->hm_deflate && !htsp_deflate_init(htsp) &&
+              (dlen = htsp_deflate_batch(htsp, htsp->htsp_wbatch + i, n - i,
+                                         &htsp->htsp_wdptr[i], &j)) > 0) {
+      /* Consecutive compressed messages share a frame */
+      iov->iov_base = htsp->htsp_wdptr[i];
+      iov->iov_len  = dlen;
+      iov++;
+      bytes += dlen;
+      while(--j > 0)
+        htsp->htsp_wdptr[++i] = NULL;
+#endif
+    } else {
+      /* All messages of the batch go into one buffer, reused */
+      fixiov[nfix] = iov;
+      fixoff[nfix++] = htsp->htsp_wbuf.hbb_len;
+      htsmsg_binary_serialize_buf(hm->hm_msg, &htsp->htsp_wbuf, INT32_MAX);
+      iov->iov_len = htsp->htsp_wbuf.hbb_len - fixoff[nfix - 1];
+      iov++;
+      bytes += iov[-1].iov_len;
     }
+  }
 
-    hm = TAILQ_FIRST(&hmq->hmq_q);
-    TAILQ_REMOVE(&hmq->hmq_q, hm, hm_link);
-    hmq->hmq_length--;
-    hmq->hmq_payload -= hm->hm_payloadsize;
+  /* The buffer may have moved while it grew */
+  for(i = 0; i < nfix; i++)
+    fixiov[i]->iov_base = htsp->htsp_wbuf.hbb_data + fixoff[i];
 
-    TAILQ_REMOVE(&htsp->htsp_active_output_queues, hmq, hmq_link);
-    if(hmq->hmq_length) {
-      /* Still messages to be sent, put back in active queues */
-      if(hmq->hmq_strict_prio) {
-	      TAILQ_INSERT_HEAD(&htsp->htsp_active_output_queues, hmq, hmq_link);
-      } else {
-        TAILQ_INSERT_TAIL(&htsp->htsp_active_output_queues, hmq, hmq_link);
-      }
-    }
+  htsp->htsp_wn = n;
+  htsp->htsp_wcur = htsp->htsp_wiov;
+  htsp->htsp_wiovcnt = iov - htsp->htsp_wiov;
+  htsp->htsp_wbytes = bytes;
+  htsp->htsp_wsyscalls = 0;
+  return n;
+}
 
-    pthread_mutex_unlock(&htsp->htsp_out_mutex);
+/**
+ * Release the write batch
+ */
+static void
+htsp_write_batch_free(htsp_connection_t *htsp)
+{
+  int i;
 
-    r = htsmsg_binary_serialize(hm->hm_msg, &dptr, &dlen, INT32_MAX);
+  for(i = 0; i < htsp->htsp_wn; i++) {
+    free(htsp->htsp_wdptr[i]);
+    htsp_msg_destroy(htsp->htsp_wbatch[i]);
+  }
+  htsp->htsp_wn = 0;
+  htsp->htsp_wiovcnt = 0;
+  htsp->htsp_wfile = NULL;
+  htsp->htsp_wbuf.hbb_len = 0;
 
-    htsp_msg_destroy(hm);
+  /* Don't hold on to what a burst of big messages left behind */
+  if(htsp->htsp_wbuf.hbb_size > HTSP_WRITE_BYTES * 4)
+    htsmsg_binary_buf_free(&htsp->htsp_wbuf);
+}
 
-    void *freeme = dptr;
+/**
+ * Output callback, writes batches until the queues are empty or the
+ * socket is full. A partially written batch is kept for the next call
+ */
+static int
+htsp_output(void *conn)
+{
+  htsp_connection_t *htsp = conn;
+  int r, rounds = 0;
 
-    while(dlen > 0) {
-      r = write(htsp->htsp_fd, dptr, dlen);
-      if(r < 0) {
-        if(errno == EAGAIN || errno == EWOULDBLOCK)
-          continue;
-        tvhlog(LOG_INFO, "htsp", "%s: Write error -- %s",
-               htsp->htsp_logname, strerror(errno));
-        break;
-      }
-      if(r == 0) {
-        tvhlog(LOG_ERR, "htsp", "%s: write() returned 0",
-               htsp->htsp_logname);
+  while(1) {
+    if(htsp->htsp_wn == 0) {
+      /* Let other connections have a go, we'll be called again */
+      if(rounds++ == HTSP_WRITE_ROUNDS)
+        return 1;
+
+      if(htsp_write_batch_fill(htsp) == 0) {
+        pthread_mutex_lock(&htsp->htsp_out_mutex);
+        r = htsp->htsp_sync_active;
+        pthread_mutex_unlock(&htsp->htsp_out_mutex);
+        if(!r)
+          return 0;
+        htsp_sync_step(htsp);
+        continue;
       }
-      dptr += r;
-      dlen -= r;
     }
 
-    free(freeme);
+    if((r = htsp_writev(htsp)) != 0)
+      return r;
+
+    if(htsp->htsp_wfile != NULL && (r = htsp_sendfile(htsp)) != 0)
+      return r;
+
     pthread_mutex_lock(&htsp->htsp_out_mutex);
-    if(dlen)
-      break;
-  }
-  // Shutdown socket to make receive thread terminate entire HTSP connection
+    htsp->htsp_stat_syscalls += htsp->htsp_wsyscalls;
+    htsp->htsp_stat_bytes    += htsp->htsp_wbytes;
+    pthread_mutex_unlock(&htsp->htsp_out_mutex);
 
-  shutdown(htsp->htsp_fd, SHUT_RDWR);
-  pthread_mutex_unlock(&htsp->htsp_out_mutex);
-  return NULL;
+    htsp_write_batch_free(htsp);
+  }
 }
 
 /**
  *
  */
-static void
-htsp_serve(int fd, void *opaque, struct sockaddr_in *source,
-	   struct sockaddr_in *self)
+static void *
+htsp_start(tcp_connection_t *tc, int fd, void *opaque,
+	   struct sockaddr_in *source, struct sockaddr_in *self)
 {
-  htsp_connection_t htsp;
+  htsp_connection_t *htsp;
   char buf[30];
-  htsp_subscription_t *s;
 
   snprintf(buf, sizeof(buf), "%s", inet_ntoa(source->sin_addr));
 
-  memset(&htsp, 0, sizeof(htsp_connection_t));
+  htsp = calloc(1, sizeof(htsp_connection_t));
 
-  TAILQ_INIT(&htsp.htsp_active_output_queues);
+  TAILQ_INIT(&htsp->htsp_active_output_queues);
+  pthread_mutex_init(&htsp->htsp_out_mutex, NULL);
 
-  htsp_init_queue(&htsp.htsp_hmq_ctrl, 0);
-  htsp_init_queue(&htsp.htsp_hmq_qstatus, 1);
-  htsp_init_queue(&htsp.htsp_hmq_epg, 0);
+  htsp_init_queue(&htsp->htsp_hmq_ctrl, 0);
+  htsp_init_queue(&htsp->htsp_hmq_qstatus, 1);
+  htsp_init_queue(&htsp->htsp_hmq_epg, 0);
 
-  htsp.htsp_peername = strdup(buf);
-  htsp_update_logname(&htsp);
+  htsp->htsp_peername = strdup(buf);
+  htsp_update_logname(htsp);
 
-  htsp.htsp_fd = fd;
-  htsp.htsp_peer = source;
-  htsp.htsp_writer_run = 1;
+  /* sendfile() has no MSG_DONTWAIT */
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-  pthread_mutex_lock(&global_lock);
-  LIST_INSERT_HEAD(&htsp_connections, &htsp, htsp_link);
-  pthread_mutex_unlock(&global_lock);
+  htsp->htsp_fd = fd;
+  htsp->htsp_peer = source;
+  htsp->htsp_tc = tc;
 
-  pthread_create(&htsp.htsp_writer_thread, NULL, htsp_write_scheduler, &htsp);
+  if(htsp_generate_challenge(htsp)) {
+    tvhlog(LOG_ERR, "htsp", "%s: Unable to generate challenge",
+	   htsp->htsp_logname);
+    free(htsp->htsp_logname);
+    free(htsp->htsp_peername);
+    free(htsp);
+    return NULL;
+  }
 
-  /**
-   * Reader loop
-   */
+  pthread_mutex_lock(&global_lock);
+  htsp->htsp_granted_access = 
+    access_get_by_addr((struct sockaddr *)htsp->htsp_peer);
+  LIST_INSERT_HEAD(&htsp_connections, htsp, htsp_link);
+  pthread_mutex_unlock(&global_lock);
 
-  htsp_read_loop(&htsp);
+  tvhlog(LOG_INFO, "htsp", "Got connection from %s", htsp->htsp_logname);
+  return htsp;
+}
 
-  tvhlog(LOG_INFO, "htsp", "%s: Disconnected", htsp.htsp_logname);
+/**
+ * Other end disconnected or the connection broke. Clean up stuff.
+ */
+static void
+htsp_stop(void *conn)
+{
+  htsp_connection_t *htsp = conn;
+  htsp_subscription_t *s;
+  htsp_msg_q_t *hmq;
+  htsp_msg_t *hm;
+  htsp_file_t *hf;
 
-  /**
-   * Ok, we're back, other end disconnected. Clean up stuff.
-   */
+  tvhlog(LOG_INFO, "htsp", "%s: Disconnected", htsp->htsp_logname);
 
   pthread_mutex_lock(&global_lock);
 
   /* Beware! Closing subscriptions will invoke a lot of callbacks
      down in the streaming code. So we do this as early as possible
      to avoid any weird lockups */
-  while((s = LIST_FIRST(&htsp.htsp_subscriptions)) != NULL) {
-    htsp_subscription_destroy(&htsp, s);
+  while((s = LIST_FIRST(&htsp->htsp_subscriptions)) != NULL) {
+    htsp_subscription_destroy(htsp, s);
   }
 
-  if(htsp.htsp_async_mode)
-    LIST_REMOVE(&htsp, htsp_async_link);
+  if(htsp->htsp_async_mode)
+    LIST_REMOVE(htsp, htsp_async_link);
 
-  LIST_REMOVE(&htsp, htsp_link);
+  LIST_REMOVE(htsp, htsp_link);
 
   pthread_mutex_unlock(&global_lock);
 
-  pthread_mutex_lock(&htsp.htsp_out_mutex);
-  htsp.htsp_writer_run = 0;
-  pthread_cond_signal(&htsp.htsp_out_cond);
-  pthread_mutex_unlock(&htsp.htsp_out_mutex);
-
-  pthread_join(htsp.htsp_writer_thread, NULL);
+  htsp_write_batch_free(htsp);
 
-  free(htsp.htsp_logname);
-  free(htsp.htsp_peername);
-  free(htsp.htsp_username);
-  free(htsp.htsp_clientname);
+#if ENABLE_ZLIB
+  if(htsp->htsp_zstream != NULL) {
+    if(htsp->htsp_stat_zin)
+      tvhlog(LOG_DEBUG, "htsp", "%s: Compressed %"PRIu64" bytes to %"PRIu64,
+             htsp->htsp_logname, htsp->htsp_stat_zin, htsp->htsp_stat_zout);
+    deflateEnd(htsp->htsp_zstream);
+    free(htsp->htsp_zstream);
+  }
+  htsmsg_binary_buf_free(&htsp->htsp_zbuf);
+#endif
+  htsmsg_binary_buf_free(&htsp->htsp_wbuf);
 
-  htsp_msg_q_t *hmq;
+  free(htsp->htsp_logname);
+  free(htsp->htsp_peername);
+  free(htsp->htsp_username);
+  free(htsp->htsp_clientname);
 
-  TAILQ_FOREACH(hmq, &htsp.htsp_active_output_queues, hmq_link) {
-    htsp_msg_t *hm;
+  TAILQ_FOREACH(hmq, &htsp->htsp_active_output_queues, hmq_link) {
     while((hm = TAILQ_FIRST(&hmq->hmq_q)) != NULL) {
       TAILQ_REMOVE(&hmq->hmq_q, hm, hm_link);
       htsp_msg_destroy(hm);
     }
   }
 
-  htsp_file_t *hf;
-  while((hf = LIST_FIRST(&htsp.htsp_files)) != NULL)
+  while((hf = LIST_FIRST(&htsp->htsp_files)) != NULL)
     htsp_file_destroy(hf);
 
-  close(fd);
+  free(htsp->htsp_language);
+  free(htsp->htsp_sync_ids);
+  free(htsp->htsp_sync_index);
+  free(htsp->htsp_rbuf);
+  pthread_mutex_destroy(&htsp->htsp_out_mutex);
+  free(htsp);
 }
 
+static tcp_server_ops_t htsp_ops = {
+  .start  = htsp_start,
+  .input  = htsp_input,
+  .output = htsp_output,
+  .stop   = htsp_stop,
+};
+
 /**
  *  Fire up HTSP server
  */
@@ -1901,9 +2902,9 @@ void
 htsp_init(void)
 {
   extern int htsp_port_extra;
-  htsp_server = tcp_server_create(htsp_port, htsp_serve, NULL);
+  htsp_server = tcp_server_create(htsp_port, &htsp_ops, NULL);
   if(htsp_port_extra)
-    htsp_server_2 = tcp_server_create(htsp_port_extra, htsp_serve, NULL);
+    htsp_server_2 = tcp_server_create(htsp_port_extra, &htsp_ops, NULL);
 }
 
 /* **************************************************************************
@@ -1911,15 +2912,16 @@ htsp_init(void)
  * *************************************************************************/
 
 /**
- *
+ * Send to all async connections, 'phase' and 'id' identify the object
+ * for connections that are still doing their initial sync
  */
 static void
-htsp_async_send(htsmsg_t *m, int mode)
+htsp_async_send(htsmsg_t *m, int mode, htsp_sync_phase_t phase, uint32_t id)
 {
   htsp_connection_t *htsp;
 
   LIST_FOREACH(htsp, &htsp_async_connections, htsp_async_link)
-    if (htsp->htsp_async_mode & mode)
+    if ((htsp->htsp_async_mode & mode) && htsp_sync_passed(htsp, phase, id))
       htsp_send_message(htsp, htsmsg_copy(m), NULL);
   htsmsg_destroy(m);
 }
@@ -1945,7 +2947,7 @@ htsp_channel_update_current(channel_t *ch)
   next = ch->ch_epg_next;
   htsmsg_add_u32(m, "eventId",     now  ? now->id : 0);
   htsmsg_add_u32(m, "nextEventId", next ? next->id : 0);
-  htsp_async_send(m, HTSP_ASYNC_ON);
+  htsp_async_send(m, HTSP_ASYNC_ON, HTSP_SYNC_CHANNELS, ch->ch_id);
 }
 
 /**
@@ -1954,7 +2956,8 @@ htsp_channel_update_current(channel_t *ch)
 void
 htsp_channel_add(channel_t *ch)
 {
-  htsp_async_send(htsp_build_channel(ch, "channelAdd"), HTSP_ASYNC_ON);
+  htsp_async_send(htsp_build_channel(ch, "channelAdd"), HTSP_ASYNC_ON,
+		  HTSP_SYNC_CHANNELS, ch->ch_id);
 }
 
 
@@ -1964,7 +2967,8 @@ htsp_channel_add(channel_t *ch)
 void
 htsp_channel_update(channel_t *ch)
 {
-  htsp_async_send(htsp_build_channel(ch, "channelUpdate"), HTSP_ASYNC_ON);
+  htsp_async_send(htsp_build_channel(ch, "channelUpdate"), HTSP_ASYNC_ON,
+		  HTSP_SYNC_CHANNELS, ch->ch_id);
 }
 
 
@@ -1977,7 +2981,7 @@ htsp_channel_delete(channel_t *ch)
   htsmsg_t *m = htsmsg_create_map();
   htsmsg_add_u32(m, "channelId", ch->ch_id);
   htsmsg_add_str(m, "method", "channelDelete");
-  htsp_async_send(m, HTSP_ASYNC_ON);
+  htsp_async_send(m, HTSP_ASYNC_ON, HTSP_SYNC_CHANNELS, ch->ch_id);
 }
 
 
@@ -1987,7 +2991,8 @@ htsp_channel_delete(channel_t *ch)
 void
 htsp_tag_add(channel_tag_t *ct)
 {
-  htsp_async_send(htsp_build_tag(ct, "tagAdd", 1), HTSP_ASYNC_ON);
+  htsp_async_send(htsp_build_tag(ct, "tagAdd", 1), HTSP_ASYNC_ON,
+		  HTSP_SYNC_TAGS, ct->ct_identifier);
 }
 
 
@@ -1997,7 +3002,8 @@ htsp_tag_add(channel_tag_t *ct)
 void
 htsp_tag_update(channel_tag_t *ct)
 {
-  htsp_async_send(htsp_build_tag(ct, "tagUpdate", 1), HTSP_ASYNC_ON);
+  htsp_async_send(htsp_build_tag(ct, "tagUpdate", 1), HTSP_ASYNC_ON,
+		  HTSP_SYNC_TAGS, ct->ct_identifier);
 }
 
 
@@ -2010,7 +3016,7 @@ htsp_tag_delete(channel_tag_t *ct)
   htsmsg_t *m = htsmsg_create_map();
   htsmsg_add_u32(m, "tagId", ct->ct_identifier);
   htsmsg_add_str(m, "method", "tagDelete");
-  htsp_async_send(m, HTSP_ASYNC_ON);
+  htsp_async_send(m, HTSP_ASYNC_ON, HTSP_SYNC_TAGS, ct->ct_identifier);
 }
 
 
@@ -2020,7 +3026,8 @@ htsp_tag_delete(channel_tag_t *ct)
 void
 htsp_dvr_entry_add(dvr_entry_t *de)
 {
-  htsp_async_send(htsp_build_dvrentry(de, "dvrEntryAdd"), HTSP_ASYNC_ON);
+  htsp_async_send(htsp_build_dvrentry(de, "dvrEntryAdd"), HTSP_ASYNC_ON,
+		  HTSP_SYNC_DVR, de->de_id);
 }
 
 
@@ -2030,7 +3037,8 @@ htsp_dvr_entry_add(dvr_entry_t *de)
 void
 htsp_dvr_entry_update(dvr_entry_t *de)
 {
-  htsp_async_send(htsp_build_dvrentry(de, "dvrEntryUpdate"), HTSP_ASYNC_ON);
+  htsp_async_send(htsp_build_dvrentry(de, "dvrEntryUpdate"), HTSP_ASYNC_ON,
+		  HTSP_SYNC_DVR, de->de_id);
 }
 
 
@@ -2043,7 +3051,7 @@ htsp_dvr_entry_delete(dvr_entry_t *de)
   htsmsg_t *m = htsmsg_create_map();
   htsmsg_add_u32(m, "id", de->de_id);
   htsmsg_add_str(m, "method", "dvrEntryDelete");
-  htsp_async_send(m, HTSP_ASYNC_ON);
+  htsp_async_send(m, HTSP_ASYNC_ON, HTSP_SYNC_DVR, de->de_id);
 }
 
 /**
@@ -2056,6 +3064,7 @@ htsp_event_add(epg_broadcast_t *ebc)
   htsmsg_t *m;
   LIST_FOREACH(htsp, &htsp_async_connections, htsp_async_link) {
     if (!(htsp->htsp_async_mode & HTSP_ASYNC_EPG)) continue;
+    if (!htsp_sync_passed_event(htsp, ebc, 0)) continue;
     m = htsp_build_event(ebc, "eventAdd", htsp->htsp_language, 0, htsp);
     htsp_send_message(htsp, m, NULL);
   }
@@ -2071,6 +3080,7 @@ htsp_event_update(epg_broadcast_t *ebc)
   htsmsg_t *m;
   LIST_FOREACH(htsp, &htsp_async_connections, htsp_async_link) {
     if (!(htsp->htsp_async_mode & HTSP_ASYNC_EPG)) continue;
+    if (!htsp_sync_passed_event(htsp, ebc, 0)) continue;
     m = htsp_build_event(ebc, "eventUpdate", htsp->htsp_language, 0, htsp);
     htsp_send_message(htsp, m, NULL);
   }
@@ -2082,10 +3092,16 @@ htsp_event_update(epg_broadcast_t *ebc)
 void
 htsp_event_delete(epg_broadcast_t *ebc)
 {
+  htsp_connection_t *htsp;
   htsmsg_t *m = htsmsg_create_map();
   htsmsg_add_str(m, "method", "eventDelete");
   htsmsg_add_u32(m, "eventId", ebc->id);
-  htsp_async_send(m, HTSP_ASYNC_EPG);
+  LIST_FOREACH(htsp, &htsp_async_connections, htsp_async_link) {
+    if (!(htsp->htsp_async_mode & HTSP_ASYNC_EPG)) continue;
+    if (!htsp_sync_passed_event(htsp, ebc, 1)) continue;
+    htsp_send_message(htsp, htsmsg_copy(m), NULL);
+  }
+  htsmsg_destroy(m);
 }
 
 const static char frametypearray[PKT_NTYPES] = {
@@ -2100,8 +3116,9 @@ const static char frametypearray[PKT_NTYPES] = {
 static void
 htsp_stream_deliver(htsp_subscription_t *hs, th_pkt_t *pkt)
 {
-  htsmsg_t *m, *n;
+  htsmsg_t *m;
   htsp_msg_t *hm;
+  uint8_t *p;
   htsp_connection_t *htsp = hs->hs_htsp;
   int64_t ts;
   int qlen = hs->hs_q.hmq_payload;
@@ -2117,38 +3134,50 @@ htsp_stream_deliver(htsp_subscription_t *hs, th_pkt_t *pkt)
     return;
   }
 
-  m = htsmsg_create_map();
- 
-  htsmsg_add_str(m, "method", "muxpkt");
-  htsmsg_add_u32(m, "subscriptionId", hs->hs_sid);
-  htsmsg_add_u32(m, "frametype", frametypearray[pkt->pkt_frametype]);
-
-  htsmsg_add_u32(m, "stream", pkt->pkt_componentindex);
-  htsmsg_add_u32(m, "com", pkt->pkt_commercial);
+  pkt = pkt_merge_header(pkt);
 
+  /**
+   * The header fields are serialized right away into the queued message,
+   * the payload is written out with writev() directly from the pktbuf,
+   * which stays referenced until then
+   */
+  hm = malloc(sizeof(htsp_msg_t) + HTSP_MUXPKT_HDR_MAX);
+  hm->hm_msg = NULL;
+  hm->hm_pb = pkt->pkt_payload;
+  pktbuf_ref_inc(hm->hm_pb);
+  hm->hm_payloadsize = pktbuf_len(pkt->pkt_payload);
+  hm->hm_hdr = (uint8_t *)(hm + 1);
+  hm->hm_dts = PTS_UNSET;
+  hm->hm_file_fd = -1;
+  hm->hm_file_len = 0;
+
+  p = hm->hm_hdr + 4;
+  p = htsp_field_str(p, "method", "muxpkt");
+  p = htsp_field_s64(p, "subscriptionId", hs->hs_sid);
+  p = htsp_field_s64(p, "frametype", frametypearray[pkt->pkt_frametype]);
+  p = htsp_field_s64(p, "stream", pkt->pkt_componentindex);
+  p = htsp_field_s64(p, "com", pkt->pkt_commercial);
 
   if(pkt->pkt_pts != PTS_UNSET) {
     int64_t pts = hs->hs_90khz ? pkt->pkt_pts : ts_rescale(pkt->pkt_pts, 1000000);
-    htsmsg_add_s64(m, "pts", pts);
+    p = htsp_field_s64(p, "pts", pts);
   }
 
   if(pkt->pkt_dts != PTS_UNSET) {
     int64_t dts = hs->hs_90khz ? pkt->pkt_dts : ts_rescale(pkt->pkt_dts, 1000000);
-    htsmsg_add_s64(m, "dts", dts);
+    p = htsp_field_s64(p, "dts", dts);
+    hm->hm_dts = dts;
   }
 
   uint32_t dur = hs->hs_90khz ? pkt->pkt_duration : ts_rescale(pkt->pkt_duration, 1000000);
-  htsmsg_add_u32(m, "duration", dur);
-  
-  pkt = pkt_merge_header(pkt);
+  p = htsp_field_s64(p, "duration", dur);
 
-  /**
-   * Since we will serialize directly we use 'binptr' which is a binary
-   * object that just points to data, thus avoiding a copy.
-   */
-  htsmsg_add_binptr(m, "payload", pktbuf_ptr(pkt->pkt_payload),
-		    pktbuf_len(pkt->pkt_payload));
-  htsp_send(htsp, m, pkt->pkt_payload, &hs->hs_q, pktbuf_len(pkt->pkt_payload));
+  p = htsp_field_bin_hdr(p, "payload", hm->hm_payloadsize);
+
+  hm->hm_hdrlen = p - hm->hm_hdr;
+  htsp_put_u32(hm->hm_hdr, hm->hm_hdrlen - 4 + hm->hm_payloadsize);
+
+  htsp_enqueue(htsp, hm, &hs->hs_q);
 
   if(hs->hs_last_report != dispatch_clock) {
 
@@ -2171,10 +3200,16 @@ htsp_stream_deliver(htsp_subscription_t *hs, th_pkt_t *pkt)
     if(TAILQ_FIRST(&hs->hs_q.hmq_q) == NULL) {
       htsmsg_add_s64(m, "delay", 0);
     } else if((hm = TAILQ_FIRST(&hs->hs_q.hmq_q)) != NULL &&
-	      (n = hm->hm_msg) != NULL && !htsmsg_get_s64(n, "dts", &ts) &&
-	      pkt->pkt_dts != PTS_UNSET && ts != PTS_UNSET) {
+	      (ts = hm->hm_dts) != PTS_UNSET &&
+	      pkt->pkt_dts != PTS_UNSET) {
       htsmsg_add_s64(m, "delay", pkt->pkt_dts - ts);
     }
+
+    /* Writer stats are per connection */
+    htsmsg_add_s64(m, "writeCalls", htsp->htsp_stat_syscalls);
+    if(htsp->htsp_stat_syscalls)
+      htsmsg_add_u32(m, "bytesPerWrite",
+                     htsp->htsp_stat_bytes / htsp->htsp_stat_syscalls);
     pthread_mutex_unlock(&htsp->htsp_out_mutex);
 
     htsmsg_add_u32(m, "Bdrops", hs->hs_dropstats[PKT_B_FRAME]);
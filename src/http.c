@@ -25,6 +25,7 @@
 #include <stdarg.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -218,6 +219,11 @@ http_send_header(http_connection_t *hc, int rc, const char *content,
   
   htsbuf_qprintf(&hdrs, "\r\n");
 
+  /* A body that doesn't fit in the socket buffer may block for as long
+     as the client takes to read it, don't tie up a connection worker */
+  if(!hc->hc_no_output && contentlen > hc->hc_sndbuf)
+    tcp_worker_detach();
+
   tcp_write_queue(hc->hc_fd, &hdrs);
 }
 
@@ -410,6 +416,10 @@ http_cmd_post(http_connection_t *hc, htsbuf_queue_t *spill)
   hc->hc_post_data = malloc(hc->hc_post_len + 1);
   hc->hc_post_data[hc->hc_post_len] = 0;
 
+  /* The rest of the body is read blocking, at the client's pace */
+  if(spill->hq_size < hc->hc_post_len)
+    tcp_worker_detach();
+
   if(tcp_read_data(hc->hc_fd, hc->hc_post_data, hc->hc_post_len, spill) < 0)
     return -1;
 
@@ -710,113 +720,181 @@ http_parse_get_args(http_connection_t *hc, char *args)
 
 
 /**
+ * Max size of a request header
+ */
+#define HTTP_HEADER_MAX (64 * 1024)
+
+/**
+ * Check if 'spill' holds a complete request header, ie. everything up
+ * to and including the first empty line
+ */
+static int
+http_header_complete(htsbuf_queue_t *spill)
+{
+  htsbuf_data_t *hd;
+  unsigned int i;
+  int bol = 1; /* At beginning of line */
+  uint8_t c;
+
+  TAILQ_FOREACH(hd, &spill->hq_q, hd_link) {
+    for(i = hd->hd_data_off; i < hd->hd_data_len; i++) {
+      c = hd->hd_data[i];
+      if(c == '\n') {
+	if(bol)
+	  return 1;
+	bol = 1;
+      } else if(c != '\r') {
+	bol = 0;
+      }
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Serve one request, the complete header must be in the spill
  *
+ * Returns -1 if the connection should be closed
  */
-static void
-http_serve_requests(http_connection_t *hc, htsbuf_queue_t *spill)
+static int
+http_serve_request(http_connection_t *hc, htsbuf_queue_t *spill)
 {
   char cmdline[1024];
   char hdrline[1024];
   char *argv[3], *c;
-  int n;
+  int n, r;
 
-  htsbuf_queue_init(&hc->hc_reply, 0);
-
-  do {
-    hc->hc_no_output  = 0;
+  hc->hc_no_output  = 0;
 
-    if(tcp_read_line(hc->hc_fd, cmdline, sizeof(cmdline), spill) < 0)
-      return;
+  if(tcp_read_line(hc->hc_fd, cmdline, sizeof(cmdline), spill) < 0)
+    return -1;
 
-    if((n = http_tokenize(cmdline, argv, 3, -1)) != 3)
-      return;
+  if((n = http_tokenize(cmdline, argv, 3, -1)) != 3)
+    return -1;
     
-    if((hc->hc_cmd = str2val(argv[0], HTTP_cmdtab)) == -1)
-      return;
-    hc->hc_url = argv[1];
-    if((hc->hc_version = str2val(argv[2], HTTP_versiontab)) == -1)
-      return;
-
-    /* parse header */
-    while(1) {
-      if(tcp_read_line(hc->hc_fd, hdrline, sizeof(hdrline), spill) < 0)
-	return;
+  if((hc->hc_cmd = str2val(argv[0], HTTP_cmdtab)) == -1)
+    return -1;
+  hc->hc_url = argv[1];
+  if((hc->hc_version = str2val(argv[2], HTTP_versiontab)) == -1)
+    return -1;
 
-      if(hdrline[0] == 0)
-	break; /* header complete */
+  /* parse header */
+  while(1) {
+    if(tcp_read_line(hc->hc_fd, hdrline, sizeof(hdrline), spill) < 0)
+      return -1;
 
-      if((n = http_tokenize(hdrline, argv, 2, -1)) < 2)
-	continue;
+    if(hdrline[0] == 0)
+      break; /* header complete */
 
-      if((c = strrchr(argv[0], ':')) == NULL)
-	return;
+    if((n = http_tokenize(hdrline, argv, 2, -1)) < 2)
+      continue;
 
-      *c = 0;
-      http_arg_set(&hc->hc_args, argv[0], argv[1]);
-    }
+    if((c = strrchr(argv[0], ':')) == NULL)
+      return -1;
 
-    if(process_request(hc, spill))
-      break;
+    *c = 0;
+    http_arg_set(&hc->hc_args, argv[0], argv[1]);
+  }
+
+  r = process_request(hc, spill);
 
-    free(hc->hc_post_data);
-    hc->hc_post_data = NULL;
+  free(hc->hc_post_data);
+  hc->hc_post_data = NULL;
 
-    http_arg_flush(&hc->hc_args);
-    http_arg_flush(&hc->hc_req_args);
+  http_arg_flush(&hc->hc_args);
+  http_arg_flush(&hc->hc_req_args);
 
-    htsbuf_queue_flush(&hc->hc_reply);
+  htsbuf_queue_flush(&hc->hc_reply);
 
-    free(hc->hc_username);
-    hc->hc_username = NULL;
+  free(hc->hc_username);
+  hc->hc_username = NULL;
 
-    free(hc->hc_password);
-    hc->hc_password = NULL;
+  free(hc->hc_password);
+  hc->hc_password = NULL;
 
-  } while(hc->hc_keep_alive);
-  
+  return r || !hc->hc_keep_alive ? -1 : 0;
 }
 
 
 /**
  *
  */
-static void
-http_serve(int fd, void *opaque, struct sockaddr_in *peer, 
-	   struct sockaddr_in *self)
+static void *
+http_start(tcp_connection_t *tc, int fd, void *opaque,
+	   struct sockaddr_in *peer, struct sockaddr_in *self)
 {
-  htsbuf_queue_t spill;
-  http_connection_t hc;
-  
-  memset(&hc, 0, sizeof(http_connection_t));
+  http_connection_t *hc = calloc(1, sizeof(http_connection_t));
+  socklen_t len = sizeof(hc->hc_sndbuf);
+
+  TAILQ_INIT(&hc->hc_args);
+  TAILQ_INIT(&hc->hc_req_args);
+
+  hc->hc_fd = fd;
+  hc->hc_peer = peer;
+  hc->hc_self = self;
+
+  if(getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &hc->hc_sndbuf, &len))
+    hc->hc_sndbuf = 0;
+
+  htsbuf_queue_init(&hc->hc_reply, 0);
+  htsbuf_queue_init(&hc->hc_spill, 0);
+  return hc;
+}
+
+
+/**
+ * Buffer whatever has arrived and serve all requests that are complete
+ */
+static int
+http_input(void *conn)
+{
+  http_connection_t *hc = conn;
 
-  TAILQ_INIT(&hc.hc_args);
-  TAILQ_INIT(&hc.hc_req_args);
+  if(tcp_fill_spill(hc->hc_fd, &hc->hc_spill) < 0)
+    return -1;
 
-  hc.hc_fd = fd;
-  hc.hc_peer = peer;
-  hc.hc_self = self;
+  while(http_header_complete(&hc->hc_spill))
+    if(http_serve_request(hc, &hc->hc_spill) < 0)
+      return -1;
 
-  htsbuf_queue_init(&spill, 0);
+  return hc->hc_spill.hq_size > HTTP_HEADER_MAX ? -1 : 0;
+}
 
-  http_serve_requests(&hc, &spill);
 
-  free(hc.hc_post_data);
-  free(hc.hc_username);
-  free(hc.hc_password);
+/**
+ *
+ */
+static void
+http_stop(void *conn)
+{
+  http_connection_t *hc = conn;
 
-  http_arg_flush(&hc.hc_args);
-  http_arg_flush(&hc.hc_req_args);
+  free(hc->hc_post_data);
+  free(hc->hc_username);
+  free(hc->hc_password);
 
-  htsbuf_queue_flush(&spill);
-  close(fd);
+  http_arg_flush(&hc->hc_args);
+  http_arg_flush(&hc->hc_req_args);
+
+  htsbuf_queue_flush(&hc->hc_reply);
+  htsbuf_queue_flush(&hc->hc_spill);
+  free(hc);
 }
 
 
+static tcp_server_ops_t http_ops = {
+  .start  = http_start,
+  .input  = http_input,
+  .stop   = http_stop,
+};
+
+
 /**
  *  Fire up HTTP server
  */
 void
 http_server_init(void)
 {
-  http_server = tcp_server_create(webui_port, http_serve, NULL);
+  http_server = tcp_server_create(webui_port, &http_ops, NULL);
 }
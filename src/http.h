@@ -49,6 +49,8 @@ typedef struct http_connection {
 
   htsbuf_queue_t hc_reply;
 
+  htsbuf_queue_t hc_spill;  /* Received but not yet parsed */
+
   struct http_arg_list hc_args;
 
   struct http_arg_list hc_req_args; /* Argumets from GET or POST request */
@@ -85,6 +87,8 @@ typedef struct http_connection {
 
   int hc_no_output;
 
+  int hc_sndbuf;  /* Socket send buffer size, see http_send_header() */
+
   /* Support for HTTP POST */
   
   char *hc_post_data;
@@ -93,28 +93,43 @@ iptv_got_pmt(const uint8_t *ptr, size_t len, void *aux)
 
 
 /**
- * Handle a single TS packet for the given IPTV service
+ * Handle a buffer of 'len' bytes of TS packets for the given IPTV service
+ *
+ * Runs of stream packets are passed to the demuxer in one batch,
+ * PAT and PMT packets are handled here as they are encountered
  */
 static void
-iptv_ts_input(service_t *t, const uint8_t *tsb)
+iptv_ts_input(service_t *t, const uint8_t *tsb, int len)
 {
-  uint16_t pid = ((tsb[1] & 0x1f) << 8) | tsb[2];
+  const uint8_t *run = tsb;
+  uint16_t pid;
 
-  if(pid == 0) {
+  for(; len > 0; tsb += 188, len -= 188) {
+    pid = ((tsb[1] & 0x1f) << 8) | tsb[2];
 
-    if(t->s_pat_section == NULL)
-      t->s_pat_section = calloc(1, sizeof(psi_section_t));
-    psi_section_reassemble(t->s_pat_section, tsb, 1, iptv_got_pat, t);
+    if(pid != 0 && pid != t->s_pmt_pid)
+      continue;
 
-  } else if(pid == t->s_pmt_pid) {
+    if(tsb > run)
+      ts_recv_packets(t, run, (tsb - run) / 188);
+    run = tsb + 188;
 
-    if(t->s_pmt_section == NULL)
-      t->s_pmt_section = calloc(1, sizeof(psi_section_t));
-    psi_section_reassemble(t->s_pmt_section, tsb, 1, iptv_got_pmt, t);
+    if(pid == 0) {
 
-  } else {
-    ts_recv_packet1(t, tsb, NULL);
-  } 
+      if(t->s_pat_section == NULL)
+	t->s_pat_section = calloc(1, sizeof(psi_section_t));
+      psi_section_reassemble(t->s_pat_section, tsb, 1, iptv_got_pat, t);
+
+    } else {
+
+      if(t->s_pmt_section == NULL)
+	t->s_pmt_section = calloc(1, sizeof(psi_section_t));
+      psi_section_reassemble(t->s_pmt_section, tsb, 1, iptv_got_pmt, t);
+    }
+  }
+
+  if(tsb > run)
+    ts_recv_packets(t, run, (tsb - run) / 188);
 }
 
 
@@ -124,7 +139,7 @@ iptv_ts_input(service_t *t, const uint8_t *tsb)
 static void *
 iptv_thread(void *aux)
 {
-  int nfds, fd, r, j, hlen;
+  int nfds, fd, r, hlen;
   uint8_t tsb[65536], *buf;
   struct epoll_event ev;
   service_t *t;
@@ -185,8 +200,7 @@ iptv_thread(void *aux)
       if(t->s_iptv_fd != fd)
 	continue;
       
-      for(j = 0; j < r; j += 188)
-	iptv_ts_input(t, buf + j);
+      iptv_ts_input(t, buf, r);
     }
     pthread_mutex_unlock(&iptv_recvmutex);
   }
@@ -22,6 +22,7 @@
 #include "redblack.h"
 #include "lang_codes.h"
 #include "lang_str.h"
+#include "strpool.h"
 
 /* ************************************************************************
  * Support
@@ -48,7 +49,7 @@ void lang_str_destroy ( lang_str_t *ls )
 { 
   lang_str_ele_t *e;
   while ((e = RB_FIRST(ls))) {
-    if (e->str)  free(e->str);
+    strpool_put(e->str);
     RB_REMOVE(ls, e, link);
     free(e);
   }
@@ -109,6 +110,9 @@ static int _lang_str_add
   int save = 0;
   static lang_str_ele_t *skel = NULL;
   lang_str_ele_t *e;
+  const char *old;
+  size_t len;
+  char *tmp;
 
   if (!str) return 0;
 
@@ -122,20 +126,27 @@ static int _lang_str_add
   /* Create */
   e = RB_INSERT_SORTED(ls, skel, link, _lang_cmp);
   if (!e) {
-    skel->str = strdup(str);
+    skel->str = strpool_get(str);
     skel = NULL;
     save = 1;
 
   /* Append */
   } else if (append) {
-    e->str = realloc(e->str, strlen(e->str) + strlen(str) + 1);
-    strcat(e->str, str);
+    old = e->str;
+    len = strlen(old);
+    tmp = malloc(len + strlen(str) + 1);
+    memcpy(tmp, old, len);
+    strcpy(tmp + len, str);
+    e->str = strpool_get(tmp);
+    strpool_put(old);
+    free(tmp);
     save = 1;
 
   /* Update */
   } else if (update && strcmp(str, e->str)) {
-    free(e->str);
-    e->str = strdup(str);
+    old    = e->str;
+    e->str = strpool_get(str);
+    strpool_put(old);
     save = 1;
   }
   
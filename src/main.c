@@ -48,6 +48,7 @@
 #include "serviceprobe.h"
 #include "cwc.h"
 #include "capmt.h"
+#include "tvhcsa.h"
 #include "dvr/dvr.h"
 #include "htsp_server.h"
 #include "rawtsinput.h"
@@ -459,6 +460,10 @@ main(int argc, char **argv)
 
   config_init();
 
+  packet_init();
+
+  streaming_init();
+
   service_init();
 
   channels_init();
@@ -494,6 +499,7 @@ main(int argc, char **argv)
 #if (!ENABLE_DVBCSA)
   ffdecsa_init();
 #endif
+  tvhcsa_init(config_get_descrambler_threads());
 #endif
 
   epggrab_init();
@@ -0,0 +1,281 @@
+/*
+ *  Per-thread cached object pools
+ *  Copyright (C) 2013
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+
+#include "mempool.h"
+
+#define MEMPOOL_MAX       16 /* Max number of pools */
+#define MEMPOOL_DEPOT_MAX 16 /* Max number of full magazines in a depot */
+
+/**
+ * Free objects are chained through their first word, the first object
+ * of a magazine in the depot links to the next magazine in its second
+ */
+#define MP_NEXT(p)     (((void **)(p))[0])
+#define MP_MAG_NEXT(p) (((void **)(p))[1])
+
+typedef struct mempool_cache {
+  void *mc_head;
+  int mc_count;
+  int mc_allocs;
+  int mc_frees;
+} mempool_cache_t;
+
+/**
+ * The caches of a thread, listed (in mempool_threads) so statistics
+ * can include what has not reached the depot yet
+ */
+typedef struct mempool_thread {
+  LIST_ENTRY(mempool_thread) mt_link;
+  mempool_cache_t mt_caches[MEMPOOL_MAX];
+} mempool_thread_t;
+
+static __thread mempool_thread_t mempool_thread;
+static __thread int mempool_thread_init;
+static LIST_HEAD(, mempool_thread) mempool_threads;
+static pthread_key_t mempool_key;
+static pthread_once_t mempool_once = PTHREAD_ONCE_INIT;
+static mempool_t *mempool_tab[MEMPOOL_MAX];
+static int mempool_num;
+
+struct mempool_list mempools;
+pthread_mutex_t mempools_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Account the statistics gathered by a thread cache
+ *
+ * mp_mutex must be held
+ */
+static void
+mempool_cache_sync(mempool_t *mp, mempool_cache_t *mc)
+{
+  mp->mp_allocs += mc->mc_allocs;
+  mp->mp_frees  += mc->mc_frees;
+  mc->mc_allocs = 0;
+  mc->mc_frees  = 0;
+}
+
+
+/**
+ * Hand the (full) magazine of a thread cache to the depot, or back to
+ * the system if the depot is full or the magazine is partial
+ */
+static void
+mempool_depot_put(mempool_t *mp, mempool_cache_t *mc)
+{
+  void *p, *next;
+  int n = 0;
+
+  pthread_mutex_lock(&mp->mp_mutex);
+  mempool_cache_sync(mp, mc);
+
+  if(mc->mc_count == mp->mp_magsize &&
+     mp->mp_depot_count < MEMPOOL_DEPOT_MAX) {
+    MP_MAG_NEXT(mc->mc_head) = mp->mp_depot;
+    mp->mp_depot = mc->mc_head;
+    mp->mp_depot_count++;
+  } else {
+    for(p = mc->mc_head; p != NULL; p = next) {
+      next = MP_NEXT(p);
+      free(p);
+      n++;
+    }
+    mp->mp_system -= n;
+  }
+  pthread_mutex_unlock(&mp->mp_mutex);
+
+  mc->mc_head = NULL;
+  mc->mc_count = 0;
+}
+
+
+/**
+ * Return all cached objects when a thread exits
+ */
+static void
+mempool_thread_exit(void *aux)
+{
+  mempool_thread_t *mt = aux;
+  mempool_cache_t *caches = mt->mt_caches;
+  int i;
+
+  pthread_mutex_lock(&mempools_mutex);
+  LIST_REMOVE(mt, mt_link);
+  pthread_mutex_unlock(&mempools_mutex);
+
+  for(i = 0; i < mempool_num; i++)
+    if(caches[i].mc_head != NULL || caches[i].mc_allocs || caches[i].mc_frees)
+      mempool_depot_put(mempool_tab[i], &caches[i]);
+}
+
+
+/**
+ * First use of any pool by the calling thread
+ */
+static void
+mempool_thread_register(void)
+{
+  pthread_setspecific(mempool_key, &mempool_thread);
+  pthread_mutex_lock(&mempools_mutex);
+  LIST_INSERT_HEAD(&mempool_threads, &mempool_thread, mt_link);
+  pthread_mutex_unlock(&mempools_mutex);
+  mempool_thread_init = 1;
+}
+
+
+/**
+ *
+ */
+static void
+mempool_key_init(void)
+{
+  pthread_key_create(&mempool_key, mempool_thread_exit);
+}
+
+
+/**
+ * Register a pool, must be called before any threads use it
+ */
+void
+mempool_init(mempool_t *mp, const char *name, size_t size)
+{
+  pthread_once(&mempool_once, mempool_key_init);
+
+  if(size < 2 * sizeof(void *))
+    size = 2 * sizeof(void *);
+
+  mp->mp_name = name;
+  mp->mp_size = size;
+  mp->mp_magsize = 65536 / size;
+  if(mp->mp_magsize > 64)
+    mp->mp_magsize = 64;
+  if(mp->mp_magsize < 4)
+    mp->mp_magsize = 4;
+
+  pthread_mutex_init(&mp->mp_mutex, NULL);
+  mp->mp_depot = NULL;
+  mp->mp_depot_count = 0;
+  mp->mp_allocs = 0;
+  mp->mp_frees = 0;
+  mp->mp_depot_hits = 0;
+  mp->mp_depot_misses = 0;
+  mp->mp_system = 0;
+
+  pthread_mutex_lock(&mempools_mutex);
+  assert(mempool_num < MEMPOOL_MAX);
+  mp->mp_id = mempool_num;
+  mempool_tab[mempool_num++] = mp;
+  LIST_INSERT_HEAD(&mempools, mp, mp_link);
+  pthread_mutex_unlock(&mempools_mutex);
+}
+
+
+/**
+ *
+ */
+void *
+mempool_alloc(mempool_t *mp)
+{
+  mempool_cache_t *mc = &mempool_thread.mt_caches[mp->mp_id];
+  void *p;
+
+  if(mc->mc_head == NULL) {
+    if(!mempool_thread_init)
+      mempool_thread_register();
+
+    pthread_mutex_lock(&mp->mp_mutex);
+    mempool_cache_sync(mp, mc);
+    if((p = mp->mp_depot) != NULL) {
+      mp->mp_depot = MP_MAG_NEXT(p);
+      mp->mp_depot_count--;
+      mp->mp_depot_hits++;
+      mc->mc_head = p;
+      mc->mc_count = mp->mp_magsize;
+    } else {
+      mp->mp_depot_misses++;
+      mp->mp_system++;
+    }
+    pthread_mutex_unlock(&mp->mp_mutex);
+
+    if(p == NULL) {
+      mc->mc_allocs++;
+      return malloc(mp->mp_size);
+    }
+  }
+
+  p = mc->mc_head;
+  mc->mc_head = MP_NEXT(p);
+  mc->mc_count--;
+  mc->mc_allocs++;
+  return p;
+}
+
+
+/**
+ *
+ */
+void
+mempool_free(mempool_t *mp, void *ptr)
+{
+  mempool_cache_t *mc = &mempool_thread.mt_caches[mp->mp_id];
+
+  if(mc->mc_count == mp->mp_magsize)
+    mempool_depot_put(mp, mc);
+
+  if(!mempool_thread_init)
+    mempool_thread_register();
+
+  MP_NEXT(ptr) = mc->mc_head;
+  mc->mc_head = ptr;
+  mc->mc_count++;
+  mc->mc_frees++;
+}
+
+
+/**
+ * Current statistics of a pool, including the counts of the thread
+ * caches. These are read while their threads keep using them, so the
+ * figures are approximate
+ *
+ * mempools_mutex must be held
+ */
+void
+mempool_get_stats(mempool_t *mp, mempool_stats_t *mps)
+{
+  mempool_thread_t *mt;
+  mempool_cache_t *mc;
+
+  pthread_mutex_lock(&mp->mp_mutex);
+  mps->mps_allocs  = mp->mp_allocs;
+  mps->mps_frees   = mp->mp_frees;
+  mps->mps_cached  = 0;
+  LIST_FOREACH(mt, &mempool_threads, mt_link) {
+    mc = &mt->mt_caches[mp->mp_id];
+    mps->mps_allocs += mc->mc_allocs;
+    mps->mps_frees  += mc->mc_frees;
+    mps->mps_cached += mc->mc_count;
+  }
+  mps->mps_system       = mp->mp_system;
+  mps->mps_depot        = mp->mp_depot_count * mp->mp_magsize;
+  mps->mps_depot_hits   = mp->mp_depot_hits;
+  mps->mps_depot_misses = mp->mp_depot_misses;
+  pthread_mutex_unlock(&mp->mp_mutex);
+}
@@ -0,0 +1,75 @@
+/*
+ *  Per-thread cached object pools
+ *  Copyright (C) 2013
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMPOOL_H
+#define MEMPOOL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include "queue.h"
+
+/**
+ * Pool of fixed size objects
+ *
+ * Each thread keeps a small cache (a magazine) of free objects per pool,
+ * so allocation and release normally do not touch any lock. Full and
+ * empty magazines are exchanged with a mutex protected depot, objects
+ * only go back to malloc() when the depot is full.
+ */
+LIST_HEAD(mempool_list, mempool);
+
+typedef struct mempool {
+  LIST_ENTRY(mempool) mp_link;
+  const char *mp_name;
+  size_t mp_size;      /* Object size */
+  int mp_id;           /* Index in the per-thread cache table */
+  int mp_magsize;      /* Objects per magazine */
+
+  pthread_mutex_t mp_mutex;
+  void *mp_depot;      /* Chain of full magazines */
+  int mp_depot_count;
+
+  /* Statistics, protected by mp_mutex, updated when magazines move
+     (see mempool_get_stats() for current figures) */
+  uint64_t mp_allocs;
+  uint64_t mp_frees;
+  uint64_t mp_depot_hits;
+  uint64_t mp_depot_misses;
+  int mp_system;       /* Objects currently malloc()ed by the pool */
+} mempool_t;
+
+typedef struct mempool_stats {
+  uint64_t mps_allocs;
+  uint64_t mps_frees;
+  int mps_system;
+  int mps_depot;       /* Objects in the depot */
+  int mps_cached;      /* Objects in thread caches */
+  uint64_t mps_depot_hits;
+  uint64_t mps_depot_misses;
+} mempool_stats_t;
+
+extern struct mempool_list mempools;
+extern pthread_mutex_t mempools_mutex;
+
+void mempool_init(mempool_t *mp, const char *name, size_t size);
+void *mempool_alloc(mempool_t *mp);
+void mempool_free(mempool_t *mp, void *ptr);
+
+void mempool_get_stats(mempool_t *mp, mempool_stats_t *mps);
+
+#endif /* MEMPOOL_H */
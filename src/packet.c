@@ -17,10 +17,46 @@
  */
 
 
+#include <assert.h>
+
 #include "tvheadend.h"
 #include "packet.h"
 #include "string.h"
 #include "atomic.h"
+#include "mempool.h"
+
+/**
+ * Size classes of pooled packet data, larger buffers use malloc()
+ */
+#define PKTBUF_CLASSES 4
+
+static const size_t pktbuf_class_size[PKTBUF_CLASSES] = {
+  256, 1024, 4096, 16384
+};
+
+static const char *pktbuf_class_name[PKTBUF_CLASSES] = {
+  "pktbuf data 256", "pktbuf data 1k", "pktbuf data 4k", "pktbuf data 16k"
+};
+
+static mempool_t pkt_pool;
+static mempool_t pktbuf_pool;
+static mempool_t pktbuf_data_pool[PKTBUF_CLASSES];
+
+/**
+ *
+ */
+void
+packet_init(void)
+{
+  int i;
+
+  mempool_init(&pkt_pool, "th_pkt_t", sizeof(th_pkt_t));
+  mempool_init(&pktbuf_pool, "pktbuf_t", sizeof(pktbuf_t));
+  for(i = 0; i < PKTBUF_CLASSES; i++)
+    mempool_init(&pktbuf_data_pool[i], pktbuf_class_name[i],
+                 pktbuf_class_size[i]);
+}
+
 
 /*
  *
@@ -33,7 +69,7 @@ pkt_destroy(th_pkt_t *pkt)
 
   if(pkt->pkt_header != NULL)
     pktbuf_ref_dec(pkt->pkt_header);
-  free(pkt);
+  mempool_free(&pkt_pool, pkt);
 }
 
 
@@ -46,7 +82,8 @@ pkt_alloc(const void *data, size_t datalen, int64_t pts, int64_t dts)
 {
   th_pkt_t *pkt;
 
-  pkt = calloc(1, sizeof(th_pkt_t));
+  pkt = mempool_alloc(&pkt_pool);
+  memset(pkt, 0, sizeof(th_pkt_t));
   if(datalen)
     pkt->pkt_payload = pktbuf_alloc(data, datalen);
   pkt->pkt_dts = dts;
@@ -137,7 +174,7 @@ pkt_merge_header(th_pkt_t *pkt)
   if(pkt->pkt_header == NULL)
     return pkt;
 
-  n = malloc(sizeof(th_pkt_t));
+  n = mempool_alloc(&pkt_pool);
   *n = *pkt;
 
   n->pkt_refcount = 1;
@@ -166,7 +203,7 @@ pkt_merge_header(th_pkt_t *pkt)
 th_pkt_t *
 pkt_copy_shallow(th_pkt_t *pkt)
 {
-  th_pkt_t *n = malloc(sizeof(th_pkt_t));
+  th_pkt_t *n = mempool_alloc(&pkt_pool);
   *n = *pkt;
 
   n->pkt_refcount = 1;
@@ -198,8 +235,13 @@ void
 pktbuf_ref_dec(pktbuf_t *pb)
 {
   if((atomic_add(&pb->pb_refcount, -1)) == 1) {
-    free(pb->pb_data);
-    free(pb);
+    if(pb->pb_parent != NULL)
+      pktbuf_ref_dec(pb->pb_parent);
+    else if(pb->pb_class >= 0)
+      mempool_free(&pktbuf_data_pool[pb->pb_class], pb->pb_data);
+    else
+      free(pb->pb_data);
+    mempool_free(&pktbuf_pool, pb);
   }
 }
 
@@ -212,12 +254,26 @@ pktbuf_ref_inc(pktbuf_t *pb)
 pktbuf_t *
 pktbuf_alloc(const void *data, size_t size)
 {
-  pktbuf_t *pb = malloc(sizeof(pktbuf_t));
+  pktbuf_t *pb = mempool_alloc(&pktbuf_pool);
+  int i;
+
   pb->pb_refcount = 1;
+  pb->pb_class = -1;
+  pb->pb_parent = NULL;
   pb->pb_size = size;
+  pb->pb_data = NULL;
 
   if(size > 0) {
-    pb->pb_data = malloc(size);
+    for(i = 0; i < PKTBUF_CLASSES; i++)
+      if(size <= pktbuf_class_size[i])
+        break;
+
+    if(i < PKTBUF_CLASSES) {
+      pb->pb_class = i;
+      pb->pb_data = mempool_alloc(&pktbuf_data_pool[i]);
+    } else {
+      pb->pb_data = malloc(size);
+    }
     if(data != NULL)
       memcpy(pb->pb_data, data, size);
   }
@@ -227,9 +283,34 @@ pktbuf_alloc(const void *data, size_t size)
 pktbuf_t *
 pktbuf_make(void *data, size_t size)
 {
-  pktbuf_t *pb = malloc(sizeof(pktbuf_t));
+  pktbuf_t *pb = mempool_alloc(&pktbuf_pool);
   pb->pb_refcount = 1;
+  pb->pb_class = -1;
+  pb->pb_parent = NULL;
   pb->pb_size = size;
   pb->pb_data = data;
   return pb;
 }
+
+/**
+ * Create a buffer referencing 'size' bytes at 'off' in 'pb' without
+ * copying, 'pb' is kept alive for as long as the slice is
+ */
+pktbuf_t *
+pktbuf_slice(pktbuf_t *pb, size_t off, size_t size)
+{
+  pktbuf_t *s = mempool_alloc(&pktbuf_pool);
+
+  assert(off + size <= pb->pb_size);
+
+  s->pb_refcount = 1;
+  s->pb_class = -1;
+  s->pb_data = pb->pb_data + off;
+  s->pb_size = size;
+
+  if(pb->pb_parent != NULL)
+    pb = pb->pb_parent;
+  pktbuf_ref_inc(pb);
+  s->pb_parent = pb;
+  return s;
+}
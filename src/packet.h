@@ -22,6 +22,8 @@
 
 typedef struct pktbuf {
   int pb_refcount;
+  int pb_class;      /* Data pool size class, -1 if pb_data is malloc()ed */
+  struct pktbuf *pb_parent; /* Set for slices, pb_data points into it */
   uint8_t *pb_data;
   size_t pb_size;
 } pktbuf_t;
@@ -72,6 +74,8 @@ typedef struct th_pktref {
 /**
  *
  */
+void packet_init(void);
+
 void pkt_ref_dec(th_pkt_t *pkt);
 
 void pkt_ref_inc(th_pkt_t *pkt);
@@ -102,6 +106,8 @@ pktbuf_t *pktbuf_alloc(const void *data, size_t size);
 
 pktbuf_t *pktbuf_make(void *data, size_t size);
 
+pktbuf_t *pktbuf_slice(pktbuf_t *pb, size_t off, size_t size);
+
 #define pktbuf_len(pb) ((pb)->pb_size)
 #define pktbuf_ptr(pb) ((pb)->pb_data)
 
@@ -123,6 +123,7 @@ service_stream_destroy(service_t *t, elementary_stream_t *es)
   avgstat_flush(&es->es_cc_errors);
 
   TAILQ_REMOVE(&t->s_components, es, es_link);
+  t->s_components_gen++;
   free(es->es_nicename);
   free(es);
 }
@@ -156,7 +157,10 @@ service_stop(service_t *t)
   TAILQ_FOREACH(st, &t->s_components, es_link)
     stream_clean(st);
 
-  sbuf_free(&t->s_tsbuf);
+  if(t->s_tsbuf != NULL) {
+    pktbuf_ref_dec(t->s_tsbuf);
+    t->s_tsbuf = NULL;
+  }
 
   t->s_status = SERVICE_IDLE;
 
@@ -500,7 +504,10 @@ service_destroy(service_t *t)
   free(t->s_pat_section);
   free(t->s_pmt_section);
 
-  sbuf_free(&t->s_tsbuf);
+  if(t->s_tsbuf != NULL) {
+    pktbuf_ref_dec(t->s_tsbuf);
+    t->s_tsbuf = NULL;
+  }
 
   avgstat_flush(&t->s_cc_errors);
   avgstat_flush(&t->s_rate);
@@ -537,7 +544,7 @@ service_create(const char *identifier, int type, int source_type)
   t->s_dvb_eit_enable = 1;
   TAILQ_INIT(&t->s_components);
 
-  sbuf_init(&t->s_tsbuf);
+  t->s_tsbuf = NULL;
 
   streaming_pad_init(&t->s_streaming_pad);
 
@@ -640,6 +647,7 @@ service_stream_create(service_t *t, int pid,
   st->es_type = type;
 
   TAILQ_INSERT_TAIL(&t->s_components, st, es_link);
+  t->s_components_gen++;
   st->es_service = t;
 
   st->es_pid = pid;
@@ -22,6 +22,7 @@
 #define PID_TELETEXT_BASE 0x2000
 
 #include "htsmsg.h"
+#include "packet.h"
 
 
 
@@ -284,6 +285,12 @@ typedef struct service {
    */
   struct th_dvb_mux_instance *s_dvb_mux_instance;
 
+  /**
+   * Value of s_components_gen when the adapter PID dispatch table
+   * was last built for this service (protected by tda_delivery_mutex)
+   */
+  int s_dvb_pid_dispatch_gen;
+
   /**
    * Unique identifer (used for storing on disk, etc)
    */
@@ -452,9 +459,10 @@ typedef struct service {
 
   /**
    * When a subscription request SMT_MPEGTS, chunk them togeather 
-   * in order to recude load.
+   * in order to recude load. The packets are collected directly in
+   * the pktbuf that is delivered.
    */
-  sbuf_t s_tsbuf;
+  pktbuf_t *s_tsbuf;
 
   /**
    * Average continuity errors
@@ -486,6 +494,13 @@ typedef struct service {
    */
   struct elementary_stream_queue s_components;
 
+  /**
+   * Bumped every time a component is added or removed. Input code
+   * that caches elementary_stream_t pointers use this to detect
+   * that the cached pointers are stale.
+   */
+  int s_components_gen;
+
 
   /**
    * Delivery pad, this is were we finally deliver all streaming output
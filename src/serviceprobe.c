@@ -136,7 +136,7 @@ serviceprobe_thread(void *aux)
         while((sm = TAILQ_FIRST(&sq.sq_queue)) == NULL)
           pthread_cond_wait(&sq.sq_cond, &sq.sq_mutex);
 
-        TAILQ_REMOVE(&sq.sq_queue, sm, sm_link);
+        streaming_queue_remove(&sq, sm);
 
         pthread_mutex_unlock(&sq.sq_mutex);
 
@@ -156,7 +156,7 @@ serviceprobe_thread(void *aux)
         pthread_mutex_lock(&sq.sq_mutex);
       }
 
-      streaming_queue_clear(&sq.sq_queue);
+      streaming_queue_flush(&sq);
       pthread_mutex_unlock(&sq.sq_mutex);
     } else {
       err = NULL;
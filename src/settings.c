@@ -319,8 +319,35 @@ hts_settings_open_file(int for_write, const char *pathfmt, ...)
   if (for_write)
     if (hts_settings_makedirs(path)) return -1;
 
-  /* Open file */
-  int flags = for_write ? O_CREAT | O_TRUNC | O_WRONLY : O_RDONLY;
+  /* Open file (for_write > 1 appends) */
+  int flags = for_write > 1 ? O_CREAT | O_APPEND | O_WRONLY :
+              for_write     ? O_CREAT | O_TRUNC  | O_WRONLY : O_RDONLY;
 
   return tvh_open(path, flags, 0700);
 }
+
+/**
+ *
+ */
+static void
+hts_settings_path(char *dst, size_t dstsize, const char *fmt, ...)
+{
+  va_list ap;
+
+  va_start(ap, fmt);
+  hts_settings_buildpath(dst, dstsize, fmt, ap, settingspath);
+  va_end(ap);
+}
+
+/**
+ * Replace the file "to" with "from", both relative to the settings root
+ */
+int
+hts_settings_rename(const char *from, const char *to)
+{
+  char frompath[256], topath[256];
+
+  hts_settings_path(frompath, sizeof(frompath), "%s", from);
+  hts_settings_path(topath,   sizeof(topath),   "%s", to);
+  return rename(frompath, topath);
+}
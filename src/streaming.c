@@ -16,14 +16,37 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/eventfd.h>
 
 #include "tvheadend.h"
 #include "streaming.h"
 #include "packet.h"
 #include "atomic.h"
 #include "service.h"
+#include "hts_strtab.h"
+#include "mempool.h"
 
+static mempool_t streaming_msg_pool;
+
+/**
+ *
+ */
+void
+streaming_init(void)
+{
+  mempool_init(&streaming_msg_pool, "streaming_message_t",
+               sizeof(streaming_message_t));
+}
+
+/**
+ *
+ */
 void
 streaming_pad_init(streaming_pad_t *sp)
 {
@@ -43,6 +66,107 @@ streaming_target_init(streaming_target_t *st, st_callback_t *cb, void *opaque,
 }
 
 
+/**
+ * Payload size of a message, as accounted in the queue size
+ */
+static size_t
+streaming_message_data_size(streaming_message_t *sm)
+{
+  th_pkt_t *pkt;
+  pktbuf_t *pb;
+
+  if(sm->sm_type == SMT_PACKET) {
+    pkt = sm->sm_data;
+    if(pkt && pkt->pkt_payload)
+      return pkt->pkt_payload->pb_size;
+  } else if(sm->sm_type == SMT_MPEGTS) {
+    pb = sm->sm_data;
+    if(pb)
+      return pb->pb_size;
+  }
+  return 0;
+}
+
+
+/**
+ * Return 1 if the message is a good point to resume a stream that
+ * has been dropping data
+ *
+ * Raw MPEG TS carries no frame information so such messages are
+ * always accepted as soon as there is room in the queue again
+ */
+static int
+streaming_message_is_keyframe(streaming_message_t *sm)
+{
+  th_pkt_t *pkt;
+
+  if(sm->sm_type != SMT_PACKET)
+    return 1;
+  pkt = sm->sm_data;
+  return pkt && pkt->pkt_frametype == PKT_I_FRAME;
+}
+
+
+/**
+ * sq_mutex must be held
+ */
+static void
+streaming_queue_insert(streaming_queue_t *sq, streaming_message_t *sm)
+{
+  TAILQ_INSERT_TAIL(&sq->sq_queue, sm, sm_link);
+  sq->sq_size += streaming_message_data_size(sm);
+  sq->sq_count++;
+}
+
+
+/**
+ * Apply the overflow policy, return 1 if the data message 'sm' should
+ * be queued, 0 if it should be dropped
+ *
+ * sq_mutex must be held
+ */
+static int
+streaming_queue_accept(streaming_queue_t *sq, streaming_message_t *sm)
+{
+  streaming_message_t *o, *next;
+
+  switch(sq->sq_overflow) {
+  case SQ_OVERFLOW_DROP_OLDEST:
+    /* A ring can only be popped by its consumer, drop newest instead */
+    if(sq->sq_ring != NULL)
+      return sq->sq_size < sq->sq_maxsize;
+    /* Control messages are kept, only data is thrown away */
+    for(o = TAILQ_FIRST(&sq->sq_queue);
+        o != NULL && sq->sq_size >= sq->sq_maxsize; o = next) {
+      next = TAILQ_NEXT(o, sm_link);
+      if(streaming_message_data_size(o) == 0)
+        continue;
+      streaming_queue_remove(sq, o);
+      streaming_msg_free(o);
+      sq->sq_drops++;
+    }
+    return 1;
+
+  case SQ_OVERFLOW_DROP_KEYFRAME:
+    if(sq->sq_size >= sq->sq_maxsize) {
+      sq->sq_dropping = 1;
+      return 0;
+    }
+    /* If the queue drained completely there is nothing to stay
+       consistent with, so resume even without a keyframe (radio) */
+    if(sq->sq_dropping && 
+       !streaming_message_is_keyframe(sm) && sq->sq_size > 0)
+      return 0;
+    sq->sq_dropping = 0;
+    return 1;
+
+  case SQ_OVERFLOW_DROP_NEWEST:
+  default:
+    return sq->sq_size < sq->sq_maxsize;
+  }
+}
+
+
 /**
  *
  */
@@ -53,20 +177,257 @@ streaming_queue_deliver(void *opauqe, streaming_message_t *sm)
 
   pthread_mutex_lock(&sq->sq_mutex);
 
-  /* queue size protection */
-  // TODO: would be better to update size as we go, but this would
-  //       require updates elsewhere to ensure all removals from the queue
-  //       are covered (new function)
-  if (sq->sq_maxsize && streaming_queue_size(&sq->sq_queue) >= sq->sq_maxsize)
+  /* queue size protection, control messages are never dropped */
+  if(sq->sq_maxsize && streaming_message_data_size(sm) &&
+     !streaming_queue_accept(sq, sm)) {
+    sq->sq_drops++;
     streaming_msg_free(sm);
-  else
-    TAILQ_INSERT_TAIL(&sq->sq_queue, sm, sm_link);
+  } else {
+    streaming_queue_insert(sq, sm);
+    pthread_cond_signal(&sq->sq_cond);
+  }
 
-  pthread_cond_signal(&sq->sq_cond);
   pthread_mutex_unlock(&sq->sq_mutex);
 }
 
 
+/**
+ * Number of ring slots kept free for control messages, data is dropped
+ * before it can eat into these
+ */
+#define SQ_RING_RESERVE 32
+
+/**
+ * Ring mode delivery, called by the (single) producer
+ */
+static void
+streaming_queue_ring_deliver(void *opauqe, streaming_message_t *sm)
+{
+  streaming_queue_t *sq = opauqe;
+  unsigned int head = sq->sq_ring_head;
+  unsigned int used = head - sq->sq_ring_tail;
+  size_t size = streaming_message_data_size(sm);
+  uint64_t one = 1;
+
+  if(size) {
+    if(used + SQ_RING_RESERVE > sq->sq_ring_mask ||
+       (sq->sq_maxsize && !streaming_queue_accept(sq, sm))) {
+      sq->sq_drops++;
+      streaming_msg_free(sm);
+      return;
+    }
+  } else if(used > sq->sq_ring_mask) {
+    tvhlog(LOG_ERR, "streaming",
+           "Queue ring full, control message %d lost", sm->sm_type);
+    sq->sq_drops++;
+    streaming_msg_free(sm);
+    return;
+  }
+
+  sq->sq_ring[head & sq->sq_ring_mask] = sm;
+  atomic_add_size(&sq->sq_size, size);
+  atomic_add(&sq->sq_count, 1);
+
+  /* Publish the slot before the new head */
+  __sync_synchronize();
+  sq->sq_ring_head = head + 1;
+
+  /* Pairs with the barrier in streaming_queue_ring_get() so either
+     we see the consumer sleeping or it sees the new head */
+  __sync_synchronize();
+  if(sq->sq_ring_sleeping)
+    if(write(sq->sq_ring_efd, &one, sizeof(one)) != sizeof(one))
+      tvhlog(LOG_ERR, "streaming", "Unable to wakeup queue consumer");
+}
+
+
+/**
+ * Pop up to 'max' messages from the ring, consumer only
+ */
+static int
+streaming_queue_ring_pop(streaming_queue_t *sq, streaming_message_t **vec,
+                         int max)
+{
+  unsigned int tail = sq->sq_ring_tail;
+  unsigned int head = sq->sq_ring_head;
+  size_t size = 0;
+  int n = 0;
+
+  __sync_synchronize();
+
+  while(tail != head && n < max) {
+    vec[n] = sq->sq_ring[tail & sq->sq_ring_mask];
+    size += streaming_message_data_size(vec[n]);
+    n++;
+    tail++;
+  }
+
+  if(n) {
+    atomic_add_size(&sq->sq_size, -size);
+    atomic_add(&sq->sq_count, -n);
+    /* Done reading the slots before handing them back */
+    __sync_synchronize();
+    sq->sq_ring_tail = tail;
+  }
+  return n;
+}
+
+
+/**
+ *
+ */
+static int
+streaming_queue_ring_get(streaming_queue_t *sq, streaming_message_t **vec,
+                         int max, int timeout)
+{
+  struct pollfd pfd;
+  uint64_t u64;
+  int n;
+
+  while(1) {
+    if((n = streaming_queue_ring_pop(sq, vec, max)) > 0)
+      return n;
+
+    sq->sq_ring_sleeping = 1;
+    __sync_synchronize();
+
+    /* Recheck, the producer might not have seen the flag */
+    if((n = streaming_queue_ring_pop(sq, vec, max)) > 0) {
+      sq->sq_ring_sleeping = 0;
+      return n;
+    }
+
+    pfd.fd = sq->sq_ring_efd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    n = poll(&pfd, 1, timeout);
+    sq->sq_ring_sleeping = 0;
+
+    if(n == 0)
+      return 0;
+    if(n > 0 && read(sq->sq_ring_efd, &u64, sizeof(u64)) < 0)
+      return 0;
+  }
+}
+
+
+/**
+ * Wait for messages and dequeue up to 'max' of them into 'vec'
+ *
+ * 'timeout' is in milliseconds, -1 waits forever. Returns the number of
+ * messages dequeued, 0 on timeout. Must be called without sq_mutex held
+ */
+int
+streaming_queue_get(streaming_queue_t *sq, streaming_message_t **vec,
+                    int max, int timeout)
+{
+  streaming_message_t *sm;
+  struct timespec ts;
+  struct timeval tp;
+  int n = 0;
+
+  if(sq->sq_ring != NULL)
+    return streaming_queue_ring_get(sq, vec, max, timeout);
+
+  pthread_mutex_lock(&sq->sq_mutex);
+
+  if(TAILQ_FIRST(&sq->sq_queue) == NULL) {
+    if(timeout < 0) {
+      while(TAILQ_FIRST(&sq->sq_queue) == NULL)
+        pthread_cond_wait(&sq->sq_cond, &sq->sq_mutex);
+    } else {
+      gettimeofday(&tp, NULL);
+      ts.tv_sec  = tp.tv_sec + timeout / 1000;
+      ts.tv_nsec = tp.tv_usec * 1000 + (timeout % 1000) * 1000000;
+      if(ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&sq->sq_cond, &sq->sq_mutex, &ts);
+    }
+  }
+
+  while(n < max && (sm = TAILQ_FIRST(&sq->sq_queue)) != NULL) {
+    streaming_queue_remove(sq, sm);
+    vec[n++] = sm;
+  }
+
+  pthread_mutex_unlock(&sq->sq_mutex);
+  return n;
+}
+
+
+/**
+ * Number of messages dropped since the last call, '*seen' holds the
+ * count the caller has already accounted for. Consumer side
+ */
+uint32_t
+streaming_queue_dropped(streaming_queue_t *sq, uint32_t *seen)
+{
+  uint32_t drops = sq->sq_drops, n = drops - *seen;
+
+  *seen = drops;
+  return n;
+}
+
+
+/**
+ * Unlink a message from the queue, keeping the size accounting correct
+ *
+ * sq_mutex must be held
+ */
+void
+streaming_queue_remove(streaming_queue_t *sq, streaming_message_t *sm)
+{
+  TAILQ_REMOVE(&sq->sq_queue, sm, sm_link);
+  sq->sq_size -= streaming_message_data_size(sm);
+  sq->sq_count--;
+}
+
+
+/**
+ * Free all queued messages
+ *
+ * sq_mutex must be held
+ */
+void
+streaming_queue_flush(streaming_queue_t *sq)
+{
+  streaming_message_t *vec[64];
+  int i, n;
+
+  if(sq->sq_ring != NULL)
+    while((n = streaming_queue_ring_pop(sq, vec, 64)) > 0)
+      for(i = 0; i < n; i++)
+        streaming_msg_free(vec[i]);
+
+  streaming_queue_clear(&sq->sq_queue);
+  sq->sq_size     = 0;
+  sq->sq_count    = 0;
+  sq->sq_dropping = 0;
+}
+
+
+/**
+ *
+ */
+static struct strtab sq_overflow_tab[] = {
+  { "newest",   SQ_OVERFLOW_DROP_NEWEST },
+  { "oldest",   SQ_OVERFLOW_DROP_OLDEST },
+  { "keyframe", SQ_OVERFLOW_DROP_KEYFRAME },
+};
+
+
+/**
+ *
+ */
+sq_overflow_t
+streaming_queue_overflow_txt2type(const char *str)
+{
+  return str2val_def(str, sq_overflow_tab, SQ_OVERFLOW_DROP_NEWEST);
+}
+
+
 /**
  *
  */
@@ -79,7 +440,45 @@ streaming_queue_init2(streaming_queue_t *sq, int reject_filter, size_t maxsize)
   pthread_cond_init(&sq->sq_cond, NULL);
   TAILQ_INIT(&sq->sq_queue);
 
-  sq->sq_maxsize = maxsize;
+  sq->sq_maxsize  = maxsize;
+  sq->sq_size     = 0;
+  sq->sq_count    = 0;
+  sq->sq_overflow = SQ_OVERFLOW_DROP_NEWEST;
+  sq->sq_dropping = 0;
+  sq->sq_drops    = 0;
+
+  sq->sq_ring          = NULL;
+  sq->sq_ring_mask     = 0;
+  sq->sq_ring_head     = 0;
+  sq->sq_ring_tail     = 0;
+  sq->sq_ring_sleeping = 0;
+  sq->sq_ring_efd      = -1;
+}
+
+/**
+ * Initialize a queue in ring mode, 'slots' is rounded up to a power
+ * of two. Falls back to a regular queue if no eventfd can be created
+ */
+void
+streaming_queue_init_ring(streaming_queue_t *sq, int reject_filter,
+                          size_t maxsize, int slots)
+{
+  unsigned int n = 2 * SQ_RING_RESERVE;
+
+  streaming_queue_init2(sq, reject_filter, maxsize);
+
+  if((sq->sq_ring_efd = eventfd(0, EFD_NONBLOCK)) < 0) {
+    tvhlog(LOG_ERR, "streaming", "Unable to create eventfd -- %s",
+           strerror(errno));
+    return;
+  }
+
+  while(n < slots)
+    n <<= 1;
+
+  sq->sq_ring      = calloc(n, sizeof(streaming_message_t *));
+  sq->sq_ring_mask = n - 1;
+  sq->sq_st.st_cb  = streaming_queue_ring_deliver;
 }
 
 /**
@@ -98,7 +497,11 @@ streaming_queue_init(streaming_queue_t *sq, int reject_filter)
 void
 streaming_queue_deinit(streaming_queue_t *sq)
 {
-  streaming_queue_clear(&sq->sq_queue);
+  streaming_queue_flush(sq);
+  if(sq->sq_ring_efd >= 0)
+    close(sq->sq_ring_efd);
+  free(sq->sq_ring);
+  sq->sq_ring = NULL;
   pthread_mutex_destroy(&sq->sq_mutex);
   pthread_cond_destroy(&sq->sq_cond);
 }
@@ -135,7 +538,7 @@ streaming_target_disconnect(streaming_pad_t *sp, streaming_target_t *st)
 streaming_message_t *
 streaming_msg_create(streaming_message_type_t type)
 {
-  streaming_message_t *sm = malloc(sizeof(streaming_message_t));
+  streaming_message_t *sm = mempool_alloc(&streaming_msg_pool);
   sm->sm_type = type;
   return sm;
 }
@@ -185,7 +588,7 @@ streaming_msg_create_code(streaming_message_type_t type, int code)
 streaming_message_t *
 streaming_msg_clone(streaming_message_t *src)
 {
-  streaming_message_t *dst = malloc(sizeof(streaming_message_t));
+  streaming_message_t *dst = mempool_alloc(&streaming_msg_pool);
   streaming_start_t *ss;
 
   dst->sm_type = src->sm_type;
@@ -287,7 +690,7 @@ streaming_msg_free(streaming_message_t *sm)
   default:
     abort();
   }
-  free(sm);
+  mempool_free(&streaming_msg_pool, sm);
 }
 
 /**
@@ -428,6 +831,9 @@ streaming_code2txt(int code)
   case SM_CODE_NO_INPUT:
     return "No input detected";
 
+  case SM_CODE_DATA_LOST:
+    return "Data lost, output too slow";
+
   default:
     snprintf(ret, sizeof(ret), "Unknown reason (%i)", code);
     return ret;
@@ -64,6 +64,8 @@ typedef struct streaming_start {
 /**
  *
  */
+void streaming_init(void);
+
 void streaming_pad_init(streaming_pad_t *sp);
 
 void streaming_target_init(streaming_target_t *st,
@@ -75,8 +77,22 @@ void streaming_queue_init(streaming_queue_t *sq, int reject_filter);
 void streaming_queue_init2
   (streaming_queue_t *sq, int reject_filter, size_t maxsize);
 
+void streaming_queue_init_ring
+  (streaming_queue_t *sq, int reject_filter, size_t maxsize, int slots);
+
+int streaming_queue_get(streaming_queue_t *sq, streaming_message_t **vec,
+                        int max, int timeout);
+
+uint32_t streaming_queue_dropped(streaming_queue_t *sq, uint32_t *seen);
+
 void streaming_queue_clear(struct streaming_message_queue *q);
 
+void streaming_queue_remove(streaming_queue_t *sq, streaming_message_t *sm);
+
+void streaming_queue_flush(streaming_queue_t *sq);
+
+sq_overflow_t streaming_queue_overflow_txt2type(const char *str);
+
 size_t streaming_queue_size(struct streaming_message_queue *q);
 
 void streaming_queue_deinit(streaming_queue_t *sq);
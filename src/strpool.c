@@ -0,0 +1,206 @@
+/*
+ *  Shared (interned) strings
+ *  Copyright (C) 2013
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "strpool.h"
+
+#define STRPOOL_MIN_SIZE 1024 /* Initial number of hash buckets */
+
+typedef struct strpool_entry {
+  struct strpool_entry *se_next;  /* Hash chain */
+  uint32_t se_hash;
+  uint32_t se_refs;
+  size_t se_len;
+  char se_str[0];
+} strpool_entry_t;
+
+#define SE(str) \
+  ((strpool_entry_t *)((char *)(str) - offsetof(strpool_entry_t, se_str)))
+
+static pthread_mutex_t strpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static strpool_entry_t **strpool_hash;
+static uint32_t strpool_size;  /* Buckets, a power of two */
+static strpool_stats_t strpool_stats;
+
+
+/**
+ *
+ */
+static uint32_t
+strpool_hashfn(const char *str, size_t len)
+{
+  uint32_t h = 2166136261U;
+  while(len--)
+    h = (h ^ (uint8_t)*str++) * 16777619U;
+  return h;
+}
+
+
+/**
+ * Double the number of buckets
+ *
+ * strpool_mutex must be held
+ */
+static void
+strpool_grow(void)
+{
+  strpool_entry_t **tab, *se;
+  uint32_t i, size = strpool_size ? strpool_size * 2 : STRPOOL_MIN_SIZE;
+
+  tab = calloc(size, sizeof(strpool_entry_t *));
+  for(i = 0; i < strpool_size; i++) {
+    while((se = strpool_hash[i]) != NULL) {
+      strpool_hash[i] = se->se_next;
+      se->se_next = tab[se->se_hash & (size - 1)];
+      tab[se->se_hash & (size - 1)] = se;
+    }
+  }
+  strpool_stats.sps_bytes += (size - strpool_size) * sizeof(*tab);
+  free(strpool_hash);
+  strpool_hash = tab;
+  strpool_size = size;
+}
+
+
+/**
+ *
+ */
+const char *
+strpool_getn(const char *str, size_t len)
+{
+  strpool_entry_t *se, **p;
+  uint32_t h;
+
+  if(str == NULL)
+    return NULL;
+
+  h = strpool_hashfn(str, len);
+
+  pthread_mutex_lock(&strpool_mutex);
+
+  if(strpool_size)
+    for(se = strpool_hash[h & (strpool_size - 1)]; se; se = se->se_next)
+      if(se->se_hash == h && se->se_len == len &&
+	 !memcmp(se->se_str, str, len)) {
+	se->se_refs++;
+	strpool_stats.sps_refs++;
+	strpool_stats.sps_saved += len + 1;
+	pthread_mutex_unlock(&strpool_mutex);
+	return se->se_str;
+      }
+
+  if(strpool_stats.sps_strings >= strpool_size)
+    strpool_grow();
+
+  se = malloc(sizeof(strpool_entry_t) + len + 1);
+  se->se_hash = h;
+  se->se_refs = 1;
+  se->se_len  = len;
+  memcpy(se->se_str, str, len);
+  se->se_str[len] = 0;
+
+  p = &strpool_hash[h & (strpool_size - 1)];
+  se->se_next = *p;
+  *p = se;
+
+  strpool_stats.sps_strings++;
+  strpool_stats.sps_refs++;
+  strpool_stats.sps_bytes += sizeof(strpool_entry_t) + len + 1;
+
+  pthread_mutex_unlock(&strpool_mutex);
+  return se->se_str;
+}
+
+
+/**
+ *
+ */
+const char *
+strpool_get(const char *str)
+{
+  return str ? strpool_getn(str, strlen(str)) : NULL;
+}
+
+
+/**
+ *
+ */
+const char *
+strpool_ref(const char *str)
+{
+  if(str == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&strpool_mutex);
+  SE(str)->se_refs++;
+  strpool_stats.sps_refs++;
+  strpool_stats.sps_saved += SE(str)->se_len + 1;
+  pthread_mutex_unlock(&strpool_mutex);
+  return str;
+}
+
+
+/**
+ *
+ */
+void
+strpool_put(const char *str)
+{
+  strpool_entry_t *se, **p;
+
+  if(str == NULL)
+    return;
+
+  se = SE(str);
+
+  pthread_mutex_lock(&strpool_mutex);
+  assert(se->se_refs > 0);
+  strpool_stats.sps_refs--;
+
+  if(--se->se_refs) {
+    strpool_stats.sps_saved -= se->se_len + 1;
+    pthread_mutex_unlock(&strpool_mutex);
+    return;
+  }
+
+  p = &strpool_hash[se->se_hash & (strpool_size - 1)];
+  while(*p != se)
+    p = &(*p)->se_next;
+  *p = se->se_next;
+
+  strpool_stats.sps_strings--;
+  strpool_stats.sps_bytes -= sizeof(strpool_entry_t) + se->se_len + 1;
+  pthread_mutex_unlock(&strpool_mutex);
+  free(se);
+}
+
+
+/**
+ *
+ */
+void
+strpool_get_stats(strpool_stats_t *sps)
+{
+  pthread_mutex_lock(&strpool_mutex);
+  *sps = strpool_stats;
+  pthread_mutex_unlock(&strpool_mutex);
+}
@@ -0,0 +1,62 @@
+/*
+ *  Shared (interned) strings
+ *  Copyright (C) 2013
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef STRPOOL_H
+#define STRPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Global pool of reference counted, immutable strings
+ *
+ * Equal strings share a single copy, which is freed when the last
+ * reference is dropped. Intended for the EPG, where the same titles,
+ * descriptions and so on are held by thousands of objects. Strings
+ * from the pool must never be modified or passed to free().
+ */
+typedef struct strpool_stats {
+  uint32_t sps_strings;  /* Distinct strings */
+  uint64_t sps_refs;     /* References held */
+  uint64_t sps_bytes;    /* Memory used, including headers */
+  uint64_t sps_saved;    /* Memory separate copies would have added */
+} strpool_stats_t;
+
+/**
+ * Get a reference to the pooled copy of str (NULL if str is NULL)
+ */
+const char *strpool_get(const char *str);
+
+/**
+ * As strpool_get(), for the first len bytes of str
+ */
+const char *strpool_getn(const char *str, size_t len);
+
+/**
+ * Get a further reference to a string returned by strpool_get()
+ */
+const char *strpool_ref(const char *str);
+
+/**
+ * Drop a reference (str may be NULL)
+ */
+void strpool_put(const char *str);
+
+void strpool_get_stats(strpool_stats_t *sps);
+
+#endif /* STRPOOL_H */
@@ -545,6 +545,8 @@ subscription_create_msg(th_subscription_t *s)
   htsmsg_add_u32(m, "id", s->ths_id);
   htsmsg_add_u32(m, "start", s->ths_start);
   htsmsg_add_u32(m, "errors", s->ths_total_err);
+  if(s->ths_output_sq != NULL)
+    htsmsg_add_u32(m, "drops", s->ths_output_sq->sq_drops);
 
   const char *state;
   switch(s->ths_state) {
@@ -57,6 +57,9 @@ typedef struct th_subscription {
 
   streaming_target_t *ths_output;
 
+  struct streaming_queue *ths_output_sq; /* Queue the output ends in, if
+					    any, for its drop count */
+
   int ths_flags;
 
   streaming_message_t *ths_start_message;
@@ -200,7 +200,7 @@ tcp_write_queue(int fd, htsbuf_queue_t *q)
  *
  */
 static int
-tcp_fill_htsbuf_from_fd(int fd, htsbuf_queue_t *hq)
+tcp_fill_htsbuf_from_fd(int fd, htsbuf_queue_t *hq, int flags)
 {
   htsbuf_data_t *hd = TAILQ_LAST(&hq->hq_q, htsbuf_data_queue);
   int c;
@@ -211,7 +211,9 @@ tcp_fill_htsbuf_from_fd(int fd, htsbuf_queue_t *hq)
 
     if(c > 0) {
 
-      c = read(fd, hd->hd_data + hd->hd_data_len, c);
+      c = recv(fd, hd->hd_data + hd->hd_data_len, c, flags);
+      if(c < 0 && (errno == EAGAIN || errno == EINTR))
+	return 0;
       if(c < 1)
 	return -1;
 
@@ -226,11 +228,11 @@ tcp_fill_htsbuf_from_fd(int fd, htsbuf_queue_t *hq)
   hd->hd_data_size = 1000;
   hd->hd_data = malloc(hd->hd_data_size);
 
-  c = read(fd, hd->hd_data, hd->hd_data_size);
+  c = recv(fd, hd->hd_data, hd->hd_data_size, flags);
   if(c < 1) {
     free(hd->hd_data);
     free(hd);
-    return -1;
+    return c < 0 && (errno == EAGAIN || errno == EINTR) ? 0 : -1;
   }
   hd->hd_data_len = c;
   hd->hd_data_off = 0;
@@ -240,6 +242,17 @@ tcp_fill_htsbuf_from_fd(int fd, htsbuf_queue_t *hq)
 }
 
 
+/**
+ * Append whatever is readable right now to 'spill' without blocking.
+ * Returns -1 if the peer closed the connection or on error
+ */
+int
+tcp_fill_spill(int fd, htsbuf_queue_t *spill)
+{
+  return tcp_fill_htsbuf_from_fd(fd, spill, MSG_DONTWAIT);
+}
+
+
 /**
  *
  */
@@ -252,7 +265,7 @@ tcp_read_line(int fd, char *buf, const size_t bufsize, htsbuf_queue_t *spill)
     len = htsbuf_find(spill, 0xa);
 
     if(len == -1) {
-      if(tcp_fill_htsbuf_from_fd(fd, spill) < 0)
+      if(tcp_fill_htsbuf_from_fd(fd, spill, 0) < 0)
 	return -1;
       continue;
     }
@@ -343,65 +356,349 @@ tcp_read_timeout(int fd, void *buf, size_t len, int timeout)
 
 }
 
-/**
+/* **************************************************************************
+ * Connection engine
  *
- */
-static int tcp_server_epoll_fd;
+ * Listening sockets are served by tcp_server_loop() which accepts new
+ * connections and hands them over to the reactor. The reactor owns one
+ * epoll set with all client sockets armed in one-shot mode, readiness is
+ * turned into work items that a small pool of worker threads picks up.
+ * A connection is never run by more than one worker at a time, so the
+ * input / output / stop callbacks of a connection are serialized.
+ *
+ * Handlers that are going to block for a long time (streaming, file
+ * downloads, long polls) call tcp_worker_detach() which makes the current
+ * thread leave the pool, a replacement worker is started in its place.
+ * ************************************************************************/
+
+#define TCP_WORKERS_MIN 4
+#define TCP_WORKERS_MAX 16
+
+#define TCP_EV_IN   0x1
+#define TCP_EV_OUT  0x2
+#define TCP_EV_WAKE 0x4
+#define TCP_EV_START 0x8
+
+typedef enum {
+  TCP_STATE_IDLE,     /* Armed in epoll, waiting for an event */
+  TCP_STATE_QUEUED,   /* On the work queue */
+  TCP_STATE_RUNNING,  /* A worker is running callbacks */
+  TCP_STATE_DEAD,     /* Closed, waiting to be reclaimed */
+} tcp_state_t;
 
 typedef struct tcp_server {
-  tcp_server_callback_t *start;
+  tcp_server_ops_t *ops;
   void *opaque;
   int serverfd;
 } tcp_server_t;
 
-typedef struct tcp_server_launch_t {
-  tcp_server_callback_t *start;
-  void *opaque;
-  int fd;
-  struct sockaddr_in peer;
-  struct sockaddr_in self;
-} tcp_server_launch_t;
+struct tcp_connection {
+  TAILQ_ENTRY(tcp_connection) tc_link;
+  tcp_server_ops_t *tc_ops;
+  void *tc_conn;
+  void *tc_opaque;        /* Server opaque, for the start callback */
+  int tc_fd;
+  tcp_state_t tc_state;
+  int tc_pending;         /* TCP_EV_ bits not yet handled */
+  int tc_want_output;     /* Output callback asked to be called again */
+  struct sockaddr_in tc_peer;
+  struct sockaddr_in tc_self;
+};
+
+TAILQ_HEAD(tcp_connection_queue, tcp_connection);
+
+static int tcp_server_epoll_fd;
+static int tcp_reactor_epoll_fd;
+
+static pthread_mutex_t tcp_work_mutex;
+static pthread_cond_t tcp_work_cond;
+static struct tcp_connection_queue tcp_work_queue;
+static struct tcp_connection_queue tcp_dead_queue;
+static int tcp_workers_target;
+static int tcp_workers_attached;
+
+static __thread int tcp_worker_self;
+static __thread int tcp_worker_detached;
+
+
+/**
+ * Put connection on the work queue, tcp_work_mutex must be held
+ */
+static void
+tcp_connection_schedule(tcp_connection_t *tc, int ev)
+{
+  tc->tc_pending |= ev;
+  if(tc->tc_state != TCP_STATE_IDLE)
+    return;
+  tc->tc_state = TCP_STATE_QUEUED;
+  TAILQ_INSERT_TAIL(&tcp_work_queue, tc, tc_link);
+  pthread_cond_signal(&tcp_work_cond);
+}
+
+
+/**
+ * Ask for the output callback of the connection to be invoked
+ */
+void
+tcp_connection_wakeup(tcp_connection_t *tc)
+{
+  pthread_mutex_lock(&tcp_work_mutex);
+  tcp_connection_schedule(tc, TCP_EV_WAKE);
+  pthread_mutex_unlock(&tcp_work_mutex);
+}
+
+
+/**
+ * Re-arm the connection in epoll, tcp_work_mutex must be held
+ */
+static void
+tcp_connection_arm(tcp_connection_t *tc)
+{
+  struct epoll_event e;
+
+  memset(&e, 0, sizeof(e));
+  e.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  if(tc->tc_want_output)
+    e.events |= EPOLLOUT;
+  e.data.ptr = tc;
+  tc->tc_state = TCP_STATE_IDLE;
+  epoll_ctl(tcp_reactor_epoll_fd, EPOLL_CTL_MOD, tc->tc_fd, &e);
+}
+
+
+/**
+ * Run callbacks for a connection picked up from the work queue
+ */
+static void
+tcp_connection_run(tcp_connection_t *tc, int ev)
+{
+  int r = 0;
+
+  if(ev & TCP_EV_START) {
+    /* Started here rather than in the accept thread as start callbacks
+       may take global_lock */
+    tc->tc_conn = tc->tc_ops->start(tc, tc->tc_fd, tc->tc_opaque,
+				    &tc->tc_peer, &tc->tc_self);
+    if(tc->tc_conn == NULL)
+      r = -1;
+  }
+
+  if(r >= 0 && ev & TCP_EV_IN)
+    r = tc->tc_ops->input(tc->tc_conn);
+
+  if(r >= 0 && tc->tc_ops->output != NULL &&
+     (ev & (TCP_EV_OUT | TCP_EV_WAKE) || tc->tc_want_output)) {
+    r = tc->tc_ops->output(tc->tc_conn);
+    tc->tc_want_output = r > 0;
+  }
+
+  if(r < 0) {
+    epoll_ctl(tcp_reactor_epoll_fd, EPOLL_CTL_DEL, tc->tc_fd, NULL);
+    if(tc->tc_conn != NULL)
+      tc->tc_ops->stop(tc->tc_conn);
+    close(tc->tc_fd);
+
+    /* The reactor may still hold an event referring to us, it will
+       reclaim the memory once it's safe to do so */
+    pthread_mutex_lock(&tcp_work_mutex);
+    tc->tc_state = TCP_STATE_DEAD;
+    TAILQ_INSERT_TAIL(&tcp_dead_queue, tc, tc_link);
+    pthread_mutex_unlock(&tcp_work_mutex);
+    return;
+  }
+
+  pthread_mutex_lock(&tcp_work_mutex);
+  if(tc->tc_pending) {
+    tc->tc_state = TCP_STATE_QUEUED;
+    TAILQ_INSERT_TAIL(&tcp_work_queue, tc, tc_link);
+  } else {
+    tcp_connection_arm(tc);
+  }
+  pthread_mutex_unlock(&tcp_work_mutex);
+}
 
 
 /**
  *
  */
 static void *
-tcp_server_start(void *aux)
+tcp_worker(void *aux)
 {
-  tcp_server_launch_t *tsl = aux;
+  tcp_connection_t *tc;
+  int ev;
+
+  tcp_worker_self = 1;
+
+  pthread_mutex_lock(&tcp_work_mutex);
+
+  while(1) {
+    if(tcp_worker_detached) {
+      /* A handler detached us from the pool, rejoin if there is room */
+      if(tcp_workers_attached >= tcp_workers_target)
+	break;
+      tcp_workers_attached++;
+      tcp_worker_detached = 0;
+    }
+
+    if((tc = TAILQ_FIRST(&tcp_work_queue)) == NULL) {
+      pthread_cond_wait(&tcp_work_cond, &tcp_work_mutex);
+      continue;
+    }
+    TAILQ_REMOVE(&tcp_work_queue, tc, tc_link);
+    tc->tc_state = TCP_STATE_RUNNING;
+    ev = tc->tc_pending;
+    tc->tc_pending = 0;
+    pthread_mutex_unlock(&tcp_work_mutex);
+
+    tcp_connection_run(tc, ev);
+
+    pthread_mutex_lock(&tcp_work_mutex);
+  }
+  pthread_mutex_unlock(&tcp_work_mutex);
+  return NULL;
+}
+
+
+/**
+ * Start another pool worker, tcp_work_mutex must be held
+ */
+static int
+tcp_worker_spawn(void)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
+  int r;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if((r = pthread_create(&tid, &attr, tcp_worker, NULL)) == 0)
+    tcp_workers_attached++;
+  pthread_attr_destroy(&attr);
+  return r;
+}
+
+
+/**
+ * Called by a connection handler that is about to block for a long time.
+ * The calling thread stops counting as a pool worker and a new worker is
+ * started so other connections are not starved
+ */
+void
+tcp_worker_detach(void)
+{
+  if(!tcp_worker_self || tcp_worker_detached)
+    return;
+
+  pthread_mutex_lock(&tcp_work_mutex);
+  tcp_worker_detached = 1;
+  tcp_workers_attached--;
+  if(tcp_workers_attached < tcp_workers_target)
+    tcp_worker_spawn();
+  pthread_mutex_unlock(&tcp_work_mutex);
+}
+
+
+/**
+ *
+ */
+static void *
+tcp_reactor_loop(void *aux)
+{
+  struct epoll_event ev[64];
+  tcp_connection_t *tc;
+  int r, i, bits;
+
+  while(1) {
+    pthread_mutex_lock(&tcp_work_mutex);
+    while((tc = TAILQ_FIRST(&tcp_dead_queue)) != NULL) {
+      TAILQ_REMOVE(&tcp_dead_queue, tc, tc_link);
+      free(tc);
+    }
+    pthread_mutex_unlock(&tcp_work_mutex);
+
+    r = epoll_wait(tcp_reactor_epoll_fd, ev, sizeof(ev) / sizeof(ev[0]),
+		   1000);
+    if(r == -1) {
+      if(errno != EINTR)
+	perror("tcp_reactor: epoll_wait");
+      continue;
+    }
+
+    pthread_mutex_lock(&tcp_work_mutex);
+    for(i = 0; i < r; i++) {
+      tc = ev[i].data.ptr;
+      if(tc->tc_state == TCP_STATE_DEAD)
+	continue;
+
+      bits = 0;
+      if(ev[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+	bits |= TCP_EV_IN;
+      if(ev[i].events & EPOLLOUT)
+	bits |= TCP_EV_OUT;
+      tcp_connection_schedule(tc, bits);
+    }
+    pthread_mutex_unlock(&tcp_work_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+tcp_server_start(tcp_server_t *ts, int fd, struct sockaddr_in *peer,
+		 struct sockaddr_in *self)
+{
+  tcp_connection_t *tc;
+  struct epoll_event e;
   struct timeval to;
   int val;
 
   val = 1;
-  setsockopt(tsl->fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &val, sizeof(val));
   
 #ifdef TCP_KEEPIDLE
   val = 30;
-  setsockopt(tsl->fd, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &val, sizeof(val));
 #endif
 
 #ifdef TCP_KEEPINVL
   val = 15;
-  setsockopt(tsl->fd, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &val, sizeof(val));
 #endif
 
 #ifdef TCP_KEEPCNT
   val = 5;
-  setsockopt(tsl->fd, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &val, sizeof(val));
 #endif
 
   val = 1;
-  setsockopt(tsl->fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
 
   to.tv_sec  = 30;
   to.tv_usec =  0;
-  setsockopt(tsl->fd, SOL_SOCKET, SO_SNDTIMEO, &to, sizeof(to));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &to, sizeof(to));
 
-  tsl->start(tsl->fd, tsl->opaque, &tsl->peer, &tsl->self);
-  free(tsl);
+  tc = calloc(1, sizeof(tcp_connection_t));
+  tc->tc_ops    = ts->ops;
+  tc->tc_opaque = ts->opaque;
+  tc->tc_fd     = fd;
+  tc->tc_peer   = *peer;
+  tc->tc_self   = *self;
+  tc->tc_state  = TCP_STATE_RUNNING;
 
-  return NULL;
+  memset(&e, 0, sizeof(e));
+  e.events = EPOLLONESHOT;
+  e.data.ptr = tc;
+  epoll_ctl(tcp_reactor_epoll_fd, EPOLL_CTL_ADD, fd, &e);
+
+  /* The first worker to pick it up starts the connection, data may
+     already be waiting too */
+  pthread_mutex_lock(&tcp_work_mutex);
+  tc->tc_state = TCP_STATE_IDLE;
+  tcp_connection_schedule(tc, TCP_EV_START | TCP_EV_IN);
+  pthread_mutex_unlock(&tcp_work_mutex);
 }
 
 
@@ -411,17 +708,12 @@ tcp_server_start(void *aux)
 static void *
 tcp_server_loop(void *aux)
 {
-  int r, i;
+  int r, i, fd;
   struct epoll_event ev[1];
   tcp_server_t *ts;
-  tcp_server_launch_t *tsl;
-  pthread_attr_t attr;
-  pthread_t tid;
+  struct sockaddr_in peer, self;
   socklen_t slen;
 
-  pthread_attr_init(&attr);
-  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
   while(1) {
     r = epoll_wait(tcp_server_epoll_fd, ev, sizeof(ev) / sizeof(ev[0]), -1);
     if(r == -1) {
@@ -439,29 +731,23 @@ tcp_server_loop(void *aux)
       }
 
       if(ev[i].events & EPOLLIN) {
-	tsl = malloc(sizeof(tcp_server_launch_t));
-	tsl->start  = ts->start;
-	tsl->opaque = ts->opaque;
 	slen = sizeof(struct sockaddr_in);
 
-	tsl->fd = accept(ts->serverfd, 
-			 (struct sockaddr *)&tsl->peer, &slen);
-	if(tsl->fd == -1) {
+	fd = accept(ts->serverfd, (struct sockaddr *)&peer, &slen);
+	if(fd == -1) {
 	  perror("accept");
-	  free(tsl);
 	  sleep(1);
 	  continue;
 	}
 
 
 	slen = sizeof(struct sockaddr_in);
-	if(getsockname(tsl->fd, (struct sockaddr *)&tsl->self, &slen)) {
-	    close(tsl->fd);
-	    free(tsl);
+	if(getsockname(fd, (struct sockaddr *)&self, &slen)) {
+	    close(fd);
 	    continue;
 	}
 
-	pthread_create(&tid, &attr, tcp_server_start, tsl);
+	tcp_server_start(ts, fd, &peer, &self);
       }
     }
   }
@@ -472,7 +758,7 @@ tcp_server_loop(void *aux)
  *
  */
 void *
-tcp_server_create(int port, tcp_server_callback_t *start, void *opaque)
+tcp_server_create(int port, tcp_server_ops_t *ops, void *opaque)
 {
   int fd, x;
   struct epoll_event e;
@@ -500,7 +786,7 @@ tcp_server_create(int port, tcp_server_callback_t *start, void *opaque)
 
   ts = malloc(sizeof(tcp_server_t));
   ts->serverfd = fd;
-  ts->start = start;
+  ts->ops = ops;
   ts->opaque = opaque;
 
   
@@ -518,9 +804,26 @@ void
 tcp_server_init(void)
 {
   pthread_t tid;
+  long ncpu;
 
   tcp_server_epoll_fd = epoll_create(10);
+  tcp_reactor_epoll_fd = epoll_create(256);
+
+  pthread_mutex_init(&tcp_work_mutex, NULL);
+  pthread_cond_init(&tcp_work_cond, NULL);
+  TAILQ_INIT(&tcp_work_queue);
+  TAILQ_INIT(&tcp_dead_queue);
+
+  ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  tcp_workers_target = MIN(MAX(ncpu, TCP_WORKERS_MIN), TCP_WORKERS_MAX);
+
+  pthread_mutex_lock(&tcp_work_mutex);
+  while(tcp_workers_attached < tcp_workers_target)
+    if(tcp_worker_spawn())
+      break;
+  pthread_mutex_unlock(&tcp_work_mutex);
+
+  pthread_create(&tid, NULL, tcp_reactor_loop, NULL);
   pthread_create(&tid, NULL, tcp_server_loop, NULL);
 }
 
-
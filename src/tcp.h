@@ -26,11 +26,37 @@ void tcp_server_init(void);
 int tcp_connect(const char *hostname, int port, char *errbuf,
 		size_t errbufsize, int timeout);
 
-typedef void (tcp_server_callback_t)(int fd, void *opaque,
-				     struct sockaddr_in *peer,
-				     struct sockaddr_in *self);
+typedef struct tcp_connection tcp_connection_t;
 
-void *tcp_server_create(int port, tcp_server_callback_t *start, void *opaque);
+/**
+ * Connection callbacks. All callbacks of one connection are serialized.
+ *
+ * start   Called for each accepted connection by the first worker that
+ *         picks it up, returns the per-connection state passed to the
+ *         other callbacks or NULL to reject
+ * input   Socket is readable (or closed), must not block waiting for
+ *         more data. Returns -1 to close the connection
+ * output  Socket is writable or tcp_connection_wakeup() was called.
+ *         Returns 0 when all output is done, 1 to be called again once
+ *         the socket is writable or -1 to close the connection. May be NULL
+ * stop    Connection is being closed, release everything. The socket
+ *         is closed by the caller
+ */
+typedef struct tcp_server_ops {
+  void *(*start)(tcp_connection_t *tc, int fd, void *opaque,
+		 struct sockaddr_in *peer, struct sockaddr_in *self);
+  int (*input)(void *conn);
+  int (*output)(void *conn);
+  void (*stop)(void *conn);
+} tcp_server_ops_t;
+
+void *tcp_server_create(int port, tcp_server_ops_t *ops, void *opaque);
+
+void tcp_connection_wakeup(tcp_connection_t *tc);
+
+void tcp_worker_detach(void);
+
+int tcp_fill_spill(int fd, htsbuf_queue_t *spill);
 
 int tcp_read(int fd, void *buf, size_t len);
 
@@ -63,17 +63,38 @@ got_section(const uint8_t *data, size_t len, void *opaque)
 }
 
 
+/**
+ * Return a mask (SMT_TO_MASK) of the packet types that any target
+ * connected to the service is interested in
+ *
+ * The set of targets can only change with s_stream_mutex held, so the
+ * result stays valid for as long as the caller keeps holding it.
+ */
+static int
+ts_probe(service_t *t)
+{
+  int probe = 0;
+
+  if(streaming_pad_probe_type(&t->s_streaming_pad, SMT_MPEGTS))
+    probe |= SMT_TO_MASK(SMT_MPEGTS);
+  if(streaming_pad_probe_type(&t->s_streaming_pad, SMT_PACKET))
+    probe |= SMT_TO_MASK(SMT_PACKET);
+  return probe;
+}
+
+
 /**
  * Continue processing of transport stream packets
  */
 static void
-ts_recv_packet0(service_t *t, elementary_stream_t *st, const uint8_t *tsb)
+ts_recv_packet0(service_t *t, elementary_stream_t *st, const uint8_t *tsb,
+                int probe)
 {
   int off, pusi, cc, error;
 
   service_set_streaming_status_flags(t, TSS_MUX_PACKETS);
 
-  if(streaming_pad_probe_type(&t->s_streaming_pad, SMT_MPEGTS))
+  if(probe & SMT_TO_MASK(SMT_MPEGTS))
     ts_remux(t, tsb);
 
   error = !!(tsb[1] & 0x80);
@@ -113,7 +134,7 @@ ts_recv_packet0(service_t *t, elementary_stream_t *st, const uint8_t *tsb)
     break;
 
   default:
-    if(!streaming_pad_probe_type(&t->s_streaming_pad, SMT_PACKET))
+    if(!(probe & SMT_TO_MASK(SMT_PACKET)))
       break;
 
     if(st->es_type == SCT_TELETEXT)
@@ -181,22 +202,18 @@ ts_extract_pcr(service_t *t, elementary_stream_t *st, const uint8_t *tsb,
 
 /**
  * Process service stream packets, extract PCR and optionally descramble
+ *
+ * s_stream_mutex must be held. Returns the number of bytes that should
+ * be accounted to the service bitrate
  */
-void
-ts_recv_packet1(service_t *t, const uint8_t *tsb, int64_t *pcrp)
+static int
+ts_recv_packet_locked(service_t *t, elementary_stream_t *st,
+                      const uint8_t *tsb, int64_t *pcrp, int probe)
 {
-  elementary_stream_t *st;
-  int pid, n, m, r;
+  int n, m, r;
   th_descrambler_t *td;
   int error = 0;
 
-  if(t->s_status != SERVICE_RUNNING)
-    return;
-
-  pthread_mutex_lock(&t->s_stream_mutex);
-
-  service_set_streaming_status_flags(t, TSS_INPUT_HARDWARE);
-
   if(tsb[1] & 0x80) {
     /* Transport Error Indicator */
     limitedlog(&t->s_loglimit_tei, "TS", service_nicename(t),
@@ -204,24 +221,16 @@ ts_recv_packet1(service_t *t, const uint8_t *tsb, int64_t *pcrp)
     error = 1;
   }
 
-  pid = (tsb[1] & 0x1f) << 8 | tsb[2];
-
-  st = service_stream_find(t, pid);
-
   /* Extract PCR */
   if(tsb[3] & 0x20 && tsb[4] > 0 && tsb[5] & 0x10 && !error)
     ts_extract_pcr(t, st, tsb, pcrp);
 
-  if(st == NULL) {
-    pthread_mutex_unlock(&t->s_stream_mutex);
-    return;
-  }
+  if(st == NULL)
+    return 0;
 
   if(!error)
     service_set_streaming_status_flags(t, TSS_INPUT_SERVICE);
 
-  avgstat_add(&t->s_rate, 188, dispatch_clock);
-
   if((tsb[3] & 0xc0) ||
       (t->s_scrambled_seen && st->es_type != SCT_CA &&
        st->es_type != SCT_PAT && st->es_type != SCT_PMT)) {
@@ -239,10 +248,8 @@ ts_recv_packet1(service_t *t, const uint8_t *tsb, int64_t *pcrp)
       n++;
       
       r = td->td_descramble(td, t, st, tsb);
-      if(r == 0) {
-	pthread_mutex_unlock(&t->s_stream_mutex);
-	return;
-      }
+      if(r == 0)
+	return 188;
 
       if(r == 1)
 	m++;
@@ -257,8 +264,107 @@ ts_recv_packet1(service_t *t, const uint8_t *tsb, int64_t *pcrp)
     }
 
   } else {
-    ts_recv_packet0(t, st, tsb);
+    ts_recv_packet0(t, st, tsb, probe);
+  }
+  return 188;
+}
+
+
+/**
+ * Process service stream packets, extract PCR and optionally descramble
+ */
+void
+ts_recv_packet1(service_t *t, const uint8_t *tsb, int64_t *pcrp)
+{
+  elementary_stream_t *st;
+  int pid;
+
+  if(t->s_status != SERVICE_RUNNING)
+    return;
+
+  pthread_mutex_lock(&t->s_stream_mutex);
+
+  service_set_streaming_status_flags(t, TSS_INPUT_HARDWARE);
+
+  pid = (tsb[1] & 0x1f) << 8 | tsb[2];
+  st = service_stream_find(t, pid);
+
+  if(ts_recv_packet_locked(t, st, tsb, pcrp, ts_probe(t)))
+    avgstat_add(&t->s_rate, 188, dispatch_clock);
+
+  pthread_mutex_unlock(&t->s_stream_mutex);
+}
+
+
+/**
+ * Process a contiguous buffer of 'n' transport stream packets
+ *
+ * Same as calling ts_recv_packet1() for each packet, but the stream
+ * mutex is only taken once and status flags, pad probing and
+ * bitrate statistics are only updated once per batch
+ */
+void
+ts_recv_packets(service_t *t, const uint8_t *tsb, int n)
+{
+  elementary_stream_t *st;
+  int i, pid, probe, bytes = 0;
+
+  if(t->s_status != SERVICE_RUNNING)
+    return;
+
+  pthread_mutex_lock(&t->s_stream_mutex);
+
+  service_set_streaming_status_flags(t, TSS_INPUT_HARDWARE);
+  probe = ts_probe(t);
+
+  for(i = 0; i < n; i++, tsb += 188) {
+    pid = (tsb[1] & 0x1f) << 8 | tsb[2];
+    st = service_stream_find(t, pid);
+    bytes += ts_recv_packet_locked(t, st, tsb, NULL, probe);
+  }
+
+  if(bytes)
+    avgstat_add(&t->s_rate, bytes, dispatch_clock);
+
+  pthread_mutex_unlock(&t->s_stream_mutex);
+}
+
+
+/**
+ * Same as ts_recv_packets() but for a vector of (not necessarily
+ * contiguous) packets whose elementary streams have already been
+ * resolved by the caller (from a PID dispatch table).
+ *
+ * The 'stv' entries are only trusted if the service components have
+ * not changed since they were looked up, ie. if 'gen' still equals
+ * s_components_gen, otherwise we fall back to a normal lookup.
+ */
+void
+ts_recv_packetv(service_t *t, const uint8_t **tsbv, 
+                elementary_stream_t **stv, int gen, int n)
+{
+  elementary_stream_t *st;
+  int i, probe, bytes = 0;
+
+  if(t->s_status != SERVICE_RUNNING)
+    return;
+
+  pthread_mutex_lock(&t->s_stream_mutex);
+
+  service_set_streaming_status_flags(t, TSS_INPUT_HARDWARE);
+  probe = ts_probe(t);
+
+  for(i = 0; i < n; i++) {
+    if(gen == t->s_components_gen)
+      st = stv[i];
+    else
+      st = service_stream_find(t, (tsbv[i][1] & 0x1f) << 8 | tsbv[i][2]);
+    bytes += ts_recv_packet_locked(t, st, tsbv[i], NULL, probe);
   }
+
+  if(bytes)
+    avgstat_add(&t->s_rate, bytes, dispatch_clock);
+
   pthread_mutex_unlock(&t->s_stream_mutex);
 }
 
@@ -273,7 +379,7 @@ ts_recv_packet2(service_t *t, const uint8_t *tsb)
   int pid = (tsb[1] & 0x1f) << 8 | tsb[2];
 
   if((st = service_stream_find(t, pid)) != NULL)
-    ts_recv_packet0(t, st, tsb);
+    ts_recv_packet0(t, st, tsb, ts_probe(t));
 }
 
 
@@ -284,15 +390,21 @@ static void
 ts_remux(service_t *t, const uint8_t *src)
 {
   streaming_message_t sm;
-  pktbuf_t *pb;
-  sbuf_t *sb = &t->s_tsbuf;
+  pktbuf_t *pb = t->s_tsbuf;
 
-  sbuf_append(sb, src, 188);
+  if(pb == NULL) {
+    pb = t->s_tsbuf = pktbuf_alloc(NULL, TS_REMUX_BUFSIZE);
+    pb->pb_size = 0;
+  }
+
+  memcpy(pb->pb_data + pb->pb_size, src, 188);
+  pb->pb_size += 188;
 
-  if(sb->sb_ptr < TS_REMUX_BUFSIZE) 
+  if(pb->pb_size < TS_REMUX_BUFSIZE) 
     return;
 
-  pb = pktbuf_alloc(sb->sb_data, sb->sb_ptr);
+  /* Hand over the buffer itself, a new one is started on next packet */
+  t->s_tsbuf = NULL;
 
   sm.sm_type = SMT_MPEGTS;
   sm.sm_data = pb;
@@ -301,8 +413,6 @@ ts_remux(service_t *t, const uint8_t *src)
   pktbuf_ref_dec(pb);
 
   service_set_streaming_status_flags(t, TSS_PACKETS);
-
-  sbuf_reset(sb);
 }
 
 /*
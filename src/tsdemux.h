@@ -23,6 +23,11 @@ int ts_resync ( const uint8_t *tsb, int *len, int *idx );
 
 void ts_recv_packet1(struct service *t, const uint8_t *tsb, int64_t *pcrp);
 
+void ts_recv_packets(struct service *t, const uint8_t *tsb, int n);
+
+void ts_recv_packetv(struct service *t, const uint8_t **tsbv,
+                     struct elementary_stream **stv, int gen, int n);
+
 void ts_recv_packet2(struct service *t, const uint8_t *tsb);
 
 #endif /* TSDEMUX_H */
@@ -617,7 +617,7 @@ tsm_thread(void *aux)
     sm = TAILQ_FIRST(&sq->sq_queue);
 
     if(sm != NULL)
-      TAILQ_REMOVE(&sq->sq_queue, sm, sm_link);
+      streaming_queue_remove(sq, sm);
 
     pthread_mutex_unlock(&sq->sq_mutex);
 
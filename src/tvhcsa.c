@@ -0,0 +1,487 @@
+/*
+ *  CSA descrambling, inline or on a pool of worker threads
+ *  Copyright (C) 2013
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tvheadend.h"
+#include "service.h"
+#include "tsdemux.h"
+#include "atomic.h"
+#include "tvhcsa.h"
+
+#if ENABLE_DVBCSA
+#include <dvbcsa/dvbcsa.h>
+#else
+#include "ffdecsa/FFdecsa.h"
+#endif
+
+#define TVHCSA_MAX_THREADS 64
+#define TVHCSA_QUEUE_MAX   256   /* Clusters waiting per worker */
+#define TVHCSA_DROP_REPORT 10    /* Seconds between overload warnings */
+
+#define TVHCSA_EVEN 0x1
+#define TVHCSA_ODD  0x2
+
+/**
+ * A full cluster of scrambled packets and the key changes that
+ * surround it
+ */
+typedef struct tvhcsa_job {
+  TAILQ_ENTRY(tvhcsa_job) cj_link;
+
+  tvhcsa_t *cj_csa;
+  service_t *cj_service;
+  int cj_fill;
+
+  uint8_t cj_cw_before[16];
+  int cj_cw_before_mask;
+  uint8_t cj_cw_after[16];
+  int cj_cw_after_mask;
+
+  uint8_t cj_tsb[0];
+} tvhcsa_job_t;
+
+TAILQ_HEAD(tvhcsa_job_queue, tvhcsa_job);
+
+/**
+ *
+ */
+typedef struct tvhcsa_worker {
+  pthread_t cw_tid;
+  pthread_mutex_t cw_mutex;
+  pthread_cond_t cw_cond;
+  struct tvhcsa_job_queue cw_jobs;
+  int cw_njobs;
+} tvhcsa_worker_t;
+
+/**
+ *
+ */
+struct tvhcsa {
+  int csa_refcount;
+  int csa_dead;       /* Descrambler stopped, protected by s_stream_mutex */
+  int csa_worker;     /* -1 = inline */
+  int csa_cluster_size;
+  uint32_t csa_drops;     /* Clusters dropped since last warning */
+  time_t csa_reported;
+
+  tvhcsa_job_t *csa_job;
+
+  /**
+   * Control words not yet taken into use
+   */
+  pthread_mutex_t csa_cw_mutex;
+  uint8_t csa_cw[16];
+  int csa_cw_mask;
+
+  /**
+   * Only touched by whoever runs the jobs, that is the input thread
+   * (inline) or the one worker this descrambler is bound to
+   */
+#if ENABLE_DVBCSA
+  struct dvbcsa_bs_key_s *csa_key_even;
+  struct dvbcsa_bs_key_s *csa_key_odd;
+  struct dvbcsa_bs_batch_s *csa_batch_even;
+  struct dvbcsa_bs_batch_s *csa_batch_odd;
+#else
+  void *csa_keys;
+#endif
+};
+
+static tvhcsa_worker_t *tvhcsa_workers;
+static int tvhcsa_nworkers;
+static int tvhcsa_next_worker;
+
+
+/**
+ *
+ */
+static void
+tvhcsa_unref(tvhcsa_t *csa)
+{
+  if(atomic_add(&csa->csa_refcount, -1) > 1)
+    return;
+
+  free(csa->csa_job);
+#if ENABLE_DVBCSA
+  dvbcsa_bs_key_free(csa->csa_key_odd);
+  dvbcsa_bs_key_free(csa->csa_key_even);
+  free(csa->csa_batch_odd);
+  free(csa->csa_batch_even);
+#else
+  free_key_struct(csa->csa_keys);
+#endif
+  pthread_mutex_destroy(&csa->csa_cw_mutex);
+  free(csa);
+}
+
+
+/**
+ * Move the pending control words into 'cw'
+ */
+static int
+tvhcsa_take_cw(tvhcsa_t *csa, uint8_t *cw)
+{
+  int mask;
+
+  pthread_mutex_lock(&csa->csa_cw_mutex);
+  mask = csa->csa_cw_mask;
+  if(mask)
+    memcpy(cw, csa->csa_cw, 16);
+  csa->csa_cw_mask = 0;
+  pthread_mutex_unlock(&csa->csa_cw_mutex);
+  return mask;
+}
+
+
+/**
+ * Put the key changes of a cluster that was never decrypted back in
+ * front of the pending ones
+ */
+static void
+tvhcsa_restore_cw(tvhcsa_t *csa, tvhcsa_job_t *cj)
+{
+  uint8_t cw[16];
+  int i, mask, bit;
+
+  pthread_mutex_lock(&csa->csa_cw_mutex);
+  mask = 0;
+  for(i = 0; i < 2; i++) {
+    bit = i ? TVHCSA_ODD : TVHCSA_EVEN;
+    if(csa->csa_cw_mask & bit)
+      memcpy(cw + i * 8, csa->csa_cw + i * 8, 8);
+    else if(cj->cj_cw_after_mask & bit)
+      memcpy(cw + i * 8, cj->cj_cw_after + i * 8, 8);
+    else if(cj->cj_cw_before_mask & bit)
+      memcpy(cw + i * 8, cj->cj_cw_before + i * 8, 8);
+    else
+      continue;
+    mask |= bit;
+  }
+  memcpy(csa->csa_cw, cw, 16);
+  csa->csa_cw_mask = mask;
+  pthread_mutex_unlock(&csa->csa_cw_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+tvhcsa_apply_cw(tvhcsa_t *csa, const uint8_t *cw, int mask)
+{
+#if ENABLE_DVBCSA
+  if(mask & TVHCSA_EVEN)
+    dvbcsa_bs_key_set(cw, csa->csa_key_even);
+  if(mask & TVHCSA_ODD)
+    dvbcsa_bs_key_set(cw + 8, csa->csa_key_odd);
+#else
+  if(mask & TVHCSA_EVEN)
+    set_even_control_word(csa->csa_keys, cw);
+  if(mask & TVHCSA_ODD)
+    set_odd_control_word(csa->csa_keys, cw + 8);
+#endif
+}
+
+
+/**
+ * Decrypt a cluster in place
+ */
+#if ENABLE_DVBCSA
+static void
+tvhcsa_decrypt(tvhcsa_t *csa, uint8_t *tsb, int fill)
+{
+  uint8_t *pkt;
+  int i, xc0, len, offset;
+  int fill_even = 0, fill_odd = 0;
+
+  for(i = 0, pkt = tsb; i < fill; i++, pkt += 188) {
+    xc0 = pkt[3] & 0xc0;
+    if(xc0 != 0x80 && xc0 != 0xc0)
+      continue; // clear or reserved
+
+    pkt[3] &= 0x3f;  // consider it decrypted now
+    if(pkt[3] & 0x20) { // incomplete packet
+      offset = 4 + pkt[4] + 1;
+      len = 188 - offset;
+      if((len >> 3) == 0)
+        continue; // decrypted==encrypted!
+    } else {
+      len = 184;
+      offset = 4;
+    }
+
+    if(xc0 == 0x80) {
+      csa->csa_batch_even[fill_even].data = pkt + offset;
+      csa->csa_batch_even[fill_even].len = len;
+      fill_even++;
+    } else {
+      csa->csa_batch_odd[fill_odd].data = pkt + offset;
+      csa->csa_batch_odd[fill_odd].len = len;
+      fill_odd++;
+    }
+  }
+
+  if(fill_even) {
+    csa->csa_batch_even[fill_even].data = NULL;
+    dvbcsa_bs_decrypt(csa->csa_key_even, csa->csa_batch_even, 184);
+  }
+  if(fill_odd) {
+    csa->csa_batch_odd[fill_odd].data = NULL;
+    dvbcsa_bs_decrypt(csa->csa_key_odd, csa->csa_batch_odd, 184);
+  }
+}
+#else
+static void
+tvhcsa_decrypt(tvhcsa_t *csa, uint8_t *tsb, int fill)
+{
+  unsigned char *vec[3];
+
+  vec[0] = tsb;
+  vec[1] = tsb + fill * 188;
+  vec[2] = NULL;
+
+  while(decrypt_packets(csa->csa_keys, vec) > 0)
+    ;
+}
+#endif
+
+
+/**
+ *
+ */
+static void
+tvhcsa_process(tvhcsa_job_t *cj)
+{
+  tvhcsa_t *csa = cj->cj_csa;
+
+  tvhcsa_apply_cw(csa, cj->cj_cw_before, cj->cj_cw_before_mask);
+  tvhcsa_decrypt(csa, cj->cj_tsb, cj->cj_fill);
+  tvhcsa_apply_cw(csa, cj->cj_cw_after, cj->cj_cw_after_mask);
+}
+
+
+/**
+ *
+ */
+static void
+tvhcsa_reinject(tvhcsa_job_t *cj)
+{
+  const uint8_t *tsb = cj->cj_tsb;
+  int i;
+
+  for(i = 0; i < cj->cj_fill; i++, tsb += 188)
+    ts_recv_packet2(cj->cj_service, tsb);
+}
+
+
+/**
+ *
+ */
+static void *
+tvhcsa_thread(void *aux)
+{
+  tvhcsa_worker_t *cw = aux;
+  tvhcsa_job_t *cj;
+  service_t *t;
+
+  pthread_mutex_lock(&cw->cw_mutex);
+  while(1) {
+    while((cj = TAILQ_FIRST(&cw->cw_jobs)) == NULL)
+      pthread_cond_wait(&cw->cw_cond, &cw->cw_mutex);
+    TAILQ_REMOVE(&cw->cw_jobs, cj, cj_link);
+    cw->cw_njobs--;
+    pthread_mutex_unlock(&cw->cw_mutex);
+
+    tvhcsa_process(cj);
+
+    t = cj->cj_service;
+    pthread_mutex_lock(&t->s_stream_mutex);
+    if(!cj->cj_csa->csa_dead && t->s_status == SERVICE_RUNNING)
+      tvhcsa_reinject(cj);
+    pthread_mutex_unlock(&t->s_stream_mutex);
+
+    tvhcsa_unref(cj->cj_csa);
+    service_unref(t);
+    free(cj);
+
+    pthread_mutex_lock(&cw->cw_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static void
+tvhcsa_submit(tvhcsa_t *csa, tvhcsa_job_t *cj)
+{
+  tvhcsa_worker_t *cw = &tvhcsa_workers[csa->csa_worker];
+
+  pthread_mutex_lock(&cw->cw_mutex);
+  if(cw->cw_njobs >= TVHCSA_QUEUE_MAX) {
+    pthread_mutex_unlock(&cw->cw_mutex);
+    csa->csa_drops++;
+    if(dispatch_clock - csa->csa_reported >= TVHCSA_DROP_REPORT) {
+      tvhlog(LOG_WARNING, "csa",
+             "%s: descrambler workers overloaded, %u clusters dropped",
+             cj->cj_service->s_svcname, csa->csa_drops);
+      csa->csa_drops = 0;
+      csa->csa_reported = dispatch_clock;
+    }
+    tvhcsa_restore_cw(csa, cj);
+    free(cj);
+    return;
+  }
+  service_ref(cj->cj_service);
+  atomic_add(&csa->csa_refcount, 1);
+  TAILQ_INSERT_TAIL(&cw->cw_jobs, cj, cj_link);
+  cw->cw_njobs++;
+  pthread_cond_signal(&cw->cw_cond);
+  pthread_mutex_unlock(&cw->cw_mutex);
+}
+
+
+/**
+ *
+ */
+void
+tvhcsa_descramble(tvhcsa_t *csa, service_t *t, const uint8_t *tsb)
+{
+  tvhcsa_job_t *cj = csa->csa_job;
+
+  if(cj == NULL) {
+    cj = csa->csa_job = malloc(sizeof(tvhcsa_job_t) +
+                               csa->csa_cluster_size * 188);
+    cj->cj_csa = csa;
+    cj->cj_fill = 0;
+  }
+
+  if(cj->cj_fill == 0) {
+    cj->cj_service = t;
+    cj->cj_cw_before_mask = tvhcsa_take_cw(csa, cj->cj_cw_before);
+  }
+
+  memcpy(cj->cj_tsb + cj->cj_fill * 188, tsb, 188);
+  if(++cj->cj_fill != csa->csa_cluster_size)
+    return;
+
+  cj->cj_cw_after_mask = tvhcsa_take_cw(csa, cj->cj_cw_after);
+
+  if(csa->csa_worker < 0) {
+    tvhcsa_process(cj);
+    tvhcsa_reinject(cj);
+    cj->cj_fill = 0;
+  } else {
+    csa->csa_job = NULL;
+    tvhcsa_submit(csa, cj);
+  }
+}
+
+
+/**
+ *
+ */
+void
+tvhcsa_set_cw(tvhcsa_t *csa, const uint8_t *even, const uint8_t *odd)
+{
+  pthread_mutex_lock(&csa->csa_cw_mutex);
+  if(even != NULL) {
+    memcpy(csa->csa_cw, even, 8);
+    csa->csa_cw_mask |= TVHCSA_EVEN;
+  }
+  if(odd != NULL) {
+    memcpy(csa->csa_cw + 8, odd, 8);
+    csa->csa_cw_mask |= TVHCSA_ODD;
+  }
+  pthread_mutex_unlock(&csa->csa_cw_mutex);
+}
+
+
+/**
+ *
+ */
+tvhcsa_t *
+tvhcsa_create(void)
+{
+  tvhcsa_t *csa = calloc(1, sizeof(tvhcsa_t));
+
+  csa->csa_refcount = 1;
+  pthread_mutex_init(&csa->csa_cw_mutex, NULL);
+#if ENABLE_DVBCSA
+  csa->csa_cluster_size = dvbcsa_bs_batch_size();
+  csa->csa_batch_even   = malloc((csa->csa_cluster_size + 1) *
+                                 sizeof(struct dvbcsa_bs_batch_s));
+  csa->csa_batch_odd    = malloc((csa->csa_cluster_size + 1) *
+                                 sizeof(struct dvbcsa_bs_batch_s));
+  csa->csa_key_even     = dvbcsa_bs_key_alloc();
+  csa->csa_key_odd      = dvbcsa_bs_key_alloc();
+#else
+  csa->csa_cluster_size = get_suggested_cluster_size();
+  csa->csa_keys         = get_key_struct();
+#endif
+
+  if(tvhcsa_nworkers > 0)
+    csa->csa_worker =
+      (unsigned int)atomic_add(&tvhcsa_next_worker, 1) % tvhcsa_nworkers;
+  else
+    csa->csa_worker = -1;
+  return csa;
+}
+
+
+/**
+ * s_stream_mutex is held. Clusters already handed to a worker are
+ * decrypted but never reinjected
+ */
+void
+tvhcsa_destroy(tvhcsa_t *csa)
+{
+  csa->csa_dead = 1;
+  tvhcsa_unref(csa);
+}
+
+
+/**
+ *
+ */
+void
+tvhcsa_init(int threads)
+{
+  int i;
+  tvhcsa_worker_t *cw;
+
+  if(threads <= 0)
+    return;
+  if(threads > TVHCSA_MAX_THREADS)
+    threads = TVHCSA_MAX_THREADS;
+
+  tvhcsa_workers = calloc(threads, sizeof(tvhcsa_worker_t));
+  for(i = 0; i < threads; i++) {
+    cw = &tvhcsa_workers[i];
+    pthread_mutex_init(&cw->cw_mutex, NULL);
+    pthread_cond_init(&cw->cw_cond, NULL);
+    TAILQ_INIT(&cw->cw_jobs);
+    pthread_create(&cw->cw_tid, NULL, tvhcsa_thread, cw);
+  }
+  tvhcsa_nworkers = threads;
+  tvhlog(LOG_INFO, "csa", "Using %d descrambler threads", threads);
+}
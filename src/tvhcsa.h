@@ -0,0 +1,52 @@
+/*
+ *  CSA descrambling, inline or on a pool of worker threads
+ *  Copyright (C) 2013
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TVHCSA_H__
+#define TVHCSA_H__
+
+#include <stdint.h>
+
+struct service;
+
+typedef struct tvhcsa tvhcsa_t;
+
+/**
+ * Start the descrambler workers, 'threads' == 0 keeps descrambling
+ * inline in the input threads
+ */
+void tvhcsa_init(int threads);
+
+tvhcsa_t *tvhcsa_create(void);
+
+/**
+ * s_stream_mutex of the service being descrambled must be held
+ */
+void tvhcsa_destroy(tvhcsa_t *csa);
+
+/**
+ * Queue new control words, they are taken into use at the next cluster
+ * boundary. Pass NULL to keep the current even or odd key
+ */
+void tvhcsa_set_cw(tvhcsa_t *csa, const uint8_t *even, const uint8_t *odd);
+
+/**
+ * s_stream_mutex must be held
+ */
+void tvhcsa_descramble(tvhcsa_t *csa, struct service *t, const uint8_t *tsb);
+
+#endif /* TVHCSA_H__ */
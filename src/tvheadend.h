@@ -305,6 +305,8 @@ typedef enum {
 #define SM_CODE_NO_ACCESS                 401
 #define SM_CODE_NO_INPUT                  402
 
+#define SM_CODE_DATA_LOST                 500
+
 /**
  * Streaming messages are sent from the pad to its receivers
  */
@@ -333,6 +335,15 @@ typedef struct streaming_target {
 } streaming_target_t;
 
 
+/**
+ * What to do when a size limited streaming queue is full
+ */
+typedef enum {
+  SQ_OVERFLOW_DROP_NEWEST,   /* Drop the message being delivered */
+  SQ_OVERFLOW_DROP_OLDEST,   /* Drop queued messages from the head */
+  SQ_OVERFLOW_DROP_KEYFRAME, /* Drop until the next video keyframe */
+} sq_overflow_t;
+
 /**
  *
  */
@@ -344,9 +355,30 @@ typedef struct streaming_queue {
   pthread_cond_t  sq_cond;     /* Condvar for signalling new packets */
 
   size_t          sq_maxsize;  /* Max queue size (bytes) */
+  size_t          sq_size;     /* Current payload size (bytes) */
+  int             sq_count;    /* Current number of messages */
+
+  sq_overflow_t   sq_overflow; /* Policy when sq_maxsize is reached */
+  int             sq_dropping; /* Set while dropping until a keyframe */
+  uint32_t        sq_drops;    /* Number of dropped messages */
   
   struct streaming_message_queue sq_queue;
 
+  /**
+   * Ring mode (streaming_queue_init_ring())
+   *
+   * Messages are passed through a single producer / single consumer
+   * ring without taking sq_mutex. Producers must be serialized by the
+   * caller (they are, by s_stream_mutex or tda_delivery_mutex) and
+   * messages must only be read using streaming_queue_get()
+   */
+  streaming_message_t **sq_ring;      /* NULL when not in ring mode */
+  unsigned int          sq_ring_mask; /* Number of slots - 1 */
+  volatile unsigned int sq_ring_head; /* Written by producer only */
+  volatile unsigned int sq_ring_tail; /* Written by consumer only */
+  volatile int          sq_ring_sleeping; /* Consumer waits on sq_ring_efd */
+  int                   sq_ring_efd;
+
 } streaming_queue_t;
 
 
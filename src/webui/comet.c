@@ -30,6 +30,7 @@
 
 #include "tvheadend.h"
 #include "http.h"
+#include "tcp.h"
 #include "webui/webui.h"
 #include "access.h"
 
@@ -184,6 +185,9 @@ comet_mailbox_poll(http_connection_t *hc, const char *remain, void *opaque)
   struct timespec ts;
   htsmsg_t *m;
 
+  /* Long poll, don't tie up a connection worker */
+  tcp_worker_detach();
+
   if(!im)
     usleep(100000); /* Always sleep 0.1 sec to avoid comet storms */
 
@@ -1925,6 +1925,8 @@ extjs_config(http_connection_t *hc, const char *remain, void *opaque)
       save |= config_set_muxconfpath(str);
     if ((str = http_arg_get(&hc->hc_req_args, "language")))
       save |= config_set_language(str);
+    if ((str = http_arg_get(&hc->hc_req_args, "descrambler_threads")))
+      save |= config_set_descrambler_threads(atoi(str));
     if (save) config_save();
     pthread_mutex_unlock(&global_lock);
     out = htsmsg_create_map();
@@ -158,6 +158,8 @@ extjs_dvbadapter(http_connection_t *hc, const char *remain, void *opaque)
     htsmsg_add_u32(r, "nitoid", tda->tda_nitoid);
     htsmsg_add_u32(r, "disable_pmt_monitor", tda->tda_disable_pmt_monitor);
     htsmsg_add_u32(r, "full_mux_rx", tda->tda_full_mux_rx+1);
+    htsmsg_add_u32(r, "read_size", tda->tda_read_size);
+    htsmsg_add_u32(r, "read_adaptive", tda->tda_read_adaptive);
     htsmsg_add_str(r, "diseqcversion", 
 		   ((const char *[]){"DiSEqC 1.0 / 2.0",
 				       "DiSEqC 1.1 / 2.1"})
@@ -203,6 +205,12 @@ extjs_dvbadapter(http_connection_t *hc, const char *remain, void *opaque)
     s = http_arg_get(&hc->hc_req_args, "full_mux_rx");
     dvb_adapter_set_full_mux_rx(tda, atoi(s)-1);
 
+    if((s = http_arg_get(&hc->hc_req_args, "read_size")) != NULL)
+      dvb_adapter_set_read_size(tda, atoi(s));
+
+    s = http_arg_get(&hc->hc_req_args, "read_adaptive");
+    dvb_adapter_set_read_adaptive(tda, !!s);
+
     if((s = http_arg_get(&hc->hc_req_args, "nitoid")) != NULL)
       dvb_adapter_set_nitoid(tda, atoi(s));
 
@@ -30,6 +30,8 @@
 #include "epg.h"
 #include "psi.h"
 #include "channels.h"
+#include "mempool.h"
+#include "strpool.h"
 #if ENABLE_LINUXDVB
 #include "dvr/dvr.h"
 #include "dvb/dvb.h"
@@ -76,6 +78,55 @@ dumpchannels(htsbuf_queue_t *hq)
   }
 }
 
+
+static void
+dumpmempools(htsbuf_queue_t *hq)
+{
+  mempool_t *mp;
+  mempool_stats_t mps;
+  outputtitle(hq, 0, "Memory pools");
+
+  htsbuf_qprintf(hq, "%-22s %6s %12s %10s %8s %8s %8s %12s %10s\n",
+		 "Name", "Size", "Allocs", "In use", "System",
+		 "Depot", "Cached", "Depot hits", "Misses");
+
+  pthread_mutex_lock(&mempools_mutex);
+  LIST_FOREACH(mp, &mempools, mp_link) {
+    mempool_get_stats(mp, &mps);
+    htsbuf_qprintf(hq, "%-22s %6zu %12"PRIu64" %10"PRId64" %8d %8d %8d"
+		   " %12"PRIu64" %10"PRIu64"\n",
+		   mp->mp_name,
+		   mp->mp_size,
+		   mps.mps_allocs,
+		   (int64_t)(mps.mps_allocs - mps.mps_frees),
+		   mps.mps_system,
+		   mps.mps_depot,
+		   mps.mps_cached,
+		   mps.mps_depot_hits,
+		   mps.mps_depot_misses);
+  }
+  pthread_mutex_unlock(&mempools_mutex);
+}
+
+
+static void
+dumpstrpool(htsbuf_queue_t *hq)
+{
+  strpool_stats_t sps;
+  outputtitle(hq, 0, "String pool");
+
+  strpool_get_stats(&sps);
+  htsbuf_qprintf(hq,
+		 "  strings = %u\n"
+		 "  references = %"PRIu64"\n"
+		 "  memory used = %"PRIu64" bytes\n"
+		 "  memory saved = %"PRIu64" bytes\n",
+		 sps.sps_strings,
+		 sps.sps_refs,
+		 sps.sps_bytes,
+		 sps.sps_saved);
+}
+
 #if ENABLE_LINUXDVB
 static void
 dumptransports(htsbuf_queue_t *hq, struct service_list *l, int indent)
@@ -182,6 +233,10 @@ page_statedump(http_connection_t *hc, const char *remain, void *opaque)
 		 tvh_binshasum[19]);
 
   dumpchannels(hq);
+
+  dumpmempools(hq);
+
+  dumpstrpool(hq);
   
 #if ENABLE_LINUXDVB
   dumpdvbadapters(hq);
@@ -37,7 +37,7 @@ tvheadend.miscconf = function() {
 	 */
 	var confreader = new Ext.data.JsonReader({
 		root : 'config'
-	}, [ 'muxconfpath', 'language' ]);
+	}, [ 'muxconfpath', 'language', 'descrambler_threads' ]);
 
 	/* ****************************************************************
 	 * Form Fields
@@ -50,6 +50,16 @@ tvheadend.miscconf = function() {
 		width: 400
 	});
 
+	var descramblerThreads = new Ext.form.NumberField({
+		fieldLabel : 'Descrambler threads',
+		name : 'descrambler_threads',
+		allowNegative : false,
+		allowDecimals : false,
+		minValue : 0,
+		maxValue : 64,
+		width : 50
+	});
+
 	var language = new Ext.ux.ItemSelector({
 		name: 'language',
 		fromStore: tvheadend.languages,
@@ -95,7 +105,7 @@ tvheadend.miscconf = function() {
 		layout : 'form',
 		defaultType : 'textfield',
 		autoHeight : true,
-		items : [ language, dvbscanPath ],
+		items : [ language, dvbscanPath, descramblerThreads ],
 		tbar : [ saveButton, '->', helpButton ]
 	});
 
@@ -1094,7 +1094,8 @@ tvheadend.dvb_adapter_general = function(adapterData, satConfStore) {
 	}, [ 'name', 'automux', 'skip_initialscan', 'idlescan', 'diseqcversion',
 		'diseqcrepeats', 'qmon', 'skip_checksubscr', 
 		'poweroff', 'sidtochan', 'nitoid', 'extrapriority',
-		,'disable_pmt_monitor', 'full_mux_rx', 'idleclose' ]);
+		,'disable_pmt_monitor', 'full_mux_rx', 'idleclose',
+		'read_size', 'read_adaptive' ]);
 
 	function saveConfForm() {
 		confform.getForm().submit({
@@ -1164,7 +1165,15 @@ tvheadend.dvb_adapter_general = function(adapterData, satConfStore) {
 			fieldLabel : 'Extra priority',
 			name : 'extrapriority',
 			width : 50
-		} ];
+		}, {
+			fieldLabel : 'DVR read size (bytes, 0 = default)',
+			name : 'read_size',
+			width : 80
+		},
+		new Ext.form.Checkbox({
+			fieldLabel : 'Adaptive DVR read size',
+			name : 'read_adaptive'
+		}) ];
 
 	if (satConfStore) {
 		v = new Ext.form.ComboBox({
@@ -1246,6 +1255,8 @@ tvheadend.dvb_adapter_general = function(adapterData, satConfStore) {
 			+ '<h3>Signal Strength:</h3>{signal}%'
 			+ '<h3>Bit Error Rate:</h3>{ber}/s'
 			+ '<h3>Uncorrected Bit Errors:</h3>{uncavg}/s'
+			+ '<h3>DVR read size:</h3>{readSize} bytes'
+			+ '<h3>DVR input:</h3>{packetRate} packets/s, {syscallRate} syscalls/s'
         );
 
 	var infoPanel = new Ext.Panel({
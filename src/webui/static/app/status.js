@@ -22,6 +22,8 @@ tvheadend.status_subs = function() {
 			name : 'state'
 		}, {
 			name : 'errors'
+		}, {
+			name : 'drops'
 		}, {
 			name : 'bw'
 		}, {
@@ -51,6 +53,7 @@ tvheadend.status_subs = function() {
 			r.data.service  = m.service;
 			r.data.state    = m.state;
 			r.data.errors   = m.errors;
+			r.data.drops    = m.drops;
 			r.data.bw       = m.bw
 
 			tvheadend.subsStore.afterEdit(r);
@@ -109,6 +112,11 @@ tvheadend.status_subs = function() {
 		id : 'errors',
 		header : "Errors",
 		dataIndex : 'errors'
+	}, {
+		width : 50,
+		id : 'drops',
+		header : "Dropped",
+		dataIndex : 'drops'
 	}, {
 		width : 50,
 		id : 'bw',
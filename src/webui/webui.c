@@ -34,6 +34,7 @@
 #include "tvheadend.h"
 #include "access.h"
 #include "http.h"
+#include "tcp.h"
 #include "webui.h"
 #include "dvr/dvr.h"
 #include "filebundle.h"
@@ -49,6 +50,17 @@
 
 #define ATOI(x, y) x ? atoi(x) : y;
 
+/**
+ * Streaming queue, ring slots and max number of messages per dequeue
+ */
+#define HTTP_STREAM_SLOTS 16384
+#define HTTP_STREAM_BATCH 32
+
+/**
+ * Min interval (seconds) between reports of data lost to a full queue
+ */
+#define HTTP_STREAM_DROP_REPORT 10
+
 
 /**
  *
@@ -161,15 +173,20 @@ static void
 http_stream_run(http_connection_t *hc, streaming_queue_t *sq,
 		const char *name, muxer_container_type_t mc)
 {
-  streaming_message_t *sm;
+  streaming_message_t *sm, *smv[HTTP_STREAM_BATCH];
+  int idx = 0, num = 0;
   int run = 1;
   int started = 0;
   muxer_t *mux = NULL;
   int timeouts = 0;
-  struct timespec ts;
   struct timeval  tp;
   int err = 0;
   socklen_t errlen = sizeof(err);
+  uint32_t seen = 0, drops = 0;
+  time_t reported = 0;
+
+  /* We stay here for as long as the client is watching */
+  tcp_worker_detach();
 
   mux = muxer_create(mc);
   if(muxer_open_stream(mux, hc->hc_fd))
@@ -181,14 +198,20 @@ http_stream_run(http_connection_t *hc, streaming_queue_t *sq,
   setsockopt(hc->hc_fd, SOL_SOCKET, SO_SNDTIMEO, &tp, sizeof(tp));
 
   while(run) {
-    pthread_mutex_lock(&sq->sq_mutex);
-    sm = TAILQ_FIRST(&sq->sq_queue);
-    if(sm == NULL) {      
-      gettimeofday(&tp, NULL);
-      ts.tv_sec  = tp.tv_sec + 1;
-      ts.tv_nsec = tp.tv_usec * 1000;
-
-      if(pthread_cond_timedwait(&sq->sq_cond, &sq->sq_mutex, &ts) == ETIMEDOUT) {
+    if(idx == num) {
+      idx = 0;
+      num = streaming_queue_get(sq, smv, HTTP_STREAM_BATCH, 1000);
+
+      /* The queue overflowed, the client doesn't keep up */
+      drops += streaming_queue_dropped(sq, &seen);
+      if(drops && dispatch_clock - reported >= HTTP_STREAM_DROP_REPORT) {
+	tvhlog(LOG_WARNING, "webui",  "Streaming %s, %u packets dropped, %s",
+	       hc->hc_url_orig, drops, streaming_code2txt(SM_CODE_DATA_LOST));
+	drops = 0;
+	reported = dispatch_clock;
+      }
+
+      if(num == 0) {
           timeouts++;
 
           //Check socket status
@@ -200,14 +223,13 @@ http_stream_run(http_connection_t *hc, streaming_queue_t *sq,
 	    tvhlog(LOG_WARNING, "webui",  "Stop streaming %s, timeout waiting for packets", hc->hc_url_orig);
 	    run = 0;
           }
+          continue;
       }
-      pthread_mutex_unlock(&sq->sq_mutex);
-      continue;
+
+      timeouts = 0; //Reset timeout counter
     }
 
-    timeouts = 0; //Reset timeout counter
-    TAILQ_REMOVE(&sq->sq_queue, sm, sm_link);
-    pthread_mutex_unlock(&sq->sq_mutex);
+    sm = smv[idx++];
 
     switch(sm->sm_type) {
     case SMT_MPEGTS:
@@ -271,6 +293,9 @@ http_stream_run(http_connection_t *hc, streaming_queue_t *sq,
     }
   }
 
+  while(idx < num)
+    streaming_msg_free(smv[idx++]);
+
   if(started)
     muxer_close(mux);
 
@@ -561,6 +586,7 @@ http_stream_service(http_connection_t *hc, service_t *service)
   int flags;
   const char *str;
   size_t qsize;
+  sq_overflow_t overflow;
   const char *name;
 
   mc = muxer_container_txt2type(http_arg_get(&hc->hc_req_args, "mux"));
@@ -574,22 +600,28 @@ http_stream_service(http_connection_t *hc, service_t *service)
   else
     qsize = 1500000;
 
+  overflow = streaming_queue_overflow_txt2type
+    (http_arg_get(&hc->hc_req_args, "qoverflow"));
+
   if(mc == MC_PASS) {
-    streaming_queue_init2(&sq, SMT_PACKET, qsize);
+    streaming_queue_init_ring(&sq, SMT_PACKET, qsize, HTTP_STREAM_SLOTS);
     gh = NULL;
     tsfix = NULL;
     st = &sq.sq_st;
     flags = SUBSCRIPTION_RAW_MPEGTS;
   } else {
-    streaming_queue_init2(&sq, 0, qsize);
+    streaming_queue_init_ring(&sq, 0, qsize, HTTP_STREAM_SLOTS);
     gh = globalheaders_create(&sq.sq_st);
     tsfix = tsfix_create(gh);
     st = tsfix;
     flags = 0;
   }
 
+  sq.sq_overflow = overflow;
+
   s = subscription_create_from_service(service, "HTTP", st, flags);
   if(s) {
+    s->ths_output_sq = &sq;
     name = strdupa(service->s_ch ?
                    service->s_ch->ch_name : service->s_nicename);
     pthread_mutex_unlock(&global_lock);
@@ -620,9 +652,10 @@ http_stream_tdmi(http_connection_t *hc, th_dvb_mux_instance_t *tdmi)
   th_subscription_t *s;
   streaming_queue_t sq;
   const char *name;
-  streaming_queue_init(&sq, SMT_PACKET);
+  streaming_queue_init_ring(&sq, SMT_PACKET, 0, HTTP_STREAM_SLOTS);
 
   s = dvb_subscription_create_from_tdmi(tdmi, "HTTP", &sq.sq_st);
+  s->ths_output_sq = &sq;
   name = strdupa(tdmi->tdmi_identifier);
   pthread_mutex_unlock(&global_lock);
   http_stream_run(hc, &sq, name, MC_PASS);
@@ -653,6 +686,7 @@ http_stream_channel(http_connection_t *hc, channel_t *ch)
   muxer_container_type_t mc;
   char *str;
   size_t qsize;
+  sq_overflow_t overflow;
   const char *name;
 
 #if ENABLE_TRANSCODING
@@ -686,14 +720,17 @@ http_stream_channel(http_connection_t *hc, channel_t *ch)
   else
     qsize = 1500000;
 
+  overflow = streaming_queue_overflow_txt2type
+    (http_arg_get(&hc->hc_req_args, "qoverflow"));
+
   if(mc == MC_PASS) {
-    streaming_queue_init2(&sq, SMT_PACKET, qsize);
+    streaming_queue_init_ring(&sq, SMT_PACKET, qsize, HTTP_STREAM_SLOTS);
     gh = NULL;
     tsfix = NULL;
     st = &sq.sq_st;
     flags = SUBSCRIPTION_RAW_MPEGTS;
   } else {
-    streaming_queue_init2(&sq, 0, qsize);
+    streaming_queue_init_ring(&sq, 0, qsize, HTTP_STREAM_SLOTS);
     gh = globalheaders_create(&sq.sq_st);
 #if ENABLE_TRANSCODING
     if(transcode) {
@@ -706,12 +743,15 @@ http_stream_channel(http_connection_t *hc, channel_t *ch)
     flags = 0;
   }
 
+  sq.sq_overflow = overflow;
+
   s = subscription_create_from_channel(ch, priority, "HTTP", st, flags,
 				       inet_ntoa(hc->hc_peer->sin_addr),
 				       hc->hc_username,
 				       http_arg_get(&hc->hc_args, "User-Agent"));
 
   if(s) {
+    s->ths_output_sq = &sq;
     name = strdupa(ch->ch_name);
     pthread_mutex_unlock(&global_lock);
     http_stream_run(hc, &sq, name, mc);